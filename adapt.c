@@ -0,0 +1,138 @@
+#include "adapt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TO_MIN 300	  // ms, floor of the derived timeout
+#define TO_MARGIN 4	  // derived timeout is this many times p99 ...
+#define TO_MAX_MUL 2  // ... and at least this many times the slowest op seen
+#define ERR_SHRINK 2  // errors per window that make a smaller chunk worth measuring
+#define GAIN_MIN 1.03 // goodput gain that is worth a change of the chunk
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+uint32_t adapt_percentile(const adapt_t *a, uint32_t pct)
+{
+	uint32_t n = a->lat_cnt < ADAPT_HIST ? a->lat_cnt : ADAPT_HIST;
+	if(!n) return 0;
+	uint32_t tmp[ADAPT_HIST];
+	memcpy(tmp, a->lat, n * sizeof(uint32_t));
+	qsort(tmp, n, sizeof(uint32_t), cmp_u32);
+	return tmp[(n - 1) * pct / 100];
+}
+
+static uint32_t level_chunk(const adapt_t *a, uint32_t level)
+{
+	uint32_t hdr = a->aligned ? DFU_DNLOAD_HDR : 0;
+	uint64_t c = ((uint64_t)(a->chunk_min + hdr) << level) - hdr;
+	return c > a->chunk_max ? a->chunk_max : (uint32_t)c;
+}
+
+/**
+ * \brief Start from the smallest chunk with the default timeout, the chunk
+ * grows while goodput does, then moves to a neighbour size that delivers more:
+ * a smaller one is tried when the link starts failing, a bigger one after
+ * clean windows, so random loss that costs every size alike doesn't shrink it
+ */
+void adapt_init(adapt_t *a, dfu_queue_t *q, dfu_src_image_t *src, const dfu_caps_t *caps)
+{
+	memset(a, 0, sizeof(*a));
+	a->q = q;
+	a->src = src;
+	a->aligned = caps->transfer_size && caps->ep0_size;
+	a->chunk_max = dfu_chunk_size(caps, 0);
+	a->chunk_min = a->aligned ? 2U * caps->ep0_size - DFU_DNLOAD_HDR : 64;
+	if(a->chunk_min > a->chunk_max) a->chunk_min = a->chunk_max;
+	a->levels = 1;
+	while(a->levels < ADAPT_LEVELS && level_chunk(a, a->levels - 1) < a->chunk_max)
+		a->levels++;
+	a->ramp = true;
+	if(src)
+	{
+		src->chunk = a->chunk_min;
+		q->max_len = a->chunk_max;
+	}
+	q->timeout_ms = DFU_DNLOAD_TO;
+}
+
+static void adapt_timeout(adapt_t *a)
+{
+	uint32_t to = adapt_percentile(a, 99) * TO_MARGIN / 1000;
+	if(to < a->lat_max * TO_MAX_MUL / 1000) to = a->lat_max * TO_MAX_MUL / 1000;
+	if(to < TO_MIN) to = TO_MIN;
+	if(to > DFU_DNLOAD_TO) to = DFU_DNLOAD_TO;
+	a->q->timeout_ms = to;
+}
+
+static void adapt_chunk(adapt_t *a)
+{
+	uint32_t l = a->level, prev = l;
+	double g = a->win_us ? (double)a->win_bytes / (double)a->win_us : 0;
+	a->goodput[l] = (a->measured & (1U << l)) ? a->goodput[l] * 0.75 + g * 0.25 : g;
+	a->measured |= 1U << l;
+
+	if(!a->ramp && ++a->age >= ADAPT_STALE) a->measured = 1U << l; // the link may have changed since the neighbours were measured
+	bool has_down = l > 0, has_up = l + 1 < a->levels;
+	bool down_known = has_down && (a->measured & (1U << (l - 1))), up_known = has_up && (a->measured & (1U << (l + 1)));
+	double cur = a->goodput[l], down = down_known ? a->goodput[l - 1] : 0, up = up_known ? a->goodput[l + 1] : 0;
+	if(a->ramp)
+	{
+		if(has_up && (!down_known || cur > down * GAIN_MIN)) l++;
+		else
+		{
+			a->ramp = false;
+			if(down > cur) l--;
+		}
+	}
+	else if(up > cur * GAIN_MIN && up >= down) l++;
+	else if(down > cur * GAIN_MIN) l--;
+	else if(has_down && !down_known && a->win_errs >= ERR_SHRINK) l--;
+	else if(has_up && !up_known && !a->win_errs) l++;
+
+	if(l != prev)
+	{
+		a->level = l;
+		a->age = 0;
+		a->src->chunk = level_chunk(a, l);
+	}
+}
+
+void adapt_done(void *arg, const dfu_op_t *op, int sts, uint32_t latency_us)
+{
+	adapt_t *a = arg;
+	a->ops++;
+	if(sts < 0)
+	{
+		a->errs++;
+		a->win_errs++;
+		if(sts == LIBUSB_ERROR_TIMEOUT) // might be a slow erase: back off to the safe value
+		{
+			a->timeouts++;
+			a->q->timeout_ms = a->q->timeout_ms * 2 > DFU_DNLOAD_TO ? DFU_DNLOAD_TO : a->q->timeout_ms * 2;
+		}
+	}
+	else
+	{
+		a->lat[a->lat_cnt++ % ADAPT_HIST] = latency_us;
+		if(latency_us > a->lat_max) a->lat_max = latency_us;
+		a->win_bytes += op->next - op->pos;
+	}
+	a->win_us += latency_us; // a failed op costs time and delivers nothing
+	if(++a->win_ops < ADAPT_WINDOW) return;
+
+	if(!a->win_errs) adapt_timeout(a);
+	if(a->src) adapt_chunk(a);
+	a->win_ops = a->win_errs = 0;
+	a->win_bytes = a->win_us = 0;
+}
+
+void adapt_report(const adapt_t *a)
+{
+	fprintf(stderr, "info:    adaptive: chunk %d | timeout %d ms | latency p50/p95/p99 %d/%d/%d us | errors %d (%d timeouts) of %d\n",
+			a->src ? a->src->chunk : 0, a->q->timeout_ms, adapt_percentile(a, 50), adapt_percentile(a, 95), adapt_percentile(a, 99),
+			a->errs, a->timeouts, a->ops);
+}
\ No newline at end of file
@@ -0,0 +1,45 @@
+#ifndef ADAPT_H__
+#define ADAPT_H__
+
+#include "dfu.h"
+
+#define ADAPT_HIST 128	// latencies kept for percentiles
+#define ADAPT_WINDOW 16 // ops measured per chunk size step
+#define ADAPT_LEVELS 16 // chunk sizes, each one twice the previous
+#define ADAPT_STALE 16	// windows after which the neighbour sizes are measured again
+
+typedef struct
+{
+	dfu_queue_t *q;
+	dfu_src_image_t *src; // NULL - chunk is fixed, only timeouts follow the link
+	uint32_t chunk_min;
+	uint32_t chunk_max;
+	bool aligned; // chunk + header kept a multiple of bMaxPacketSize0
+
+	uint32_t lat[ADAPT_HIST];
+	uint32_t lat_cnt;
+	uint32_t lat_max;
+
+	uint32_t win_ops;
+	uint32_t win_errs;
+	uint64_t win_bytes;
+	uint64_t win_us;
+
+	uint32_t level;
+	uint32_t levels;
+	double goodput[ADAPT_LEVELS]; // acked bytes per us, failed ops' time included
+	uint32_t measured;			  // bit per level with a valid goodput
+	uint32_t age;				  // windows at the level
+	bool ramp;					  // stepping up from the smallest chunk
+
+	uint32_t ops;
+	uint32_t errs;
+	uint32_t timeouts;
+} adapt_t;
+
+void adapt_init(adapt_t *a, dfu_queue_t *q, dfu_src_image_t *src, const dfu_caps_t *caps);
+void adapt_done(void *arg, const dfu_op_t *op, int sts, uint32_t latency_us);
+uint32_t adapt_percentile(const adapt_t *a, uint32_t pct);
+void adapt_report(const adapt_t *a);
+
+#endif // ADAPT_H__
\ No newline at end of file
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Flash and read throughput against the simulated device (see sim.h), run by "make bench".
+# The images are random, so the device doesn't check their fw header (check=0).
+# BENCH_SIM - device spec, BENCH_SIZES - image sizes, BENCH_XFERS - wTransferSize values (chunk + 4)
+exe=${1:-build/usb_dfu_flasher}
+sim=${BENCH_SIM:-latency=125,bw=1000,page=2048,page_us=1000,erase_us=2000,reboot=20,flash=4M}
+sizes=${BENCH_SIZES:-65536 262144 1048576}
+xfers=${BENCH_XFERS:-256 1024 4096}
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+export HOME="$dir" # the device index of the simulated devices stays here
+
+# "transfer" phase time of the telemetry file, us
+data_us() { sed -n 's/.*"transfer":\([0-9]*\).*/\1/p' "$1"; }
+kbs() { awk -v b="$1" -v us="$2" 'BEGIN { printf "%.1f", (us > 0 ? b / 1024 / (us / 1e6) : 0) }'; }
+
+echo "sim: $sim"
+printf "%-6s %9s %6s %12s %12s  %s\n" op size chunk "total kB/s" "data kB/s" result
+fail=0
+for size in $sizes; do
+	head -c "$size" /dev/urandom >"$dir/img.bin"
+	for xfer in $xfers; do
+		chunk=$((xfer - 4))
+		for op in write read; do
+			rm -f "$dir/dev.bin" "$dir/out.bin" "$dir/t.json"
+			t0=$(date +%s%6N)
+			if [ $op = write ]; then
+				"$exe" --force --sim "check=0,$sim,xfer=$xfer,save=$dir/dev.bin" --telemetry "$dir/t.json" w a "$dir/img.bin" sim >/dev/null 2>&1
+				cmp -s "$dir/img.bin" "$dir/dev.bin"
+			else
+				"$exe" --sim "$sim,xfer=$xfer,app=$dir/img.bin" --telemetry "$dir/t.json" r a "$dir/out.bin" sim >/dev/null 2>&1
+				cmp -s "$dir/img.bin" "$dir/out.bin"
+			fi
+			ok=$?
+			t1=$(date +%s%6N)
+			[ $ok -eq 0 ] && res=OK || { res=FAIL; fail=1; }
+			printf "%-6s %9d %6d %12s %12s  %s\n" $op "$size" $chunk "$(kbs "$size" $((t1 - t0)))" "$(kbs "$size" "$(data_us "$dir/t.json")")" $res
+		done
+	done
+done
+exit $fail
\ No newline at end of file
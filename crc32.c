@@ -1,4 +1,9 @@
 #include "crc32.h"
+#include <pthread.h>
+#include <stdlib.h>
+#if !defined(_WIN32) && !defined(WIN32)
+#include <unistd.h>
+#endif
 
 static uint32_t sw_crc32_table[256] = {
 	0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, // 0..3
@@ -67,74 +72,236 @@ static uint32_t sw_crc32_table[256] = {
 	0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668,
 	0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4};
 
+static uint32_t slice[16][256]; // slice[k][b] - CRC of byte b followed by k zero bytes
+static pthread_once_t slice_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32_words)(uint32_t crc, const uint8_t *p, uint32_t len) = crc32_sb16; // fastest one this CPU has
+
+static void slice_init(void)
+{
+	if(crc32_clmul_supported()) crc32_words = crc32_clmul;
+	for(uint32_t b = 0; b < 256; b++)
+	{
+		slice[0][b] = sw_crc32_table[b];
+		for(int k = 1; k < 16; k++)
+			slice[k][b] = (slice[k - 1][b] << 8) ^ sw_crc32_table[slice[k - 1][b] >> 24];
+	}
+}
+
+static inline uint32_t ld32(const uint8_t *p) { return ((uint32_t)p[3] << 24U) | ((uint32_t)p[2] << 16U) | ((uint32_t)p[1] << 8U) | (uint32_t)p[0]; }
+
+// one little endian word, MSB first as the STM32 CRC unit takes it
+static inline uint32_t word(uint32_t crc, uint32_t data)
+{
+	crc ^= data;
+	return slice[3][crc >> 24] ^ slice[2][(crc >> 16) & 0xFF] ^ slice[1][(crc >> 8) & 0xFF] ^ slice[0][crc & 0xFF];
+}
+
+// the original one lookup per byte loop, reference for crc32_selftest()
+static uint32_t crc32_ref(uint32_t crc, const uint8_t *pBuffer, uint32_t NumOfByte)
+{
+	for(uint32_t i = 0; i + 4 <= NumOfByte; i += 4)
+	{
+		crc = crc ^ ld32(&pBuffer[i]);
+		for(int k = 0; k < 4; k++)
+			crc = (crc << 8) ^ sw_crc32_table[crc >> 24];
+	}
+	return crc;
+}
+
+/**
+ * \brief Whole words of `p` (the tail is left out, like crc32() does), two
+ * words per step with independent lookups
+ */
+uint32_t crc32_sb8(uint32_t crc, const uint8_t *p, uint32_t len)
+{
+	pthread_once(&slice_once, slice_init);
+	for(; len >= 8; p += 8, len -= 8)
+	{
+		uint32_t w0 = ld32(p) ^ crc, w1 = ld32(&p[4]);
+		crc = slice[7][w0 >> 24] ^ slice[6][(w0 >> 16) & 0xFF] ^ slice[5][(w0 >> 8) & 0xFF] ^ slice[4][w0 & 0xFF] ^
+			  slice[3][w1 >> 24] ^ slice[2][(w1 >> 16) & 0xFF] ^ slice[1][(w1 >> 8) & 0xFF] ^ slice[0][w1 & 0xFF];
+	}
+	if(len >= 4) crc = word(crc, ld32(p));
+	return crc;
+}
+
+// same as crc32_sb8(), four words per step
+uint32_t crc32_sb16(uint32_t crc, const uint8_t *p, uint32_t len)
+{
+	pthread_once(&slice_once, slice_init);
+	for(; len >= 16; p += 16, len -= 16)
+	{
+		uint32_t w0 = ld32(p) ^ crc, w1 = ld32(&p[4]), w2 = ld32(&p[8]), w3 = ld32(&p[12]);
+		crc = slice[15][w0 >> 24] ^ slice[14][(w0 >> 16) & 0xFF] ^ slice[13][(w0 >> 8) & 0xFF] ^ slice[12][w0 & 0xFF] ^
+			  slice[11][w1 >> 24] ^ slice[10][(w1 >> 16) & 0xFF] ^ slice[9][(w1 >> 8) & 0xFF] ^ slice[8][w1 & 0xFF] ^
+			  slice[7][w2 >> 24] ^ slice[6][(w2 >> 16) & 0xFF] ^ slice[5][(w2 >> 8) & 0xFF] ^ slice[4][w2 & 0xFF] ^
+			  slice[3][w3 >> 24] ^ slice[2][(w3 >> 16) & 0xFF] ^ slice[1][(w3 >> 8) & 0xFF] ^ slice[0][w3 & 0xFF];
+	}
+	for(; len >= 4; p += 4, len -= 4)
+		crc = word(crc, ld32(p));
+	return crc;
+}
+
+/**
+ * \brief Continue `crc` over `len` bytes including the tail: the last
+ * len % 4 bytes are fed one by one, as byte writes to an STM32 CRC unit with
+ * programmable data size do. Chunks of a stream must be word multiples
+ * except the last one.
+ */
+uint32_t crc32_update(uint32_t crc, const uint8_t *p, uint32_t len)
+{
+	pthread_once(&slice_once, slice_init);
+	crc = crc32_words(crc, p, len);
+	for(uint32_t i = len & ~3U; i < len; i++)
+		crc = (crc << 8) ^ sw_crc32_table[(crc >> 24) ^ p[i]];
+	return crc;
+}
+
 /*!
  * \brief Calculate STM32 compatible CRC
  * \param pBuffer Pointer to a buffer
- * \param NumOfByte Buffer size
+ * \param NumOfByte Buffer size (the remainder of a word is not included)
  * \return CRC Value
  */
 uint32_t crc32(const uint8_t *pBuffer, uint32_t NumOfByte)
 {
-	uint32_t crc32 = 0xFFFFFFFF;
-	uint32_t NumOfDWord = NumOfByte >> 2;
-	uint32_t i = 0;
+	pthread_once(&slice_once, slice_init);
+	return crc32_words(0xFFFFFFFF, pBuffer, NumOfByte);
+}
 
-	while(NumOfDWord--)
-	{
-		uint32_t data = ((uint32_t)pBuffer[i + 3] << 24U) |
-						((uint32_t)pBuffer[i + 2] << 16U) |
-						((uint32_t)pBuffer[i + 1] << 8U) |
-						((uint32_t)pBuffer[i + 0]);
-		i += 4;
+void crc32_start(const uint8_t *pBuffer, uint32_t NumOfByte, uint32_t *temp)
+{
+	pthread_once(&slice_once, slice_init);
+	*temp = crc32_words(0xFFFFFFFF, pBuffer, NumOfByte);
+}
 
-		crc32 = crc32 ^ data;
+uint32_t crc32_end(const uint8_t *pBuffer, uint32_t NumOfByte, uint32_t *temp)
+{
+	pthread_once(&slice_once, slice_init);
+	return *temp = crc32_words(*temp, pBuffer, NumOfByte);
+}
 
-		for(int k = 0; k < 4; k++)
-			crc32 = (crc32 << 8) ^ sw_crc32_table[crc32 >> 24];
+// a * b mod P
+static uint32_t mul_mod(uint32_t a, uint32_t b)
+{
+	uint32_t r = 0;
+	for(int i = 31; i >= 0; i--)
+	{
+		r = (r << 1) ^ ((r & 0x80000000U) ? sw_crc32_table[1] : 0);
+		if(b & (1U << i)) r ^= a;
 	}
-
-	return crc32;
+	return r;
 }
 
-void crc32_start(const uint8_t *pBuffer, uint32_t NumOfByte, uint32_t *temp)
+// x^(8 * len) mod P
+static uint32_t x8n_mod(uint32_t len)
 {
-	*temp = 0xFFFFFFFF;
-	uint32_t NumOfDWord = NumOfByte >> 2;
-	uint32_t i = 0;
-
-	while(NumOfDWord--)
+	uint32_t r = 1U, sq = 1U << 8; // x^8, squared for every bit of len
+	for(; len; len >>= 1, sq = mul_mod(sq, sq))
 	{
-		uint32_t data = ((uint32_t)pBuffer[i + 3] << 24U) |
-						((uint32_t)pBuffer[i + 2] << 16U) |
-						((uint32_t)pBuffer[i + 1] << 8U) |
-						((uint32_t)pBuffer[i + 0]);
-		i += 4;
+		if(len & 1) r = mul_mod(r, sq);
+	}
+	return r;
+}
 
-		*temp = *temp ^ data;
+/**
+ * \brief CRC of A followed by B from crc1 = CRC(A) and crc2 = CRC(B), both
+ * started from 0xFFFFFFFF
+ * \param len2 bytes crc2 covers (whole words for crc32(), A must be whole words)
+ */
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint32_t len2) { return mul_mod(crc1 ^ 0xFFFFFFFF, x8n_mod(len2)) ^ crc2; }
 
-		for(int k = 0; k < 4; k++)
-			*temp = (*temp << 8) ^ sw_crc32_table[*temp >> 24];
-	}
+typedef struct
+{
+	pthread_t thr;
+	bool threaded; // else done in place
+	const uint8_t *p;
+	uint32_t len;
+	uint32_t crc;
+} slice_job_t;
+
+static void *slice_job(void *arg)
+{
+	slice_job_t *j = arg;
+	j->crc = crc32_words(0xFFFFFFFF, j->p, j->len);
+	return NULL;
 }
 
-uint32_t crc32_end(const uint8_t *pBuffer, uint32_t NumOfByte, uint32_t *temp)
+/**
+ * \brief crc32() of a large buffer: word aligned slices are hashed by up to
+ * CRC32_MT_MAX threads at once and merged with crc32_combine()
+ */
+uint32_t crc32_mt(const uint8_t *pBuffer, uint32_t NumOfByte)
 {
-	uint32_t NumOfDWord = NumOfByte >> 2;
-	uint32_t i = 0;
+	pthread_once(&slice_once, slice_init);
+	uint32_t n = 4;
+#if !defined(_WIN32) && !defined(WIN32)
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(cpus > 0) n = (uint32_t)cpus;
+#endif
+	if(n > CRC32_MT_MAX) n = CRC32_MT_MAX;
+	if(n > NumOfByte / CRC32_MT_SLICE) n = NumOfByte / CRC32_MT_SLICE;
+	if(n < 2) return crc32_words(0xFFFFFFFF, pBuffer, NumOfByte);
 
-	while(NumOfDWord--)
+	slice_job_t job[CRC32_MT_MAX];
+	uint32_t step = NumOfByte / n & ~3U;
+	for(uint32_t i = n; i-- > 0;) // the first slice is hashed by the caller
 	{
-		uint32_t data = ((uint32_t)pBuffer[i + 3] << 24U) |
-						((uint32_t)pBuffer[i + 2] << 16U) |
-						((uint32_t)pBuffer[i + 1] << 8U) |
-						((uint32_t)pBuffer[i + 0]);
-		i += 4;
+		job[i].p = &pBuffer[i * step];
+		job[i].len = i == n - 1 ? NumOfByte - i * step : step;
+		job[i].threaded = i && pthread_create(&job[i].thr, NULL, slice_job, &job[i]) == 0;
+		if(!job[i].threaded) slice_job(&job[i]);
+	}
 
-		*temp = *temp ^ data;
+	uint32_t crc = job[0].crc;
+	for(uint32_t i = 1; i < n; i++)
+	{
+		if(job[i].threaded) pthread_join(job[i].thr, NULL);
+		crc = crc32_combine(crc, job[i].crc, job[i].len & ~3U);
+	}
+	return crc;
+}
 
-		for(int k = 0; k < 4; k++)
-			*temp = (*temp << 8) ^ sw_crc32_table[*temp >> 24];
+/**
+ * \brief Check the sliced and folding versions and the tail handling against the
+ * reference loop on every length up to 1 KiB and every start alignment
+ * \return 0 - pass, otherwise 1 + the failed length
+ */
+int crc32_selftest(void)
+{
+	enum { LEN = 1024 };
+	static uint8_t buf[LEN + 16];
+	uint32_t x = 0x12345678;
+	for(uint32_t i = 0; i < sizeof(buf); i++)
+	{
+		x = x * 1103515245U + 12345U;
+		buf[i] = (uint8_t)(x >> 16);
 	}
+	for(uint32_t len = 0; len <= LEN; len++)
+	{
+		for(uint32_t al = 0; al < 16; al++)
+		{
+			const uint8_t *p = &buf[al];
+			uint32_t ref = crc32_ref(0xFFFFFFFF, p, len);
+			if(crc32_sb8(0xFFFFFFFF, p, len) != ref || crc32_sb16(0xFFFFFFFF, p, len) != ref || crc32(p, len) != ref) return (int)len + 1;
+			if(crc32_clmul_supported() && crc32_clmul(0xFFFFFFFF, p, len) != ref) return (int)len + 1;
+
+			// tail: every byte shifted through the register on its own
+			uint32_t tail = ref;
+			for(uint32_t i = len & ~3U; i < len; i++)
+			{
+				tail ^= (uint32_t)p[i] << 24;
+				tail = (tail << 8) ^ sw_crc32_table[tail >> 24];
+			}
+			if(crc32_update(0xFFFFFFFF, p, len) != tail) return (int)len + 1;
 
-	return *temp;
-}
\ No newline at end of file
+			// split streams continue the same, and merge the same
+			uint32_t half = (len / 2) & ~3U, st;
+			crc32_start(p, half, &st);
+			if(len % 4 == 0 && crc32_end(&p[half], len - half, &st) != ref) return (int)len + 1;
+			uint32_t head = crc32_sb16(0xFFFFFFFF, p, half), rest = crc32_sb16(0xFFFFFFFF, &p[half], len - half);
+			if(crc32_combine(head, rest, (len - half) & ~3U) != ref) return (int)len + 1;
+		}
+	}
+	return 0;
+}
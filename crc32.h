@@ -1,10 +1,24 @@
 #ifndef CRC32_H__
 #define CRC32_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#define CRC32_MT_MAX 16			// threads of crc32_mt()
+#define CRC32_MT_SLICE 0x100000 // smallest slice worth a thread
+
 uint32_t crc32(const uint8_t *pBuffer, uint32_t NumOfByte);
 void crc32_start(const uint8_t *pBuffer, uint32_t NumOfByte, uint32_t *temp);
 uint32_t crc32_end(const uint8_t *pBuffer, uint32_t NumOfByte, uint32_t *temp);
 
+// continue `crc` (0xFFFFFFFF to start) over whole words of `p`
+uint32_t crc32_sb8(uint32_t crc, const uint8_t *p, uint32_t len);
+uint32_t crc32_sb16(uint32_t crc, const uint8_t *p, uint32_t len);
+uint32_t crc32_update(uint32_t crc, const uint8_t *p, uint32_t len); // with the tail bytes
+uint32_t crc32_clmul(uint32_t crc, const uint8_t *p, uint32_t len); // PCLMULQDQ/PMULL folding
+bool crc32_clmul_supported(void);
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint32_t len2);
+uint32_t crc32_mt(const uint8_t *pBuffer, uint32_t NumOfByte); // crc32() on several threads
+int crc32_selftest(void);
+
 #endif // CRC32_H__
\ No newline at end of file
@@ -0,0 +1,155 @@
+#include "crc32.h"
+
+/**
+ * Folding with carry-less multiplication. The STM32 CRC is CRC-32/MPEG-2
+ * over little endian words, so a 16 byte block with its four words in
+ * reverse lane order is the message polynomial w0*x^96 + w1*x^64 + w2*x^32 + w3
+ * in plain bit order, and no bit reflection is needed:
+ *  - init is xored into the top word of the first block,
+ *  - a block is carried `d` bits forward as hi64 * (x^(d+64) mod P) ^ lo64 * (x^d mod P),
+ *    four blocks in flight (d = 512) and then merged (d = 128),
+ *  - the last 128 bits are reduced by the table code with init 0.
+ */
+
+// x^n mod P, P = 0x04C11DB7 (checked by crc32_selftest())
+#define K576 0x8833794cU
+#define K512 0xe6228b11U
+#define K192 0xc5b9cd4cU
+#define K128 0xe8a45605U
+
+#if(defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define CLMUL_X86
+
+__attribute__((target("pclmul,sse2"))) static inline __m128i fold(__m128i a, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x11), _mm_clmulepi64_si128(a, k, 0x00));
+}
+
+__attribute__((target("pclmul,sse2"))) static inline __m128i load(const uint8_t *p)
+{
+	return _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(const void *)p), 0x1B);
+}
+
+__attribute__((target("pclmul,sse2"))) static uint32_t clmul_blocks(uint32_t crc, const uint8_t *p, uint32_t blocks)
+{
+	const __m128i k512 = _mm_set_epi64x(K576, K512);
+	const __m128i k128 = _mm_set_epi64x(K192, K128);
+
+	__m128i a0 = _mm_xor_si128(load(p), _mm_set_epi32((int)crc, 0, 0, 0));
+	p += 16;
+	blocks--;
+	if(blocks >= 7) // 4 folds in flight
+	{
+		__m128i a1 = load(p), a2 = load(&p[16]), a3 = load(&p[32]);
+		p += 48;
+		blocks -= 3;
+		for(; blocks >= 4; p += 64, blocks -= 4)
+		{
+			a0 = _mm_xor_si128(fold(a0, k512), load(p));
+			a1 = _mm_xor_si128(fold(a1, k512), load(&p[16]));
+			a2 = _mm_xor_si128(fold(a2, k512), load(&p[32]));
+			a3 = _mm_xor_si128(fold(a3, k512), load(&p[48]));
+		}
+		a1 = _mm_xor_si128(fold(a0, k128), a1);
+		a2 = _mm_xor_si128(fold(a1, k128), a2);
+		a0 = _mm_xor_si128(fold(a2, k128), a3);
+	}
+	for(; blocks; p += 16, blocks--)
+		a0 = _mm_xor_si128(fold(a0, k128), load(p));
+
+	uint8_t last[16];
+	_mm_storeu_si128((__m128i *)(void *)last, _mm_shuffle_epi32(a0, 0x1B));
+	return crc32_sb16(0, last, sizeof(last));
+}
+
+bool crc32_clmul_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2");
+}
+
+#elif defined(__aarch64__) && defined(__linux__) && defined(__GNUC__)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define CLMUL_ARM
+
+typedef struct
+{
+	poly64_t hi, lo;
+} consts_t;
+
+__attribute__((target("+crypto"))) static inline uint64x2_t fold(uint64x2_t a, consts_t k)
+{
+	poly128_t h = vmull_p64((poly64_t)vgetq_lane_u64(a, 1), k.hi);
+	poly128_t l = vmull_p64((poly64_t)vgetq_lane_u64(a, 0), k.lo);
+	return veorq_u64(vreinterpretq_u64_p128(h), vreinterpretq_u64_p128(l));
+}
+
+static inline uint64x2_t load(const uint8_t *p)
+{
+	uint32x4_t w = vreinterpretq_u32_u8(vld1q_u8(p));
+	w = vrev64q_u32(w);
+	return vreinterpretq_u64_u32(vextq_u32(w, w, 2));
+}
+
+__attribute__((target("+crypto"))) static uint32_t clmul_blocks(uint32_t crc, const uint8_t *p, uint32_t blocks)
+{
+	const consts_t k512 = {K576, K512};
+	const consts_t k128 = {K192, K128};
+	const uint32_t init[4] = {0, 0, 0, crc};
+
+	uint64x2_t a0 = veorq_u64(load(p), vreinterpretq_u64_u32(vld1q_u32(init)));
+	p += 16;
+	blocks--;
+	if(blocks >= 7)
+	{
+		uint64x2_t a1 = load(p), a2 = load(&p[16]), a3 = load(&p[32]);
+		p += 48;
+		blocks -= 3;
+		for(; blocks >= 4; p += 64, blocks -= 4)
+		{
+			a0 = veorq_u64(fold(a0, k512), load(p));
+			a1 = veorq_u64(fold(a1, k512), load(&p[16]));
+			a2 = veorq_u64(fold(a2, k512), load(&p[32]));
+			a3 = veorq_u64(fold(a3, k512), load(&p[48]));
+		}
+		a1 = veorq_u64(fold(a0, k128), a1);
+		a2 = veorq_u64(fold(a1, k128), a2);
+		a0 = veorq_u64(fold(a2, k128), a3);
+	}
+	for(; blocks; p += 16, blocks--)
+		a0 = veorq_u64(fold(a0, k128), load(p));
+
+	uint32x4_t w = vreinterpretq_u32_u64(a0);
+	w = vrev64q_u32(w);
+	uint8_t last[16];
+	vst1q_u8(last, vreinterpretq_u8_u32(vextq_u32(w, w, 2)));
+	return crc32_sb16(0, last, sizeof(last));
+}
+
+bool crc32_clmul_supported(void) { return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0; }
+
+#else
+
+bool crc32_clmul_supported(void) { return false; }
+
+#endif
+
+/**
+ * \brief Same as crc32_sb16(), the caller checks crc32_clmul_supported()
+ */
+uint32_t crc32_clmul(uint32_t crc, const uint8_t *p, uint32_t len)
+{
+#if defined(CLMUL_X86) || defined(CLMUL_ARM)
+	uint32_t blocks = len / 16;
+	if(blocks >= 2)
+	{
+		crc = clmul_blocks(crc, p, blocks);
+		p += blocks * 16;
+		len -= blocks * 16;
+	}
+#endif
+	return crc32_sb16(crc, p, len);
+}
\ No newline at end of file
@@ -0,0 +1,428 @@
+#include "daemon.h"
+#include "telemetry.h"
+#include "timedate.h"
+#include "trace.h"
+#include "usb_io.h"
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_WIN32) && !defined(WIN32)
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+typedef struct
+{
+	char serial[256]; // "" - unreadable
+	uint16_t vid;
+	uint16_t pid;
+	uint8_t bus;
+	uint8_t port[8];
+	int port_len;
+	uint8_t addr; // a new one on every enumeration, the serial is read again then
+	bool present;
+	bool busy; // in a job, left as it is by rescans
+} reg_dev_t;
+
+static reg_dev_t reg[DAEMON_DEVICES_MAX];
+static uint32_t reg_cnt;
+static pthread_mutex_t reg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reg_released = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER; // one rescan at a time
+static atomic_bool dirty; // hotplug event or a device back from a job
+static atomic_bool stop; // lock-free, so the signal handler may set it for the threads
+static atomic_uint conns; // connections being served
+static daemon_job_fn job_fn;
+
+static bool prefix_lwr(const char *name, const char *serial)
+{
+	for(; *name; name++, serial++)
+	{
+		if(tolower(*name) != tolower(*serial)) return false;
+	}
+	return true;
+}
+
+static void port_fmt(const reg_dev_t *d, char *s, size_t sz)
+{
+	int n = snprintf(s, sz, "%d-", d->bus);
+	for(int i = 0; i < d->port_len && n > 0 && (size_t)n < sz; i++)
+		n += snprintf(&s[n], sz - (size_t)n, i ? ".%d" : "%d", d->port[i]);
+}
+
+// call locked
+static reg_dev_t *reg_find(uint8_t bus, const uint8_t *port, int port_len)
+{
+	for(uint32_t i = 0; i < reg_cnt; i++)
+	{
+		if(reg[i].bus == bus && reg[i].port_len == port_len && memcmp(reg[i].port, port, (size_t)port_len) == 0) return &reg[i];
+	}
+	return NULL;
+}
+
+/**
+ * \brief Sync the registry with the device list. Only devices that are new
+ * on their port are opened for the serial, `retry` - the unreadable ones too.
+ * Devices in jobs are not touched.
+ */
+static void rescan(bool retry)
+{
+	pthread_mutex_lock(&scan_lock);
+	libusb_device **list = NULL;
+	ssize_t cnt = trace_get_device_list(NULL, &list);
+	if(cnt < 0)
+	{
+		fprintf(stderr, "error    libusb: failed to get device list\n");
+		pthread_mutex_unlock(&scan_lock);
+		return;
+	}
+	pthread_mutex_lock(&reg_lock);
+	for(uint32_t i = 0; i < reg_cnt; i++)
+		reg[i].present = false;
+	pthread_mutex_unlock(&reg_lock);
+
+	for(ssize_t i = 0; i < cnt; i++)
+	{
+		struct libusb_device_descriptor desc;
+		uint8_t port[8];
+		int port_len = usb_io->get_port_numbers(list[i], port, sizeof(port));
+		if(port_len <= 0 || usb_io->get_device_descriptor(list[i], &desc) < 0) continue;
+		if(desc.bDeviceClass == LIBUSB_CLASS_HUB || !desc.iSerialNumber) continue;
+		uint8_t bus = usb_io->get_bus_number(list[i]), addr = usb_io->get_device_address(list[i]);
+
+		pthread_mutex_lock(&reg_lock);
+		reg_dev_t *d = reg_find(bus, port, port_len);
+		bool known = d && (d->busy || (d->addr == addr && (d->serial[0] || !retry)));
+		if(d) d->present = true;
+		pthread_mutex_unlock(&reg_lock);
+		if(known) continue;
+
+		char serial[256] = {0};
+		libusb_device_handle *h;
+		if(trace_open(list[i], &h) == 0)
+		{
+			if(trace_get_string_descriptor_ascii(h, desc.iSerialNumber, (uint8_t *)serial, sizeof(serial) - 1) < 0) serial[0] = '\0';
+			usb_io->close(h);
+		}
+
+		pthread_mutex_lock(&reg_lock);
+		if(!(d = reg_find(bus, port, port_len)) && reg_cnt < DAEMON_DEVICES_MAX)
+		{
+			d = &reg[reg_cnt++];
+			memset(d, 0, sizeof(*d));
+			d->bus = bus;
+			memcpy(d->port, port, (size_t)port_len);
+			d->port_len = port_len;
+		}
+		if(d && !d->busy) // taken by a job while the serial was read: it is the job's now
+		{
+			char p[40];
+			port_fmt(d, p, sizeof(p));
+			if(serial[0] && strcmp(serial, d->serial) != 0) fprintf(stderr, "info:    daemon: %s on %s\n", serial, p);
+			strcpy(d->serial, serial);
+			d->vid = desc.idVendor;
+			d->pid = desc.idProduct;
+			d->addr = addr;
+			d->present = true;
+		}
+		pthread_mutex_unlock(&reg_lock);
+	}
+	usb_io->free_device_list(list, 1);
+
+	pthread_mutex_lock(&reg_lock);
+	for(uint32_t i = 0; i < reg_cnt;)
+	{
+		if(reg[i].present || reg[i].busy)
+		{
+			i++;
+			continue;
+		}
+		if(reg[i].serial[0]) fprintf(stderr, "info:    daemon: %s left\n", reg[i].serial);
+		reg[i] = reg[--reg_cnt];
+	}
+	pthread_mutex_unlock(&reg_lock);
+	pthread_mutex_unlock(&scan_lock);
+}
+
+bool daemon_claim(const char *name, uint16_t vid, uint16_t pid, uint8_t *bus, uint8_t *port, int *port_len)
+{
+	bool scanned = false;
+	pthread_mutex_lock(&reg_lock);
+	for(;;)
+	{
+		bool seen = false;
+		for(uint32_t i = 0; i < reg_cnt; i++)
+		{
+			reg_dev_t *d = &reg[i];
+			if(!d->serial[0] || !prefix_lwr(name, d->serial) || (vid && d->vid != vid) || (pid && d->pid != pid)) continue;
+			seen = true;
+			if(d->busy) continue;
+			d->busy = true;
+			*bus = d->bus;
+			memcpy(port, d->port, sizeof(d->port));
+			*port_len = d->port_len;
+			pthread_mutex_unlock(&reg_lock);
+			return true;
+		}
+		if(seen)
+		{
+			pthread_cond_wait(&reg_released, &reg_lock);
+			continue;
+		}
+		if(scanned) break;
+		pthread_mutex_unlock(&reg_lock); // it may have come without an event yet
+		rescan(true);
+		pthread_mutex_lock(&reg_lock);
+		scanned = true;
+	}
+	pthread_mutex_unlock(&reg_lock);
+	return false;
+}
+
+void daemon_release(uint8_t bus, const uint8_t *port, int port_len)
+{
+	pthread_mutex_lock(&reg_lock);
+	reg_dev_t *d = reg_find(bus, port, port_len);
+	if(d)
+	{
+		d->busy = false;
+		d->addr = 0; // likely rebooted by the job, read it again
+	}
+	pthread_cond_broadcast(&reg_released);
+	pthread_mutex_unlock(&reg_lock);
+	atomic_store(&dirty, true);
+}
+
+static void list_devices(FILE *out)
+{
+	pthread_mutex_lock(&reg_lock);
+	uint32_t n = 0;
+	for(uint32_t i = 0; i < reg_cnt; i++)
+	{
+		if(!reg[i].serial[0]) continue;
+		char p[40];
+		port_fmt(&reg[i], p, sizeof(p));
+		fprintf(out, "device {\"serial\":");
+		telem_json_str(out, reg[i].serial);
+		fprintf(out, ",\"port\":\"%s\",\"id\":\"%04x:%04x\",\"busy\":%s}\n", p, reg[i].vid, reg[i].pid, reg[i].busy ? "true" : "false");
+		n++;
+	}
+	pthread_mutex_unlock(&reg_lock);
+	fprintf(out, "result 0 {\"devices\":%d}\n", n);
+}
+
+#if !defined(_WIN32) && !defined(WIN32)
+static int LIBUSB_CALL on_hotplug(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+	(void)ctx;
+	(void)dev;
+	(void)event;
+	(void)user_data;
+	atomic_store(&dirty, true);
+	return 0;
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	atomic_store(&stop, true);
+}
+
+// handles USB events for hotplug and rescans the registry
+static void *watch_thread(void *arg)
+{
+	bool hotplug = *(const bool *)arg;
+	TD_V t0, t1;
+	TD_GET(t0);
+	while(!atomic_load(&stop))
+	{
+		if(hotplug)
+		{
+			struct timeval tv = {.tv_sec = 0, .tv_usec = 1000 * DAEMON_TICK_MS};
+			usb_io->handle_events_timeout_completed(NULL, &tv, NULL);
+		}
+		else
+		{
+			delay_ms(DAEMON_TICK_MS);
+		}
+		TD_GET(t1);
+		if(atomic_exchange(&dirty, false) || (!hotplug && TD_CALC_ms(t1, t0) >= DAEMON_POLL_MS))
+		{
+			rescan(false);
+			TD_GET(t0);
+		}
+	}
+	return NULL;
+}
+
+static void *conn_thread(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	struct timeval tv = {.tv_sec = DAEMON_REQUEST_TO};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	int fd_out = dup(fd);
+	FILE *in = fdopen(fd, "r"), *out = fd_out >= 0 ? fdopen(fd_out, "w") : NULL;
+	char line[DAEMON_LINE_MAX];
+	if(in && out && fgets(line, sizeof(line), in))
+	{
+		char prog[] = "job"; // argv[0]
+		char *argv[DAEMON_ARGS_MAX + 1] = {prog};
+		int argc = 1;
+		char *save = NULL;
+		for(char *a = strtok_r(line, " \t\r\n", &save); a && argc < DAEMON_ARGS_MAX; a = strtok_r(NULL, " \t\r\n", &save))
+			argv[argc++] = a;
+		if(argc == 2 && strcmp(argv[1], "list") == 0)
+			list_devices(out);
+		else
+			job_fn(argc, argv, out);
+	}
+	if(out)
+		fclose(out);
+	else if(fd_out >= 0)
+		close(fd_out);
+	if(in)
+		fclose(in);
+	else
+		close(fd);
+	atomic_fetch_sub(&conns, 1);
+	return NULL;
+}
+
+int daemon_run(const char *path, daemon_job_fn job)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "error:    daemon: socket path is too long\n");
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	struct stat st;
+	if(stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path); // left by a previous run
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	mode_t mask = umask(0177); // 0600: jobs write any device and read any path of ours, the socket is the owner's only
+	int bound = fd < 0 ? -1 : bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if(fd < 0 || bound || listen(fd, 16))
+	{
+		fprintf(stderr, "error:    daemon: can't listen on %s: %s\n", path, strerror(errno));
+		if(fd >= 0) close(fd);
+		return -1;
+	}
+	job_fn = job;
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, SIG_IGN); // a client that went away ends its own connection only
+
+	rescan(false);
+	libusb_hotplug_callback_handle hp;
+	bool hotplug = usb_io->has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+				   usb_io->hotplug_register_callback(NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, 0, LIBUSB_HOTPLUG_MATCH_ANY,
+													 LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, on_hotplug, NULL, &hp) == LIBUSB_SUCCESS;
+	pthread_t watch;
+	bool watching = pthread_create(&watch, NULL, watch_thread, &hotplug) == 0;
+	if(!watching) fprintf(stderr, "warn:    daemon: failed to start the registry thread, devices are looked up by jobs only\n");
+	fprintf(stderr, "info:    daemon: %d devices, listening on %s (%s)\n", reg_cnt, path, hotplug ? "hotplug" : "polling");
+
+	while(!atomic_load(&stop))
+	{
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		if(poll(&pfd, 1, DAEMON_TICK_MS) <= 0) continue;
+		int c = accept(fd, NULL, NULL);
+		if(c < 0) continue;
+		pthread_t thr;
+		atomic_fetch_add(&conns, 1);
+		if(pthread_create(&thr, NULL, conn_thread, (void *)(intptr_t)c) != 0)
+		{
+			fprintf(stderr, "error:    daemon: failed to start a connection thread\n");
+			atomic_fetch_sub(&conns, 1);
+			close(c);
+			continue;
+		}
+		pthread_detach(thr);
+	}
+
+	close(fd);
+	unlink(path);
+	if(atomic_load(&conns)) fprintf(stderr, "info:    daemon: stopping, waiting for %d jobs\n", atomic_load(&conns));
+	while(atomic_load(&conns))
+		delay_ms(DAEMON_TICK_MS);
+	if(watching) pthread_join(watch, NULL);
+	if(hotplug) usb_io->hotplug_deregister_callback(NULL, hp);
+	return 0;
+}
+
+int daemon_client(const char *path, int argc, char *argv[])
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "error:    daemon: socket path is too long\n");
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	for(int i = 0; i < argc; i++)
+	{
+		if(strpbrk(argv[i], " \t\r\n"))
+		{
+			fprintf(stderr, "error:    job arguments can't have spaces: [%s]\n", argv[i]);
+			return -1;
+		}
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+	{
+		fprintf(stderr, "error:    can't connect to %s: %s\n", path, strerror(errno));
+		if(fd >= 0) close(fd);
+		return -1;
+	}
+	FILE *io = fdopen(fd, "r+");
+	if(!io)
+	{
+		close(fd);
+		return -1;
+	}
+	for(int i = 0; i < argc; i++)
+		fprintf(io, "%s%s", i ? " " : "", argv[i]);
+	fprintf(io, "\n");
+	fflush(io);
+
+	int sts = -1;
+	char line[DAEMON_LINE_MAX];
+	while(fgets(line, sizeof(line), io))
+	{
+		fputs(line, stdout);
+		if(strncmp(line, "result ", 7) == 0) sts = atoi(&line[7]);
+	}
+	fclose(io);
+	return sts;
+}
+#else
+int daemon_run(const char *path, daemon_job_fn job)
+{
+	(void)path;
+	(void)job;
+	(void)job_fn;
+	(void)stop;
+	(void)conns;
+	fprintf(stderr, "error:    daemon: no Unix sockets on this platform\n");
+	return -1;
+}
+
+int daemon_client(const char *path, int argc, char *argv[])
+{
+	(void)path;
+	(void)argc;
+	(void)argv;
+	(void)list_devices;
+	fprintf(stderr, "error:    daemon: no Unix sockets on this platform\n");
+	return -1;
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,44 @@
+#ifndef DAEMON_H__
+#define DAEMON_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define DAEMON_DEVICES_MAX 128
+#define DAEMON_LINE_MAX 4096 // request line
+#define DAEMON_ARGS_MAX 64
+#define DAEMON_TICK_MS 100	 // event handling / stop check period
+#define DAEMON_POLL_MS 1000	 // registry rescan period without hotplug
+#define DAEMON_REQUEST_TO 5	 // s, to send the request line after connecting
+
+// runs one request on the connection thread, `argv` as on the command line, ends with a "result" line to `out`
+typedef int (*daemon_job_fn)(int argc, char *argv[], FILE *out);
+
+/**
+ * Keep the USB backend and a registry of the devices (serial, id, port)
+ * updated by hotplug, or by a rescan every DAEMON_POLL_MS without it, and
+ * serve one request per connection on the Unix socket `path` (mode 0600)
+ * till SIGINT or SIGTERM. A request is a line of whitespace separated arguments:
+ *   list                          - "device {json}" per registered device
+ *   w|r p|b|a|c file name [sub] [chunk] [--options]
+ *   inspect [--csv] [--jobs N] path...
+ * Paths are the daemon's. Progress comes back as "progress <bytes> <total>"
+ * lines (total 0 - unknown), the reply ends with "result <code> {json}".
+ * Jobs run concurrently, each device is given to one job at a time.
+ */
+int daemon_run(const char *path, daemon_job_fn job);
+
+/**
+ * \brief Take an idle registered device whose serial starts with `name`,
+ * waiting while all of them are in other jobs, and return its port
+ * \return false - no such device, even after a rescan
+ */
+bool daemon_claim(const char *name, uint16_t vid, uint16_t pid, uint8_t *bus, uint8_t *port, int *port_len);
+void daemon_release(uint8_t bus, const uint8_t *port, int port_len);
+
+/** \brief Send `argv` as a request to the daemon at `path`, print the reply to stdout
+ * \return the result code, -1 - no daemon or no result */
+int daemon_client(const char *path, int argc, char *argv[]);
+
+#endif // DAEMON_H__
\ No newline at end of file
@@ -0,0 +1,119 @@
+#include "dev_index.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // --all threads update it together
+static dev_index_entry_t list[DEV_INDEX_MAX];
+
+static bool index_path(char *path, size_t sz)
+{
+	const char *home = getenv("HOME");
+	if(!home) home = getenv("USERPROFILE");
+	if(!home) return false;
+	int n = snprintf(path, sz, "%s/%s", home, DEV_INDEX_FILE);
+	return n > 0 && (size_t)n < sz;
+}
+
+static bool parse_line(const char *line, dev_index_entry_t *e)
+{
+	unsigned bus;
+	char ports[64];
+	if(sscanf(line, "%255s %u %63s", e->serial, &bus, ports) != 3 || bus > UINT8_MAX) return false;
+	e->bus = (uint8_t)bus;
+	e->port_len = 0;
+	for(char *p = ports; *p && e->port_len < (int)sizeof(e->port); p++)
+	{
+		unsigned long v = strtoul(p, &p, 10);
+		if(v == 0 || v > UINT8_MAX) return false;
+		e->port[e->port_len++] = (uint8_t)v;
+		if(*p != '.') break;
+	}
+	return e->port_len > 0;
+}
+
+// oldest first
+static uint32_t load(void)
+{
+	char path[1024], line[512];
+	if(!index_path(path, sizeof(path))) return 0;
+	FILE *f = fopen(path, "r");
+	if(!f) return 0;
+	uint32_t n = 0;
+	while(n < DEV_INDEX_MAX && fgets(line, sizeof(line), f))
+	{
+		if(parse_line(line, &list[n])) n++;
+	}
+	fclose(f);
+	return n;
+}
+
+static int cmp_prefix_lwr(const char *name, const char *serial)
+{
+	for(; *name; name++, serial++)
+	{
+		if(tolower(*name) != tolower(*serial)) return 1;
+	}
+	return 0;
+}
+
+/**
+ * \brief Latest entry whose serial starts with `name` (case insensitive)
+ */
+bool dev_index_find(const char *name, dev_index_entry_t *e)
+{
+	bool found = false;
+	pthread_mutex_lock(&lock);
+	for(uint32_t i = load(); i-- > 0;)
+	{
+		if(cmp_prefix_lwr(name, list[i].serial) == 0)
+		{
+			*e = list[i];
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return found;
+}
+
+/**
+ * \brief Record `e` as the newest entry, replacing the ones with the same
+ * serial or port (a port holds one device at a time)
+ */
+void dev_index_put(const dev_index_entry_t *e)
+{
+	char path[1024], tmp[1040];
+	if(!e->port_len || strpbrk(e->serial, " \t\r\n") || !index_path(path, sizeof(path))) return;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	pthread_mutex_lock(&lock);
+	uint32_t n = load();
+	FILE *f = fopen(tmp, "w");
+	if(f)
+	{
+		for(uint32_t i = n >= DEV_INDEX_MAX ? 1 : 0; i < n; i++)
+		{
+			bool same_port = list[i].bus == e->bus && list[i].port_len == e->port_len && memcmp(list[i].port, e->port, (size_t)e->port_len) == 0;
+			if(same_port || strcmp(list[i].serial, e->serial) == 0) continue;
+			fprintf(f, "%s %d", list[i].serial, list[i].bus);
+			for(int k = 0; k < list[i].port_len; k++)
+				fprintf(f, k ? ".%d" : " %d", list[i].port[k]);
+			fprintf(f, "\n");
+		}
+		fprintf(f, "%s %d", e->serial, e->bus);
+		for(int k = 0; k < e->port_len; k++)
+			fprintf(f, k ? ".%d" : " %d", e->port[k]);
+		fprintf(f, "\n");
+		if(fclose(f) == 0)
+		{
+#if defined(_WIN32) || defined(WIN32)
+			remove(path); // rename() doesn't replace there
+#endif
+			rename(tmp, path);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
\ No newline at end of file
@@ -0,0 +1,22 @@
+#ifndef DEV_INDEX_H__
+#define DEV_INDEX_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DEV_INDEX_FILE ".usb_dfu_flasher.idx" // in $HOME
+#define DEV_INDEX_MAX 128					  // entries kept, the oldest are dropped
+
+// where a serial was last seen: "<serial> <bus> <port.port...>" per line
+typedef struct
+{
+	char serial[256];
+	uint8_t bus;
+	uint8_t port[8];
+	int port_len;
+} dev_index_entry_t;
+
+bool dev_index_find(const char *name, dev_index_entry_t *e);
+void dev_index_put(const dev_index_entry_t *e);
+
+#endif // DEV_INDEX_H__
\ No newline at end of file
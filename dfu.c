@@ -0,0 +1,587 @@
+#include "dfu.h"
+#include "lz.h"
+#include "timedate.h"
+#include "trace.h"
+#include "usb_io.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Note: wIndex will always be 0 in libusb_control_transfer with WinUSB device
+
+int dfu_reboot(libusb_device_handle *handle, bool sub_reboot) { return trace_control_transfer(handle, EP_REQ_OUT, DFU_DETACH, sub_reboot, 0, NULL, 0, 500); }
+int dfu_write(libusb_device_handle *handle, uint8_t fw_index, uint8_t *pkt, uint16_t pkt_len) { return trace_control_transfer(handle, EP_REQ_OUT, DFU_DNLOAD, fw_index, 0, pkt, pkt_len, DFU_DNLOAD_TO); }
+int dfu_get_fw_sts(libusb_device_handle *handle, uint8_t sts[3]) { return trace_control_transfer(handle, EP_REQ_IN, DFU_GETSTATUS, 0, 0, sts, 3, 500); }
+int dfu_get_fw_type(libusb_device_handle *handle, uint8_t type[1]) { return trace_control_transfer(handle, EP_REQ_IN, DFU_GETSTATE, 0, 0, type, 1, 500); }
+int dfu_halt(libusb_device_handle *handle) { return trace_control_transfer(handle, EP_REQ_OUT, DFU_CLRSTATUS, 0, 0, NULL, 0, 500); }
+int dfu_halt_specific(libusb_device_handle *handle, uint8_t fw_index, char *app) { return trace_control_transfer(handle, EP_REQ_OUT, DFU_CLRSTATUS, fw_index, 0, (uint8_t *)app, (uint16_t)strlen(app), 500); }
+
+int dfu_read(libusb_device_handle *handle, uint8_t fw_index, uint32_t offset, uint8_t *pkt, uint32_t pkt_len)
+{
+	uint8_t buf[8];
+	memcpy(&buf[0], &offset, 4);
+	memcpy(&buf[4], &pkt_len, 4);
+	int sts = trace_control_transfer(handle, EP_REQ_OUT, DFU_UPLOAD, fw_index, 0, buf, sizeof(buf), 500);
+	if(sts < 0) return sts;
+	return trace_control_transfer(handle, EP_REQ_IN, DFU_UPLOAD, fw_index, 0, pkt, (uint16_t)pkt_len, 500);
+}
+
+void dfu_upload_init(dfu_upload_t *u, libusb_device_handle *handle, uint8_t fw_index, const dfu_caps_t *caps)
+{
+	memset(u, 0, sizeof(*u));
+	u->handle = handle;
+	u->fw_index = fw_index;
+	u->itf = -1;
+	u->len = DFU_LEGACY_CHUNK;
+	if(!(caps->flags & DFU_CAP_UP_STREAM)) return;
+	u->stream = true;
+	u->len = caps->transfer_size ? caps->transfer_size : DFU_LEGACY_CHUNK;
+	if(caps->bulk_in && usb_io->claim_interface(handle, caps->bulk_itf) == 0)
+	{
+		u->itf = caps->bulk_itf;
+		u->ep = caps->bulk_in;
+		u->len = DFU_UP_BULK_LEN;
+	}
+}
+
+// restart from `offset`, e.g. after a failed packet
+void dfu_upload_seek(dfu_upload_t *u, uint32_t offset)
+{
+	u->off = offset;
+	u->requested = false;
+	u->done = false;
+}
+
+/**
+ * \brief Read the next up to `u->len` bytes of the region to `buf`
+ * \return count of bytes, 0 - end of the region, or libusb error
+ */
+int dfu_upload_next(dfu_upload_t *u, uint8_t *buf)
+{
+	int sts;
+	if(!u->stream)
+	{
+		sts = dfu_read(u->handle, u->fw_index, u->off, buf, u->len);
+		if(sts > 0) u->off += (uint32_t)sts;
+		return sts;
+	}
+	if(u->done) return 0;
+	if(!u->requested)
+	{
+		uint8_t req[8];
+		uint32_t len = UINT32_MAX; // till the end of the region
+		memcpy(&req[0], &u->off, 4);
+		memcpy(&req[4], &len, 4);
+		sts = trace_control_transfer(u->handle, EP_REQ_OUT, DFU_UPLOAD, (uint16_t)(u->fw_index | DFU_UP_STREAM), 0, req, sizeof(req), 500);
+		if(sts < 0) return sts;
+		u->requested = true;
+	}
+	if(u->ep)
+	{
+		int actual = 0;
+		sts = trace_bulk_transfer(u->handle, u->ep, buf, (int)u->len, &actual, 2000);
+		if(sts < 0) return sts; // partial data is dropped, the retry starts from `off`
+		sts = actual;
+	}
+	else
+	{
+		sts = trace_control_transfer(u->handle, EP_REQ_IN, DFU_UPLOAD, (uint16_t)(u->fw_index | DFU_UP_STREAM), 0, buf, (uint16_t)u->len, 500);
+		if(sts < 0) return sts;
+	}
+	if((uint32_t)sts < u->len) u->done = true;
+	u->off += (uint32_t)sts;
+	return sts;
+}
+
+void dfu_upload_free(dfu_upload_t *u)
+{
+	if(u->itf >= 0) usb_io->release_interface(u->handle, u->itf);
+	u->itf = -1;
+}
+
+/**
+ * \brief Read CRC32 (STM32 compatible, see crc32.c) of `count` consecutive
+ * `block` sized blocks starting at `offset`, same OUT/IN pair as dfu_read()
+ */
+int dfu_get_crc(libusb_device_handle *handle, uint8_t fw_index, uint32_t offset, uint32_t block, uint32_t count, uint32_t *crc)
+{
+	uint8_t buf[12];
+	memcpy(&buf[0], &offset, 4);
+	memcpy(&buf[4], &block, 4);
+	memcpy(&buf[8], &count, 4);
+	int sts = trace_control_transfer(handle, EP_REQ_OUT, DFU_GETCRC, fw_index, 0, buf, sizeof(buf), 500);
+	if(sts < 0) return sts;
+	return trace_control_transfer(handle, EP_REQ_IN, DFU_GETCRC, fw_index, 0, (uint8_t *)crc, (uint16_t)(count * 4), 2000);
+}
+
+/**
+ * \brief Collect transfer limits: bMaxPacketSize0, wTransferSize of the DFU
+ * functional descriptor and, when the firmware implements it, DFU_GETCAPS
+ * reply [wTransferSize:2][reserved:2][flags:4][page:4] which takes precedence
+ * \return DFU_GETCAPS reply length or libusb error (caps are valid anyway)
+ */
+int dfu_get_caps(libusb_device_handle *handle, uint8_t fw_index, dfu_caps_t *caps)
+{
+	memset(caps, 0, sizeof(*caps));
+	libusb_device *dev = usb_io->get_device(handle);
+
+	struct libusb_device_descriptor desc;
+	if(usb_io->get_device_descriptor(dev, &desc) == 0) caps->ep0_size = desc.bMaxPacketSize0;
+
+	struct libusb_config_descriptor *conf;
+	if(usb_io->get_active_config_descriptor(dev, &conf) == 0)
+	{
+		for(int i = 0; i < conf->bNumInterfaces; i++)
+		{
+			for(int a = 0; a < conf->interface[i].num_altsetting; a++)
+			{
+				const struct libusb_interface_descriptor *itf = &conf->interface[i].altsetting[a];
+				for(int e = 0; a == 0 && !caps->bulk_in && e < itf->bNumEndpoints; e++)
+				{
+					const struct libusb_endpoint_descriptor *ep = &itf->endpoint[e];
+					if((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN && (ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_BULK)
+					{
+						caps->bulk_in = ep->bEndpointAddress;
+						caps->bulk_itf = itf->bInterfaceNumber;
+					}
+				}
+				for(int k = 0; k + 7 <= itf->extra_length && itf->extra[k] >= 2; k += itf->extra[k])
+				{
+					if(itf->extra[k + 1] == DFU_FUNC_DESC_TYPE) caps->transfer_size = (uint16_t)(itf->extra[k + 5] | (itf->extra[k + 6] << 8));
+				}
+			}
+		}
+		usb_io->free_config_descriptor(conf);
+	}
+
+	uint8_t buf[12] = {0};
+	int sts = trace_control_transfer(handle, EP_REQ_IN, DFU_GETCAPS, fw_index, 0, buf, sizeof(buf), 500);
+	if(sts >= 2)
+	{
+		uint16_t ts;
+		memcpy(&ts, &buf[0], 2);
+		if(ts) caps->transfer_size = ts;
+	}
+	if(sts >= 8) memcpy(&caps->flags, &buf[4], 4);
+	if(sts >= 12) memcpy(&caps->page, &buf[8], 4);
+	return sts;
+}
+
+// largest payload the device takes in one DNLOAD
+uint32_t dfu_chunk_max(const dfu_caps_t *caps)
+{
+	if(caps->transfer_size <= DFU_DNLOAD_HDR) return DFU_LEGACY_CHUNK;
+	return caps->transfer_size - DFU_DNLOAD_HDR;
+}
+
+/**
+ * \brief Fit the requested payload to the device limit. Auto size (0) takes
+ * the whole limit trimmed so that the packet is a multiple of bMaxPacketSize0
+ * and the data stage never ends with a short packet
+ */
+uint32_t dfu_chunk_size(const dfu_caps_t *caps, uint32_t chunk)
+{
+	uint32_t max = dfu_chunk_max(caps);
+	if(chunk) return chunk > max ? max : chunk;
+	if(!caps->transfer_size || !caps->ep0_size || max + DFU_DNLOAD_HDR < 2U * caps->ep0_size) return max;
+	return (max + DFU_DNLOAD_HDR) / caps->ep0_size * caps->ep0_size - DFU_DNLOAD_HDR;
+}
+
+int dfu_src_image(void *arg, uint32_t pos, dfu_op_t *op)
+{
+	const dfu_src_image_t *s = arg;
+	if(s->map)
+	{
+		while(pos < s->length && s->map[pos / s->chunk] == DFU_CHUNK_SKIP)
+			pos += s->chunk;
+	}
+	if(pos >= s->length) return 0;
+	op->request = DFU_DNLOAD;
+	op->value = s->fw_index;
+	op->off = pos;
+	op->pos = pos;
+	if(s->map && s->map[pos / s->chunk] == DFU_CHUNK_FILL) // merge the whole erased run into one range
+	{
+		uint32_t end = pos;
+		while(end < s->length && s->map[end / s->chunk] == DFU_CHUNK_FILL)
+			end += s->chunk;
+		if(end > s->length) end = s->length;
+		uint32_t len = end - pos;
+		op->value |= DFU_DN_FILL;
+		memcpy(op->imm, &len, 4);
+		op->data = op->imm;
+		op->len = 4;
+		op->next = end;
+		return 1;
+	}
+	op->data = &s->content[pos];
+	op->len = s->length - pos > s->chunk ? s->chunk : s->length - pos;
+	op->next = pos + op->len;
+	return 1;
+}
+
+// queued packets are copied on submit, so only a rewind to the oldest one needs the bytes behind the cursor
+int dfu_src_stream_init(dfu_src_stream_t *s, FILE *f, uint32_t chunk, uint8_t fw_index, uint32_t depth)
+{
+	memset(s, 0, sizeof(*s));
+	s->f = f;
+	s->chunk = chunk;
+	s->fw_index = fw_index;
+	s->keep = (depth ? depth : 1) * chunk;
+	s->size = s->keep + chunk + DFU_STREAM_READ;
+	s->buf = malloc(s->size);
+	return s->buf ? 0 : LIBUSB_ERROR_NO_MEM;
+}
+
+void dfu_src_stream_free(dfu_src_stream_t *s)
+{
+	free(s->buf);
+	s->buf = NULL;
+}
+
+int dfu_src_stream(void *arg, uint32_t pos, dfu_op_t *op)
+{
+	dfu_src_stream_t *s = arg;
+	if(pos < s->base) return LIBUSB_ERROR_INVALID_PARAM; // rewound past the window
+	while(!s->eof && pos + s->chunk > s->base + s->fill)
+	{
+		uint32_t drop = pos > s->base + s->keep ? pos - s->keep - s->base : 0;
+		if(drop > s->fill) drop = s->fill;
+		memmove(s->buf, &s->buf[drop], s->fill - drop);
+		s->base += drop;
+		s->fill -= drop;
+
+		size_t n = fread(&s->buf[s->fill], 1, s->size - s->fill, s->f);
+		if(n == 0 && ferror(s->f)) return LIBUSB_ERROR_IO;
+		s->fill += (uint32_t)n;
+		s->eof = n == 0;
+	}
+	if(pos >= s->base + s->fill) return 0;
+	op->request = DFU_DNLOAD;
+	op->value = s->fw_index;
+	op->off = pos;
+	op->pos = pos;
+	op->data = &s->buf[pos - s->base];
+	op->len = s->base + s->fill - pos > s->chunk ? s->chunk : s->base + s->fill - pos;
+	op->next = pos + op->len;
+	return 1;
+}
+
+static uint32_t run_end(const dfu_src_image_t *img, uint32_t pos)
+{
+	uint32_t end = pos;
+	while(end < img->length && (!img->map || img->map[end / img->chunk] == DFU_CHUNK_SEND))
+		end = (end / img->chunk + 1) * img->chunk;
+	return end > img->length ? img->length : end;
+}
+
+/**
+ * \brief Cut the image into frames: each one holds as much data as compresses
+ * into a single packet (at most DFU_LZ_FRAME decoded, multiple of 4 unless it
+ * ends a run), frames that don't pay off are sent as plain chunks
+ */
+int dfu_src_lz_init(dfu_src_lz_t *s, dfu_src_image_t *img)
+{
+	memset(s, 0, sizeof(*s));
+	s->img = img;
+	if(img->chunk <= 2 + LZ_MIN) return -1;
+	s->z = malloc(img->length + img->chunk); // frames are kept only when smaller than the data, plus room for the last try
+	if(!s->z) return -1;
+
+	uint32_t z_top = 0, cap = 0;
+	for(uint32_t pos = 0; pos < img->length;)
+	{
+		if(img->map && img->map[pos / img->chunk] != DFU_CHUNK_SEND)
+		{
+			pos += img->chunk;
+			continue;
+		}
+		uint32_t end = run_end(img, pos);
+		while(pos < end)
+		{
+			if(s->frames == cap) // frame length depends on the data, so grow as they come
+			{
+				cap = cap ? cap * 2 : 64;
+				dfu_lz_frame_t *p = realloc(s->frame, cap * sizeof(dfu_lz_frame_t));
+				if(!p)
+				{
+					dfu_src_lz_free(s);
+					return -1;
+				}
+				s->frame = p;
+			}
+			dfu_lz_frame_t *fr = &s->frame[s->frames++];
+			uint32_t len = end - pos > DFU_LZ_FRAME ? DFU_LZ_FRAME : end - pos, z_len = 0;
+			for(;;)
+			{
+				z_len = lz_encode(&img->content[pos], len, &s->z[z_top + 2], img->chunk - 2, &len);
+				if(pos + len == end || (len & 3U) == 0) break;
+				len &= ~3U; // keep frames word aligned, encode again for the trimmed length
+			}
+			if(z_len + 2 >= len || len == 0) // incompressible: plain chunk
+			{
+				fr->pos = pos;
+				fr->len = end - pos > img->chunk ? img->chunk : end - pos;
+				fr->z_len = 0;
+			}
+			else
+			{
+				uint16_t raw_len = (uint16_t)len;
+				memcpy(&s->z[z_top], &raw_len, 2);
+				fr->pos = pos;
+				fr->len = len;
+				fr->z_off = z_top;
+				fr->z_len = z_len + 2;
+				z_top += fr->z_len;
+			}
+			s->raw_bytes += fr->len;
+			s->z_bytes += fr->z_len ? fr->z_len : fr->len;
+			pos += fr->len;
+		}
+	}
+	return 0;
+}
+
+void dfu_src_lz_free(dfu_src_lz_t *s)
+{
+	free(s->frame);
+	free(s->z);
+	s->frame = NULL;
+	s->z = NULL;
+	s->frames = 0;
+}
+
+int dfu_src_lz(void *arg, uint32_t pos, dfu_op_t *op)
+{
+	const dfu_src_lz_t *s = arg;
+	dfu_src_image_t *img = s->img;
+	if(img->map)
+	{
+		while(pos < img->length && img->map[pos / img->chunk] == DFU_CHUNK_SKIP)
+			pos += img->chunk;
+		if(pos < img->length && img->map[pos / img->chunk] != DFU_CHUNK_SEND) return dfu_src_image(img, pos, op);
+	}
+	if(pos >= img->length) return 0;
+
+	uint32_t lo = 0, hi = s->frames;
+	while(hi - lo > 1) // last frame starting at or before `pos`
+	{
+		uint32_t mid = (lo + hi) / 2;
+		if(s->frame[mid].pos <= pos) lo = mid;
+		else hi = mid;
+	}
+	const dfu_lz_frame_t *fr = &s->frame[lo];
+	if(!s->frames || fr->pos != pos) return -1; // cursor is not at a frame boundary
+
+	op->request = DFU_DNLOAD;
+	op->value = img->fw_index;
+	op->off = pos;
+	op->pos = pos;
+	op->next = pos + fr->len;
+	if(fr->z_len)
+	{
+		op->value |= DFU_DN_LZ;
+		op->data = &s->z[fr->z_off];
+		op->len = fr->z_len;
+	}
+	else
+	{
+		op->data = &img->content[pos];
+		op->len = fr->len;
+	}
+	return 1;
+}
+
+typedef struct
+{
+	struct libusb_transfer *xfer;
+	dfu_op_t op;
+	bool done;
+	int sts;
+	int *completed;
+	TD_V t_submit;
+	TD_V t_done;
+	uint64_t trace_t0;
+} dfu_slot_t;
+
+static int xfer_sts2err(enum libusb_transfer_status sts)
+{
+	switch(sts)
+	{
+	case LIBUSB_TRANSFER_COMPLETED: return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_CANCELLED: return LIBUSB_ERROR_INTERRUPTED;
+	case LIBUSB_TRANSFER_STALL: return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW: return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_ERROR:
+	default: return LIBUSB_ERROR_IO;
+	}
+}
+
+static void LIBUSB_CALL dfu_queue_cb(struct libusb_transfer *xfer)
+{
+	dfu_slot_t *s = xfer->user_data;
+	TD_GET(s->t_done);
+	s->sts = xfer->status == LIBUSB_TRANSFER_COMPLETED ? xfer->actual_length : xfer_sts2err(xfer->status);
+	s->done = true;
+	*s->completed = 1;
+	if(trace_enabled())
+	{
+		trace_entry_t e = {.t0_ns = s->trace_t0, .t1_ns = trace_now(), .kind = TRACE_CTRL_ASYNC, .request_type = EP_REQ_OUT, .request = s->op.request,
+						   .value = s->op.value, .length = DFU_DNLOAD_HDR + s->op.len, .status = s->sts, .offset = s->op.off};
+		trace_record(&e, xfer->dev_handle);
+	}
+}
+
+static int dfu_queue_submit(dfu_queue_t *q, dfu_slot_t *s)
+{
+	uint8_t *buf = s->xfer->buffer;
+	libusb_fill_control_setup(buf, EP_REQ_OUT, s->op.request, s->op.value, 0, (uint16_t)(DFU_DNLOAD_HDR + s->op.len));
+	memcpy(&buf[LIBUSB_CONTROL_SETUP_SIZE], &s->op.off, DFU_DNLOAD_HDR);
+	if(s->op.len) memcpy(&buf[LIBUSB_CONTROL_SETUP_SIZE + DFU_DNLOAD_HDR], s->op.data, s->op.len);
+	libusb_fill_control_transfer(s->xfer, q->handle, buf, dfu_queue_cb, s, q->timeout_ms);
+	s->done = false;
+	TD_GET(s->t_submit);
+	if(trace_enabled()) s->trace_t0 = trace_now();
+	return usb_io->submit_transfer(s->xfer);
+}
+
+/**
+ * \brief Write everything `q->src` produces starting at cursor `q->pos`,
+ * keeping up to `q->depth` DNLOAD transfers queued on EP0. Packets are
+ * submitted and acknowledged strictly in cursor order; on the first failure
+ * nothing new is submitted, the rest of the queue is cancelled and drained,
+ * and the writer restarts from the failed packet (DFU_RETRY_CNT attempts).
+ * \return 0 on success, libusb error otherwise (`q->pos` - acknowledged cursor)
+ */
+int dfu_queue_run(dfu_queue_t *q)
+{
+	uint32_t depth = q->depth ? q->depth : 1;
+	dfu_slot_t *slots = calloc(depth, sizeof(dfu_slot_t));
+	if(!slots) return LIBUSB_ERROR_NO_MEM;
+
+	int completed = 0, ret = 0;
+	for(uint32_t i = 0; i < depth; i++)
+	{
+		slots[i].completed = &completed;
+		slots[i].xfer = usb_io->alloc_transfer(0);
+		if(!slots[i].xfer) ret = LIBUSB_ERROR_NO_MEM;
+		else if(!(slots[i].xfer->buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + DFU_DNLOAD_HDR + q->max_len))) ret = LIBUSB_ERROR_NO_MEM;
+	}
+
+	uint32_t head = 0, tail = 0, inflight = 0;
+	TD_V t_prev = {0}; // previous completion, transfers are serviced one after another
+	uint32_t pos = q->pos, rewind_pos = 0, fail_pos = 0, fail_cnt = 0;
+	bool eof = false, failed = ret != 0, fatal = ret != 0;
+
+	for(;;)
+	{
+		while(!failed && !eof && inflight < depth)
+		{
+			dfu_slot_t *s = &slots[tail];
+			int sts = q->src(q->src_arg, pos, &s->op);
+			if(sts < 0)
+			{
+				q->err = ret = sts;
+				q->err_off = pos;
+				failed = fatal = true;
+				break;
+			}
+			if(sts == 0)
+			{
+				eof = true;
+				break;
+			}
+			if((sts = dfu_queue_submit(q, s)) < 0)
+			{
+				q->err = sts;
+				q->err_off = s->op.off;
+				rewind_pos = inflight ? slots[head].op.pos : s->op.pos; // the queued ones are drained unacknowledged
+				failed = true;
+				if(sts == LIBUSB_ERROR_NO_DEVICE) fatal = true;
+				for(uint32_t i = 0, k = head; i < inflight; i++, k = (k + 1) % depth)
+					usb_io->cancel_transfer(slots[k].xfer);
+				break;
+			}
+			pos = s->op.next;
+			tail = (tail + 1) % depth;
+			inflight++;
+		}
+
+		if(inflight == 0)
+		{
+			if(!failed) break; // everything acknowledged
+			if(fatal)
+			{
+				if(!ret) ret = q->err;
+				break;
+			}
+			if(fail_cnt && fail_pos == rewind_pos)
+			{
+				if(++fail_cnt >= DFU_RETRY_CNT)
+				{
+					ret = q->err;
+					break;
+				}
+			}
+			else
+			{
+				fail_pos = rewind_pos;
+				fail_cnt = 1;
+			}
+			pos = rewind_pos;
+			failed = eof = false;
+			continue;
+		}
+
+		while(!completed)
+		{
+			int sts = usb_io->handle_events_completed(NULL, &completed);
+			if(sts < 0 && sts != LIBUSB_ERROR_INTERRUPTED && !fatal)
+			{
+				q->err = ret = sts;
+				failed = fatal = true;
+				for(uint32_t i = 0, k = head; i < inflight; i++, k = (k + 1) % depth)
+					usb_io->cancel_transfer(slots[k].xfer);
+			}
+		}
+		completed = 0;
+
+		while(inflight && slots[head].done)
+		{
+			dfu_slot_t *s = &slots[head];
+			head = (head + 1) % depth;
+			inflight--;
+			if(failed) continue; // drained after a failure, will be sent again
+			if(q->done)
+			{
+				TD_V *t0 = (t_prev.tv_sec > s->t_submit.tv_sec || (t_prev.tv_sec == s->t_submit.tv_sec && t_prev.tv_nsec > s->t_submit.tv_nsec)) ? &t_prev : &s->t_submit;
+				q->done(q->done_arg, &s->op, s->sts, (uint32_t)(TD_CALC_us(s->t_done, (*t0))));
+			}
+			t_prev = s->t_done;
+			if(s->sts >= 0)
+			{
+				q->pos = s->op.next;
+				if(q->progress) q->progress(q->progress_arg, q->pos);
+				continue;
+			}
+			q->err = s->sts;
+			q->err_off = s->op.off;
+			rewind_pos = s->op.pos;
+			failed = true;
+			if(s->sts == LIBUSB_ERROR_NO_DEVICE) fatal = true;
+			for(uint32_t i = 0, k = head; i < inflight; i++, k = (k + 1) % depth)
+				usb_io->cancel_transfer(slots[k].xfer);
+		}
+	}
+
+	for(uint32_t i = 0; i < depth; i++)
+	{
+		if(!slots[i].xfer) continue;
+		free(slots[i].xfer->buffer);
+		slots[i].xfer->buffer = NULL;
+		usb_io->free_transfer(slots[i].xfer);
+	}
+	free(slots);
+	return ret;
+}
\ No newline at end of file
@@ -0,0 +1,203 @@
+#ifndef DFU_H__
+#define DFU_H__
+
+#include <libusb-1.0/libusb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum
+{
+	DFU_DETACH = 0,
+	DFU_DNLOAD,
+	DFU_UPLOAD,
+	DFU_GETSTATUS,
+	DFU_CLRSTATUS,
+	DFU_GETSTATE,
+	DFU_ABORT,
+	DFU_GETCAPS, // extension, stalled by legacy firmware
+	DFU_GETCRC,	 // extension, DFU_CAP_CRC_MAP
+};
+
+#define DFU_CAP_CRC_MAP (1U << 0) // per-block CRC32 of the flashed region
+#define DFU_CAP_FILL (1U << 1)	  // DFU_DN_FILL ranges
+#define DFU_CAP_LZ (1U << 2)	  // DFU_DN_LZ frames (see lz.h), up to DFU_LZ_FRAME bytes decoded
+#define DFU_CAP_UP_STREAM (1U << 3) // DFU_UP_STREAM reads
+
+// DNLOAD wValue is fw_index | DFU_DN_* packet kind in the high byte
+#define DFU_DN_FILL (1U << 8) // [off:4][len:4] - range is erased (0xFF), nothing to program
+#define DFU_DN_LZ (1U << 9)	  // [off:4][raw_len:2][lz stream] - program raw_len decoded bytes
+
+// UPLOAD wValue is fw_index | DFU_UP_* in the high byte
+#define DFU_UP_STREAM (1U << 8) // [off:4][len:4] - stream the range in IN packets (bulk IN if present) till a short one
+
+#define DFU_LZ_FRAME 4096
+#define DFU_UP_BULK_LEN 0x10000 // bytes asked per bulk IN transfer
+#define DFU_STREAM_READ 0x10000 // bytes read from a pipe at once
+
+
+typedef enum
+{
+	FW_PREBOOT = 0,
+	FW_BOOT,
+	FW_APP,
+} FW_TYPE_t;
+
+#define EP_REQ_IN LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE
+#define EP_REQ_OUT LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE
+
+#define DFU_DNLOAD_HDR 4 // every DNLOAD packet starts with the destination offset
+#define DFU_DNLOAD_TO 4500
+#define DFU_RETRY_CNT 5
+#define DFU_LEGACY_CHUNK 256 // payload accepted by every firmware version
+
+#define DFU_FUNC_DESC_TYPE 0x21
+
+typedef struct
+{
+	uint16_t transfer_size; // max DNLOAD wLength, 0 - unknown
+	uint8_t ep0_size;		// bMaxPacketSize0
+	uint32_t flags;			// DFU_CAP_* reported by DFU_GETCAPS
+	uint32_t page;			// erase page, the first write to a page erases all of it; 0 - unknown
+	uint8_t bulk_in;		// bulk IN endpoint address, 0 - none
+	uint8_t bulk_itf;		// interface it belongs to
+} dfu_caps_t;
+
+int dfu_reboot(libusb_device_handle *handle, bool sub_reboot);
+int dfu_write(libusb_device_handle *handle, uint8_t fw_index, uint8_t *pkt, uint16_t pkt_len);
+int dfu_get_fw_sts(libusb_device_handle *handle, uint8_t sts[3]);
+int dfu_get_fw_type(libusb_device_handle *handle, uint8_t type[1]);
+int dfu_halt(libusb_device_handle *handle);
+int dfu_halt_specific(libusb_device_handle *handle, uint8_t fw_index, char *app);
+int dfu_read(libusb_device_handle *handle, uint8_t fw_index, uint32_t offset, uint8_t *pkt, uint32_t pkt_len);
+int dfu_get_caps(libusb_device_handle *handle, uint8_t fw_index, dfu_caps_t *caps);
+int dfu_get_crc(libusb_device_handle *handle, uint8_t fw_index, uint32_t offset, uint32_t block, uint32_t count, uint32_t *crc);
+uint32_t dfu_chunk_size(const dfu_caps_t *caps, uint32_t chunk);
+uint32_t dfu_chunk_max(const dfu_caps_t *caps);
+
+/**
+ * Sequential reader of a fw region: one DFU_UP_STREAM request for the rest of
+ * the region when the device supports it, OUT/IN dfu_read() pairs otherwise
+ */
+typedef struct
+{
+	libusb_device_handle *handle;
+	uint8_t fw_index;
+	bool stream;
+	uint8_t ep;		 // bulk IN endpoint, 0 - control IN
+	int itf;		 // claimed interface, -1 - none
+	uint32_t len;	 // bytes per dfu_upload_next(), buffer size it needs
+	uint32_t off;	 // next offset to read
+	bool requested;	 // stream is running from `off`
+	bool done;		 // short packet seen
+} dfu_upload_t;
+
+void dfu_upload_init(dfu_upload_t *u, libusb_device_handle *handle, uint8_t fw_index, const dfu_caps_t *caps);
+void dfu_upload_seek(dfu_upload_t *u, uint32_t offset);
+int dfu_upload_next(dfu_upload_t *u, uint8_t *buf);
+void dfu_upload_free(dfu_upload_t *u);
+
+/**
+ * One DNLOAD packet of the queued writer: [off:4][data:len] sent with
+ * bRequest/wValue. `pos`/`next` is the source cursor before/after the packet,
+ * the writer rewinds to `pos` when the packet fails.
+ */
+typedef struct
+{
+	uint8_t request;
+	uint16_t value;
+	uint32_t off;
+	const uint8_t *data;
+	uint32_t len;
+	uint32_t pos;
+	uint32_t next;
+	uint8_t imm[8]; // storage for short payloads, `data` may point here
+} dfu_op_t;
+
+// Fill `op` for cursor `pos`: returns 1 - op is ready, 0 - nothing left, <0 - error
+typedef int (*dfu_op_src_t)(void *arg, uint32_t pos, dfu_op_t *op);
+
+typedef struct
+{
+	libusb_device_handle *handle;
+	uint32_t depth;		 // transfers kept in flight
+	uint32_t max_len;	 // largest op data length the source produces
+	uint32_t timeout_ms; // per transfer timeout
+	dfu_op_src_t src;
+	void *src_arg;
+	void (*progress)(void *arg, uint32_t pos); // called on every acknowledged op
+	void *progress_arg;
+	void (*done)(void *arg, const dfu_op_t *op, int sts, uint32_t latency_us); // optional, on every op that ended on the wire
+	void *done_arg;
+	uint32_t pos;	   // in: cursor to start from, out: acknowledged cursor
+	uint32_t err_off;  // offset of the packet that failed
+	int err;		   // libusb error of the failed packet
+} dfu_queue_t;
+
+int dfu_queue_run(dfu_queue_t *q);
+
+enum
+{
+	DFU_CHUNK_SEND = 0,
+	DFU_CHUNK_SKIP, // device already holds it
+	DFU_CHUNK_FILL, // erased, sent as a DFU_DN_FILL range
+};
+
+// Plain image source: consecutive `chunk` sized packets of `content`
+typedef struct
+{
+	const uint8_t *content;
+	uint32_t length;
+	uint32_t chunk;
+	uint8_t fw_index;
+	const uint8_t *map; // optional DFU_CHUNK_* per chunk
+} dfu_src_image_t;
+
+int dfu_src_image(void *arg, uint32_t pos, dfu_op_t *op);
+
+/**
+ * Pipe source: consecutive `chunk` sized packets read from `f` through a
+ * window that keeps `keep` bytes behind the cursor for rewinds, so memory
+ * doesn't depend on the image size
+ */
+typedef struct
+{
+	FILE *f;
+	uint32_t chunk;
+	uint8_t fw_index;
+	uint32_t keep;
+	uint8_t *buf;
+	uint32_t size;
+	uint32_t base; // stream offset of buf[0]
+	uint32_t fill; // valid bytes in buf
+	bool eof;
+} dfu_src_stream_t;
+
+int dfu_src_stream_init(dfu_src_stream_t *s, FILE *f, uint32_t chunk, uint8_t fw_index, uint32_t depth);
+void dfu_src_stream_free(dfu_src_stream_t *s);
+int dfu_src_stream(void *arg, uint32_t pos, dfu_op_t *op);
+
+typedef struct
+{
+	uint32_t pos;	// image offset
+	uint32_t len;	// image bytes it covers
+	uint32_t z_off; // [raw_len:2][lz stream] in `z`
+	uint32_t z_len; // 0 - sent as is
+} dfu_lz_frame_t;
+
+// Compressed image source: DFU_CHUNK_SEND runs of `img` cut into DFU_DN_LZ frames
+typedef struct
+{
+	dfu_src_image_t *img;
+	dfu_lz_frame_t *frame;
+	uint32_t frames;
+	uint8_t *z;
+	uint32_t raw_bytes; // image bytes covered by frames
+	uint32_t z_bytes;	// bytes they take on the wire
+} dfu_src_lz_t;
+
+int dfu_src_lz_init(dfu_src_lz_t *s, dfu_src_image_t *img);
+void dfu_src_lz_free(dfu_src_lz_t *s);
+int dfu_src_lz(void *arg, uint32_t pos, dfu_op_t *op);
+
+#endif // DFU_H__
\ No newline at end of file
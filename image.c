@@ -0,0 +1,81 @@
+#include "image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32) && !defined(WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static int image_read(image_t *img, const char *file_name)
+{
+	FILE *f = fopen(file_name, "rb");
+	if(!f) return IMAGE_ERR_OPEN;
+	fseek(f, 0, SEEK_END);
+	long len = ftell(f);
+	rewind(f);
+	if(len < 0)
+	{
+		fclose(f);
+		return IMAGE_ERR_READ;
+	}
+	img->length = (size_t)len;
+	img->data = malloc(img->length ? img->length : 1);
+	size_t read = img->data ? fread(img->data, 1, img->length, f) : 0;
+	fclose(f);
+	if(read != img->length)
+	{
+		free(img->data);
+		img->data = NULL;
+		return IMAGE_ERR_READ;
+	}
+	return 0;
+}
+
+/**
+ * \brief Map `file_name` privately (pages are loaded as packets touch them,
+ * writes stay local), or read it into a buffer where mapping is unsupported
+ * \return 0 or IMAGE_ERR_*
+ */
+int image_load(image_t *img, const char *file_name)
+{
+	memset(img, 0, sizeof(*img));
+#if !defined(_WIN32) && !defined(WIN32)
+	int fd = open(file_name, O_RDONLY);
+	if(fd < 0) return IMAGE_ERR_OPEN;
+	struct stat st;
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		void *p = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if(p != MAP_FAILED)
+		{
+			madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+			close(fd);
+			img->data = p;
+			img->length = (size_t)st.st_size;
+			img->mapped = true;
+			return 0;
+		}
+	}
+	close(fd);
+#endif
+	return image_read(img, file_name);
+}
+
+void image_free(image_t *img)
+{
+#if !defined(_WIN32) && !defined(WIN32)
+	if(img->mapped)
+	{
+		munmap(img->data, img->length);
+	}
+	else
+#endif
+	{
+		free(img->data);
+	}
+	memset(img, 0, sizeof(*img));
+}
\ No newline at end of file
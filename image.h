@@ -0,0 +1,25 @@
+#ifndef IMAGE_H__
+#define IMAGE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+	IMAGE_ERR_OPEN = 1,
+	IMAGE_ERR_READ,
+};
+
+// whole file in memory: mapped, or read in when the file can't be mapped
+typedef struct
+{
+	uint8_t *data;
+	size_t length;
+	bool mapped;
+} image_t;
+
+int image_load(image_t *img, const char *file_name);
+void image_free(image_t *img);
+
+#endif // IMAGE_H__
\ No newline at end of file
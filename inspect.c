@@ -0,0 +1,331 @@
+#include "inspect.h"
+#include "image.h"
+#include "parser.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#if !defined(_WIN32) && !defined(WIN32)
+#include <unistd.h>
+#endif
+
+#define PATH_MAX_LEN 4096
+
+// growing text buffer a record is printed into
+typedef struct
+{
+	char *s;
+	size_t len;
+	size_t cap;
+} sbuf_t;
+
+typedef struct
+{
+	char **path;
+	int count;
+	int cap;
+	char **out; // record per path
+	int format;
+	atomic_int next;
+	atomic_int failed;
+} inspect_t;
+
+static void sb_printf(sbuf_t *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void sb_printf(sbuf_t *b, const char *fmt, ...)
+{
+	for(;;)
+	{
+		va_list ap;
+		va_start(ap, fmt);
+		int n = vsnprintf(b->s ? &b->s[b->len] : NULL, b->s ? b->cap - b->len : 0, fmt, ap);
+		va_end(ap);
+		if(n < 0) return;
+		if(b->s && b->len + (size_t)n < b->cap)
+		{
+			b->len += (size_t)n;
+			return;
+		}
+		size_t cap = b->cap ? b->cap * 2 : 256;
+		while(cap <= b->len + (size_t)n) cap *= 2;
+		char *s = realloc(b->s, cap);
+		if(!s) return;
+		b->s = s;
+		b->cap = cap;
+	}
+}
+
+// text as a JSON string or a CSV cell, bytes outside of printable ASCII are escaped
+static void sb_str(sbuf_t *b, int format, const char *s, size_t len)
+{
+	sb_printf(b, "\"");
+	for(size_t i = 0; i < len; i++)
+	{
+		unsigned char c = (unsigned char)s[i];
+		if(format == INSPECT_CSV)
+		{
+			if(c == '"') sb_printf(b, "\"\"");
+			else if(c < 0x20 || c >= 0x7F) sb_printf(b, "\\x%02x", c);
+			else sb_printf(b, "%c", c);
+		}
+		else
+		{
+			if(c == '"' || c == '\\') sb_printf(b, "\\%c", c);
+			else if(c < 0x20 || c >= 0x7F) sb_printf(b, "\\u%04x", c);
+			else sb_printf(b, "%c", c);
+		}
+	}
+	sb_printf(b, "\"");
+}
+
+typedef struct
+{
+	sbuf_t b;
+	int format;
+	int count;
+} fields_t;
+
+static void on_fw_field(void *arg, const char *key, const uint8_t *value, uint32_t len, uint32_t addr)
+{
+	(void)addr;
+	fields_t *f = arg;
+	if(f->format == INSPECT_CSV)
+	{
+		sb_printf(&f->b, "%s%s=%.*s", f->count ? ";" : "", key, (int)len, (const char *)value);
+	}
+	else
+	{
+		sb_printf(&f->b, "%s", f->count ? "," : "");
+		sb_str(&f->b, f->format, key, strlen(key));
+		sb_printf(&f->b, ":");
+		sb_str(&f->b, f->format, (const char *)value, len);
+	}
+	f->count++;
+}
+
+static void on_cfg_entry(void *arg, const char *key, const uint8_t *value, uint32_t len, uint32_t addr)
+{
+	fields_t *f = arg;
+	if(f->format == INSPECT_CSV)
+	{
+		sb_printf(&f->b, "%s%s=", f->count ? ";" : "", key);
+	}
+	else
+	{
+		sb_printf(&f->b, "%s{\"key\":", f->count ? "," : "");
+		sb_str(&f->b, f->format, key, strlen(key));
+		sb_printf(&f->b, ",\"size\":%u,\"addr\":%u,\"value\":\"", len, addr);
+	}
+	for(uint32_t i = 0; i < len; i++)
+		sb_printf(&f->b, "%02x", value[i]);
+	if(f->format != INSPECT_CSV) sb_printf(&f->b, "\"}");
+	f->count++;
+}
+
+static char *inspect_file(const char *path, int format, bool *failed)
+{
+	sbuf_t b = {0};
+	image_t img;
+	int ld = image_load(&img, path);
+	*failed = ld != 0;
+
+	parse_fw_result_t fw = {0};
+	fields_t fw_fields = {.format = format}, cfg_entries = {.format = format};
+	int fw_sts = 0, cfg_sts = 0;
+	const char *type = "error";
+	if(!ld)
+	{
+		fw_sts = parse_fw(img.data, img.length, &fw, on_fw_field, &fw_fields);
+		cfg_sts = parse_cfg(img.data, img.length, on_cfg_entry, &cfg_entries);
+		type = fw_sts == 0 ? "fw" : (cfg_sts == 0 ? "cfg" : "unknown");
+	}
+	const char *error = ld == IMAGE_ERR_OPEN ? "open" : "read";
+
+	if(format == INSPECT_CSV)
+	{
+		sb_str(&b, format, path, strlen(path));
+		if(ld)
+		{
+			sb_printf(&b, ",,%s,%s,,,,,,,,,,\n", type, error);
+		}
+		else
+		{
+			sb_printf(&b, ",%zu,%s,,%s,", img.length, type, parse_fw_lock_str(fw_sts));
+			if(fw.header)
+				sb_printf(&b, "%u,%u,%08x,%08x,%d,%u,", fw.offset, fw.fw_size, fw.fw_crc32, fw.crc_calc, fw.fw_crc32 == fw.crc_calc, fw.fields_addr_offset);
+			else
+				sb_printf(&b, ",,,,,,");
+			sb_str(&b, format, fw_fields.b.s ? fw_fields.b.s : "", fw_fields.b.len);
+			sb_printf(&b, ",%s,", parse_cfg_sts_str(cfg_sts));
+			sb_str(&b, format, cfg_entries.b.s ? cfg_entries.b.s : "", cfg_entries.b.len);
+			sb_printf(&b, "\n");
+		}
+	}
+	else
+	{
+		sb_printf(&b, "{\"file\":");
+		sb_str(&b, format, path, strlen(path));
+		if(ld)
+		{
+			sb_printf(&b, ",\"type\":\"%s\",\"error\":\"%s\"}", type, error);
+		}
+		else
+		{
+			sb_printf(&b, ",\"size\":%zu,\"type\":\"%s\",\"fw\":{\"status\":\"%s\"", img.length, type, parse_fw_lock_str(fw_sts));
+			if(fw.header)
+			{
+				sb_printf(&b, ",\"offset\":%u,\"fw_size\":%u,\"fw_crc32\":\"%08x\",\"crc_calc\":\"%08x\",\"crc_ok\":%s,\"fields_addr\":%u",
+						  fw.offset, fw.fw_size, fw.fw_crc32, fw.crc_calc, fw.fw_crc32 == fw.crc_calc ? "true" : "false", fw.fields_addr_offset);
+			}
+			sb_printf(&b, ",\"fields\":{%s}},\"cfg\":{\"status\":\"%s\",\"entries\":[%s]}}",
+					  fw_fields.b.s ? fw_fields.b.s : "", parse_cfg_sts_str(cfg_sts), cfg_entries.b.s ? cfg_entries.b.s : "");
+		}
+	}
+
+	free(fw_fields.b.s);
+	free(cfg_entries.b.s);
+	if(!ld) image_free(&img);
+	return b.s;
+}
+
+static void *inspect_job(void *arg)
+{
+	inspect_t *in = arg;
+	for(int i; (i = atomic_fetch_add(&in->next, 1)) < in->count;)
+	{
+		bool failed;
+		in->out[i] = inspect_file(in->path[i], in->format, &failed);
+		if(failed) atomic_fetch_add(&in->failed, 1);
+	}
+	return NULL;
+}
+
+static int path_add(inspect_t *in, const char *path)
+{
+	if(in->count == in->cap)
+	{
+		int cap = in->cap ? in->cap * 2 : 64;
+		char **p = realloc(in->path, (size_t)cap * sizeof(char *));
+		if(!p) return -1;
+		in->path = p;
+		in->cap = cap;
+	}
+	in->path[in->count] = strdup(path);
+	if(!in->path[in->count]) return -1;
+	in->count++;
+	return 0;
+}
+
+static int path_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// regular files below `dir`, sorted, depth first
+static int walk_dir(inspect_t *in, const char *dir)
+{
+	DIR *d = opendir(dir);
+	if(!d)
+	{
+		fprintf(stderr, "warn:    can't open directory %s\n", dir);
+		return 0;
+	}
+	int first = in->count;
+	for(struct dirent *e; (e = readdir(d));)
+	{
+		if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+		char path[PATH_MAX_LEN];
+		if(snprintf(path, sizeof(path), "%s/%s", dir, e->d_name) >= (int)sizeof(path)) continue;
+		if(path_add(in, path))
+		{
+			closedir(d);
+			return -1;
+		}
+	}
+	closedir(d);
+
+	// entries of this directory are replaced by the files they hold
+	int last = in->count;
+	qsort(&in->path[first], (size_t)(last - first), sizeof(char *), path_cmp);
+	char **entry = malloc((size_t)(last - first + 1) * sizeof(char *));
+	if(!entry) return -1;
+	memcpy(entry, &in->path[first], (size_t)(last - first) * sizeof(char *));
+	in->count = first;
+	int sts = 0;
+	for(int i = 0; i < last - first; i++)
+	{
+		struct stat st;
+		if(sts == 0 && stat(entry[i], &st) == 0)
+		{
+			if(S_ISDIR(st.st_mode)) sts = walk_dir(in, entry[i]);
+			else if(S_ISREG(st.st_mode)) sts = path_add(in, entry[i]);
+		}
+		free(entry[i]);
+	}
+	free(entry);
+	return sts;
+}
+
+int inspect_run(char *const paths[], int count, int format, int jobs, FILE *out)
+{
+	inspect_t in = {.format = format};
+	int sts = 0;
+	for(int i = 0; i < count && sts == 0; i++)
+	{
+		struct stat st;
+		sts = stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode) ? walk_dir(&in, paths[i]) : path_add(&in, paths[i]);
+	}
+	if(sts == 0 && in.count) in.out = calloc((size_t)in.count, sizeof(char *));
+	if(sts || (in.count && !in.out))
+	{
+		fprintf(stderr, "error:    no memory for the file list\n");
+		for(int i = 0; i < in.count; i++)
+			free(in.path[i]);
+		free(in.path);
+		return -1;
+	}
+
+	if(jobs <= 0)
+	{
+		jobs = 4;
+#if !defined(_WIN32) && !defined(WIN32)
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if(cpus > 0) jobs = (int)cpus;
+#endif
+	}
+	if(jobs > INSPECT_JOBS_MAX) jobs = INSPECT_JOBS_MAX;
+	if(jobs > in.count) jobs = in.count;
+
+	pthread_t thr[INSPECT_JOBS_MAX];
+	int started = 0;
+	for(; started < jobs - 1; started++) // the caller is a worker too
+		if(pthread_create(&thr[started], NULL, inspect_job, &in)) break;
+	inspect_job(&in);
+	for(int i = 0; i < started; i++)
+		pthread_join(thr[i], NULL);
+
+	if(format == INSPECT_CSV)
+		fprintf(out, "file,size,type,error,fw_status,fw_offset,fw_size,fw_crc32,fw_crc_calc,fw_crc_ok,fw_fields_addr,fw_fields,cfg_status,cfg_entries\n");
+	else
+		fprintf(out, "[");
+	for(int i = 0; i < in.count; i++)
+	{
+		if(format != INSPECT_CSV) fprintf(out, "%s\n", i ? "," : "");
+		fputs(in.out[i] ? in.out[i] : "", out);
+		free(in.out[i]);
+		free(in.path[i]);
+	}
+	if(format != INSPECT_CSV) fprintf(out, "\n]\n");
+	fflush(out);
+
+	int failed = atomic_load(&in.failed);
+	if(failed) fprintf(stderr, "warn:    %d of %d files can't be read\n", failed, in.count);
+	free(in.out);
+	free(in.path);
+	return failed ? 1 : 0;
+}
\ No newline at end of file
@@ -0,0 +1,21 @@
+#ifndef INSPECT_H__
+#define INSPECT_H__
+
+#include <stdio.h>
+
+#define INSPECT_JOBS_MAX 64
+
+enum
+{
+	INSPECT_JSON = 0,
+	INSPECT_CSV,
+};
+
+/**
+ * Parse files (directories are walked) as fw and cfg images on `jobs`
+ * threads, 0 - one per core, and print one record per file to `out` in the
+ * order they were given
+ */
+int inspect_run(char *const paths[], int count, int format, int jobs, FILE *out);
+
+#endif // INSPECT_H__
\ No newline at end of file
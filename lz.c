@@ -0,0 +1,112 @@
+#include "lz.h"
+#include <string.h>
+
+#define HASH_BITS 12
+#define CHAIN_MAX 32
+
+static uint32_t hash3(const uint8_t *p) { return ((((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2]) * 2654435761U) >> (32 - HASH_BITS); }
+
+/**
+ * \brief Compress as much of `src` as fits in `cap` bytes
+ * \param consumed count of `src` bytes the output covers
+ * \return compressed size
+ */
+uint32_t lz_encode(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap, uint32_t *consumed)
+{
+	int32_t head[1U << HASH_BITS];
+	int32_t prev[LZ_WINDOW];
+	memset(head, 0xFF, sizeof(head));
+
+	uint32_t i = 0, o = 0, flag_pos = 0, bit = 8;
+	while(i < len)
+	{
+		uint32_t best_len = 0, best_pos = 0;
+		if(i + LZ_MIN <= len)
+		{
+			uint32_t max = len - i > LZ_MAX ? LZ_MAX : len - i;
+			int32_t cand = head[hash3(&src[i])];
+			for(int chain = 0; cand >= 0 && i - (uint32_t)cand <= LZ_WINDOW && chain < CHAIN_MAX; chain++)
+			{
+				uint32_t n = 0;
+				while(n < max && src[(uint32_t)cand + n] == src[i + n])
+					n++;
+				if(n > best_len)
+				{
+					best_len = n;
+					best_pos = (uint32_t)cand;
+					if(n == max) break;
+				}
+				int32_t next = prev[(uint32_t)cand % LZ_WINDOW];
+				if(next >= cand) break;
+				cand = next;
+			}
+		}
+		if(best_len < LZ_MIN) best_len = 0;
+
+		if(o + (bit == 8 ? 1U : 0U) + (best_len ? 2U : 1U) > cap) break; // no room for the next item
+
+		if(bit == 8)
+		{
+			flag_pos = o;
+			dst[o++] = 0;
+			bit = 0;
+		}
+		uint32_t step = 1;
+		if(best_len)
+		{
+			uint32_t dist = i - best_pos - 1;
+			dst[flag_pos] |= (uint8_t)(1U << bit);
+			dst[o++] = (uint8_t)(dist & 0xFFU);
+			dst[o++] = (uint8_t)(((dist >> 8) << 4) | (best_len - LZ_MIN));
+			step = best_len;
+		}
+		else
+		{
+			dst[o++] = src[i];
+		}
+		bit++;
+
+		for(uint32_t k = 0; k < step; k++, i++)
+		{
+			if(i + LZ_MIN > len) continue;
+			uint32_t h = hash3(&src[i]);
+			prev[i % LZ_WINDOW] = head[h];
+			head[h] = (int32_t)i;
+		}
+	}
+	*consumed = i;
+	return o;
+}
+
+/**
+ * \brief Reference decoder, mirrors what the firmware does with a DFU_DN_LZ frame
+ * \return `raw_len` or -1 on a malformed stream
+ */
+int lz_decode(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t raw_len)
+{
+	uint32_t i = 0, o = 0;
+	while(o < raw_len)
+	{
+		if(i >= len) return -1;
+		uint8_t flags = src[i++];
+		for(uint32_t bit = 0; bit < 8 && o < raw_len; bit++)
+		{
+			if(flags & (1U << bit))
+			{
+				if(i + 2 > len) return -1;
+				uint32_t dist = ((uint32_t)src[i] | ((uint32_t)(src[i + 1] >> 4) << 8)) + 1;
+				uint32_t n = (src[i + 1] & 0x0FU) + LZ_MIN;
+				i += 2;
+				if(dist > o || o + n > raw_len) return -1;
+				for(uint32_t k = 0; k < n; k++, o++)
+					dst[o] = dst[o - dist];
+			}
+			else
+			{
+				if(i >= len) return -1;
+				dst[o++] = src[i++];
+			}
+		}
+	}
+	return i == len ? (int)o : -1;
+}
\ No newline at end of file
@@ -0,0 +1,19 @@
+#ifndef LZ_H__
+#define LZ_H__
+
+#include <stdint.h>
+
+/**
+ * Small window LZSS: groups of a flag byte and up to 8 items (LSB first),
+ * flag bit 0 - literal byte, 1 - match [dist_lo:8][dist_hi:4|len-3:4],
+ * distance 1..4096 back in the output, length 3..18. Decoding needs nothing
+ * but the output buffer.
+ */
+#define LZ_WINDOW 4096
+#define LZ_MIN 3
+#define LZ_MAX 18
+
+uint32_t lz_encode(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap, uint32_t *consumed);
+int lz_decode(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t raw_len);
+
+#endif // LZ_H__
\ No newline at end of file
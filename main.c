@@ -1,41 +1,45 @@
 
+#include "adapt.h"
+#include "crc32.h"
+#include "daemon.h"
+#include "dev_index.h"
+#include "dfu.h"
+#include "image.h"
+#include "inspect.h"
 #include "libusb_helper.h"
+#include "lz.h"
+#include "outfile.h"
+#include "parser.h"
 #include "percent_tracker.h"
+#include "sim.h"
+#include "telemetry.h"
 #include "timedate.h"
+#include "trace.h"
+#include "usb_io.h"
 #include <ctype.h>
 #include <libusb-1.0/libusb.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #define USB_FLASHER_VER "2.0.0"
 
-#define REBOOT_TO 400
-#define RETRY_CNT 5
-#define QUANT_FLASH 256
-
-extern int parse_file_cfg(const char *file_name);
-extern int parse_file_fw(const char *file_name);
-
-enum
-{
-	DFU_DETACH = 0,
-	DFU_DNLOAD,
-	DFU_UPLOAD,
-	DFU_GETSTATUS,
-	DFU_CLRSTATUS,
-	DFU_GETSTATE,
-	DFU_ABORT
-};
-
-typedef enum
-{
-	FW_PREBOOT = 0,
-	FW_BOOT,
-	FW_APP,
-} FW_TYPE_t;
+#define REENUM_TO 3000 // from the reboot request till the device is found again
+#define POLL_MS 20
+#define RETRY_CNT DFU_RETRY_CNT
+#define QUEUE_DEPTH 4
+#define PROBE_LEN 0x10000
+#define DIFF_CRC_BATCH 64
+#define JOURNAL_STEP 0x10000
+#define TARGETS_MAX 64
+#define VIEW_PERIOD_MS 250
+#define CFG_SET_MAX 32
+#define CFG_READ_MAX 0x10000 // device config bytes read for the diff
 
 static const char *fw_type_str[] = {"PREBOOT", "BOOT", "APP", "CFG"};
 
@@ -50,19 +54,88 @@ enum
 	ERR_CHK,
 };
 
-static FILE *f = NULL;
-static uint8_t *content = NULL;
-static progress_tracker_t tr;
-static libusb_device **list = NULL;
-static ssize_t cnt;
-static libusb_device_handle *handle = NULL;
+typedef struct
+{
+	libusb_device_handle *handle;
+	char serial[256];
+	uint8_t bus;
+	uint8_t port[8]; // port path, the same for app and boot enumerations
+	int port_len;	 // 0 - take the first device matching the name
+
+	uint32_t length; // image to write
+	uint8_t *map;	 // DFU_CHUNK_* per chunk, NULL - send everything
+	progress_tracker_t tr;
+	bool quiet; // progress is drawn by the parallel view
+	atomic_uint pos;
+	atomic_bool finished;
+	atomic_bool arrived; // hotplug: a device showed up on the port
+	int errc;
+	uint64_t time_ms;
+	telem_t telem;
+	adapt_t *ad; // adaptive controller fed by the transfers, NULL - off
+
+	struct
+	{
+		bool on;
+		char path[1024];
+		char key[512]; // what the offset belongs to: device, region, image, packet framing, chunk map
+		uint32_t saved;
+	} journal;
+} target_t;
+
+typedef struct
+{
+	bool write;
+	FW_TYPE_t sel;
+	char *file_name;
+	char *dev_name;
+	char *sub_name;
+	uint32_t chunk;
+	uint32_t queue;
+	bool probe;
+	bool diff;
+	bool sparse;
+	bool lz;
+	bool resume;
+	bool adaptive;
+	bool all;
+	uint16_t vid; // 0 - any
+	uint16_t pid; // 0 - any
+	bool stream;  // image comes from a pipe, read as it is sent
+	bool force;	  // skip pre-flight checks of the image and the device
+	char *set[CFG_SET_MAX]; // "key=hex" config edits
+	int set_count;
+	char *telemetry; // JSON file written at exit
+	char *trace;	 // binary log of every USB request
+	char *sim;		 // simulated device spec, NULL - real devices
+} cfg_t;
+
+// state of one run: the process in the CLI, a job thread in the daemon
+static _Thread_local cfg_t cfg = {.queue = QUEUE_DEPTH};
+static _Thread_local FILE *f = NULL;
+static _Thread_local image_t image;
+static _Thread_local uint8_t *content = NULL; // image.data
+static _Thread_local target_t tgt; // the device of a single device run
+static _Thread_local char image_product[128]; // "product" field of the fw image, "" - not checked
+static _Thread_local uint8_t *cfg_base = NULL;	// config as loaded when `content` is its edited copy
+static _Thread_local FILE *job_out = NULL; // daemon client getting progress lines, NULL - CLI
 
-static inline void handle_close(void)
+static target_t all[TARGETS_MAX]; // devices of an --all run
+static uint32_t all_cnt;
+static struct
+{
+	cfg_t cfg;
+	uint8_t *content;
+	uint8_t *cfg_base;
+	char image_product[sizeof(image_product)];
+} all_job; // what the --all threads run with
+
+static inline void handle_close(target_t *t)
 {
-	if(handle)
+	if(t->handle)
 	{
-		libusb_close(handle);
-		handle = NULL;
+		usb_io->close(t->handle);
+		t->handle = NULL;
 	}
 }
 
@@ -76,163 +149,458 @@ static int _strncmp_lwr(const char *s0, const char *s1, size_t c)
 	return 0;
 }
 
-#define EP_REQ_IN LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE
-#define EP_REQ_OUT LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE
+static bool same_port(uint8_t bus, const uint8_t *port, int port_len, libusb_device *dev)
+{
+	uint8_t p[8];
+	int len = usb_io->get_port_numbers(dev, p, sizeof(p));
+	return usb_io->get_bus_number(dev) == bus && len == port_len && memcmp(p, port, (size_t)len) == 0;
+}
+
+// cached descriptor only, no I/O: hubs and devices without a serial are never ours
+static bool desc_match(libusb_device *dev)
+{
+	struct libusb_device_descriptor desc;
+	if(usb_io->get_device_descriptor(dev, &desc) < 0) return false;
+	if(desc.bDeviceClass == LIBUSB_CLASS_HUB || !desc.iSerialNumber) return false;
+	return (!cfg.vid || desc.idVendor == cfg.vid) && (!cfg.pid || desc.idProduct == cfg.pid);
+}
 
-// Note: wIndex will always be 0 in libusb_control_transfer with WinUSB device
+// open `dev` if its serial starts with `name`, the serial goes to `buf`
+static bool open_matching(target_t *t, libusb_device *dev, const char *name, char *buf, size_t buf_sz)
+{
+	struct libusb_device_descriptor desc;
+	if(!desc_match(dev) || usb_io->get_device_descriptor(dev, &desc) < 0) return false;
+	if(trace_open(dev, &t->handle) < 0) return false;
 
-static int dfu_reboot(bool sub_reboot) { return libusb_control_transfer(handle, EP_REQ_OUT, DFU_DETACH, sub_reboot, 0, NULL, 0, 500); }
-static int dfu_write(uint8_t fw_index, uint8_t *pkt, uint16_t pkt_len) { return libusb_control_transfer(handle, EP_REQ_OUT, DFU_DNLOAD, fw_index, 0, pkt, pkt_len, 4500); }
-static int dfu_get_fw_sts(uint8_t sts[3]) { return libusb_control_transfer(handle, EP_REQ_IN, DFU_GETSTATUS, 0, 0, sts, 3, 500); }
-static int dfu_get_fw_type(uint8_t type[1]) { return libusb_control_transfer(handle, EP_REQ_IN, DFU_GETSTATE, 0, 0, type, 1, 500); }
-static int dfu_halt(void) { return libusb_control_transfer(handle, EP_REQ_OUT, DFU_CLRSTATUS, 0, 0, NULL, 0, 500); }
-static int dfu_halt_specific(uint8_t fw_index, char *app) { return libusb_control_transfer(handle, EP_REQ_OUT, DFU_CLRSTATUS, fw_index, 0, (uint8_t *)app, (uint16_t)strlen(app), 500); }
+	memset(buf, 0, buf_sz);
+	int sts = trace_get_string_descriptor_ascii(t->handle, desc.iSerialNumber, (uint8_t *)buf, (int)buf_sz);
+	size_t name_sz = strlen(name);
+	if(sts < 0 || strlen(buf) < name_sz || _strncmp_lwr(name, buf, name_sz) != 0)
+	{
+		handle_close(t);
+		return false;
+	}
+	return true;
+}
 
-static int dfu_read(uint8_t fw_index, uint32_t offset, uint8_t *pkt, uint32_t pkt_len)
+static void on_image_field(void *arg, const char *key, const uint8_t *value, uint32_t len, uint32_t addr)
 {
-	uint8_t buf[8];
-	memcpy(&buf[0], &offset, 4);
-	memcpy(&buf[4], &pkt_len, 4);
-	int sts = libusb_control_transfer(handle, EP_REQ_OUT, DFU_UPLOAD, fw_index, 0, buf, sizeof(buf), 500);
-	if(sts < 0) return sts;
-	return libusb_control_transfer(handle, EP_REQ_IN, DFU_UPLOAD, fw_index, 0, pkt, (uint16_t)pkt_len, 500);
+	(void)arg;
+	(void)addr;
+	if(strcmp(key, "product") == 0 && !image_product[0]) snprintf(image_product, sizeof(image_product), "%.*s", (int)len, (const char *)value);
 }
 
-static int find_usb_device(bool writing, const char *name, char *sub_name, FW_TYPE_t fw_sel)
+/** \brief Image checks before any USB traffic: header, CRC and product of fw, CRC and entries of a config */
+static int preflight_image(const uint8_t *data, size_t length)
 {
-	for(ssize_t i = 0; i < cnt; i++)
+	if(cfg.sel == FW_APP + 1)
 	{
-		libusb_device *dev = list[i];
-		struct libusb_device_descriptor desc;
-		int sts = libusb_get_device_descriptor(dev, &desc);
-		if(sts < 0) continue;
-		sts = libusb_open(dev, &handle);
-		if(sts < 0) continue;
+		int sts = parse_cfg(data, length, NULL, NULL);
+		if(sts) fprintf(stderr, "error:    config image is invalid: %s\n", parse_cfg_sts_str(sts));
+		return sts ? ERR_CHK : 0;
+	}
 
-		char buf[256] = {0};
-		sts = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, (uint8_t *)buf, sizeof(buf));
-		if(sts < 0)
-		{
-			handle_close();
-			continue;
-		}
+	parse_fw_result_t r;
+	int sts = parse_fw(data, length, &r, on_image_field, NULL);
+	if(sts)
+	{
+		if(r.header)
+			fprintf(stderr, "error:    image is invalid: %s (header @x%x, crc %08x, calculated %08x)\n", parse_fw_lock_str(sts), r.offset, r.fw_crc32, r.crc_calc);
+		else
+			fprintf(stderr, "error:    image is invalid: no fw header\n");
+		return ERR_CHK;
+	}
+	if(!image_product[0])
+	{
+		fprintf(stderr, "error:    image has no \"product\" field\n");
+		return ERR_CHK;
+	}
+	if(r.fw_size != length) fprintf(stderr, "warn:    image is %d bytes, its header covers %d\n", (uint32_t)length, r.fw_size);
+	fprintf(stderr, "info:    image: product \"%s\", crc32 %08x\n", image_product, r.fw_crc32);
+	return 0;
+}
 
-		size_t name_sz = strlen(name);
-		if(strlen(buf) < name_sz)
-		{
-			handle_close();
-			continue;
-		}
-		if(_strncmp_lwr(name, buf, name_sz) != 0)
+/**
+ * \brief The device takes the image if its serial starts with the image
+ * product (as the device name does) or its product string is the same
+ */
+static int preflight_device(target_t *t)
+{
+	if(!image_product[0] || cfg.sub_name) return 0; // remote flash: nothing to compare with
+	char prod[256] = {0};
+	struct libusb_device_descriptor desc;
+	if(usb_io->get_device_descriptor(usb_io->get_device(t->handle), &desc) == 0 && desc.iProduct)
+		trace_get_string_descriptor_ascii(t->handle, desc.iProduct, (uint8_t *)prod, sizeof(prod) - 1);
+
+	size_t len = strlen(image_product);
+	if(strlen(t->serial) >= len && _strncmp_lwr(image_product, t->serial, len) == 0) return 0;
+	if(strlen(prod) == len && _strncmp_lwr(image_product, prod, len) == 0) return 0;
+	fprintf(stderr, "error:    image is for \"%s\", device is \"%s\" (%s), --force to write anyway\n", image_product, t->serial, prod[0] ? prod : "no product string");
+	return ERR_CHK;
+}
+
+static int find_usb_device(target_t *t, bool writing, const char *name, char *sub_name, FW_TYPE_t fw_sel)
+{
+	libusb_device **list = NULL;
+	ssize_t cnt = trace_get_device_list(NULL, &list);
+	if(cnt < 0) fprintf(stderr, "error    libusb: failed to get device list\n");
+
+	libusb_device *dev = NULL;
+	char buf[256] = {0};
+	dev_index_entry_t e;
+	if(!t->port_len && dev_index_find(name, &e)) // try where it was the last time before opening everything
+	{
+		for(ssize_t i = 0; i < cnt && !dev; i++)
 		{
-			handle_close();
-			continue;
+			if(same_port(e.bus, e.port, e.port_len, list[i]) && open_matching(t, list[i], name, buf, sizeof(buf))) dev = list[i];
 		}
-		// char tgt_names[2][256] = {0};
-		// strcpy(tgt_names[0], name);
-		// strcpy(tgt_names[1], name);
-		// strcat(tgt_names[0], "_app");
-		// strcat(tgt_names[1], "_ldr");
-		// int cmp_app = _strncmp_lwr(tgt_names[0], buf, strlen(tgt_names[0]));
-		// int cmp_ldr = _strncmp_lwr(tgt_names[1], buf, strlen(tgt_names[1]));
-		// if(cmp_app && cmp_ldr)
-		// {
-		// 	handle_close();
-		// 	continue;
-		// }
-		fprintf(stderr, "info:    found device %x::%x::%s\n", desc.idVendor, desc.idProduct, buf);
-
-		sts = sub_name ? dfu_halt_specific(fw_sel, sub_name) : dfu_halt();
+	}
+	for(ssize_t i = 0; i < cnt && !dev; i++)
+	{
+		if(t->port_len && !same_port(t->bus, t->port, t->port_len, list[i])) continue; // bound to a port: don't touch others
+		if(open_matching(t, list[i], name, buf, sizeof(buf))) dev = list[i];
+	}
+	struct libusb_device_descriptor desc = {0};
+	if(dev)
+	{
+		usb_io->get_device_descriptor(dev, &desc);
+		strcpy(t->serial, buf);
+		t->bus = usb_io->get_bus_number(dev);
+		t->port_len = usb_io->get_port_numbers(dev, t->port, sizeof(t->port));
+		if(t->port_len < 0) t->port_len = 0;
+	}
+	if(list) usb_io->free_device_list(list, 1);
+	if(!dev) return -1;
+
+	strcpy(e.serial, t->serial);
+	e.bus = t->bus;
+	memcpy(e.port, t->port, sizeof(e.port));
+	e.port_len = t->port_len;
+	dev_index_put(&e);
+
+	// char tgt_names[2][256] = {0};
+	// strcpy(tgt_names[0], name);
+	// strcpy(tgt_names[1], name);
+	// strcat(tgt_names[0], "_app");
+	// strcat(tgt_names[1], "_ldr");
+	// int cmp_app = _strncmp_lwr(tgt_names[0], buf, strlen(tgt_names[0]));
+	// int cmp_ldr = _strncmp_lwr(tgt_names[1], buf, strlen(tgt_names[1]));
+	// if(cmp_app && cmp_ldr)
+	// {
+	// 	handle_close();
+	// 	continue;
+	// }
+	fprintf(stderr, "info:    found device %x::%x::%s\n", desc.idVendor, desc.idProduct, buf);
+	if(writing && !cfg.force && preflight_device(t))
+	{
+		handle_close(t);
+		return -4; // not rebooted, it stays where it was
+	}
+
+	int sts = sub_name ? dfu_halt_specific(t->handle, fw_sel, sub_name) : dfu_halt(t->handle);
+	if(sts < 0)
+	{
+		fprintf(stderr, "error:    failed to halt: %s\n", libusb_err2str(sts));
+		return -2;
+	}
+
+	if(writing)
+	{
+		uint8_t fw_type = 0;
+		sts = dfu_get_fw_type(t->handle, &fw_type);
 		if(sts < 0)
 		{
-			fprintf(stderr, "error:    failed to halt: %s\n", libusb_err2str(sts));
-			return -2;
+			fprintf(stderr, "error:    failed to get fw type: %d\n", sts);
+			return -3;
 		}
-
-		if(writing)
+		if(fw_sel == FW_APP && fw_type == FW_APP)
 		{
-			uint8_t fw_type = 0;
-			sts = dfu_get_fw_type(&fw_type);
+			fprintf(stderr, "info:    rebooting%sto boot...\n", sub_name ? " sub " : " ");
+			sts = dfu_reboot(t->handle, sub_name != NULL);
 			if(sts < 0)
 			{
-				fprintf(stderr, "error:    failed to get fw type: %d\n", sts);
+				fprintf(stderr, "error:    failed to reboot%sto boot: %d\n", sub_name ? " sub " : " ", sts);
 				return -3;
 			}
-			if(fw_sel == FW_APP && fw_type == FW_APP)
-			{
-				fprintf(stderr, "info:    rebooting%sto boot...\n", sub_name ? " sub " : " ");
-				sts = dfu_reboot(sub_name != NULL);
-				if(sts < 0)
-				{
-					fprintf(stderr, "error:    failed to reboot%sto boot: %d\n", sub_name ? " sub " : " ", sts);
-					return -3;
-				}
-				handle_close();
-				delay_ms(REBOOT_TO);
-				return 1; // call again
-			}
-			else if(fw_sel == FW_BOOT && fw_type == FW_BOOT)
+			handle_close(t);
+			return 1; // call again once it re-enumerates
+		}
+		else if(fw_sel == FW_BOOT && fw_type == FW_BOOT)
+		{
+			fprintf(stderr, "info:    rebooting%sto app...\n", sub_name ? " sub " : " ");
+			sts = dfu_reboot(t->handle, sub_name != NULL);
+			if(sts < 0)
 			{
-				fprintf(stderr, "info:    rebooting%sto app...\n", sub_name ? " sub " : " ");
-				sts = dfu_reboot(sub_name != NULL);
-				if(sts < 0)
-				{
-					fprintf(stderr, "error:    failed to reboot%sto app: %d\n", sub_name ? " sub " : " ", sts);
-					return -3;
-				}
-				handle_close();
-				delay_ms(REBOOT_TO);
-				return 1; // call again
+				fprintf(stderr, "error:    failed to reboot%sto app: %d\n", sub_name ? " sub " : " ", sts);
+				return -3;
 			}
-			return 0;
+			handle_close(t);
+			return 1; // call again once it re-enumerates
 		}
 		return 0;
 	}
-	return -1;
+	return 0;
 }
 
-static void on_exit_cb(void)
+static void port_str(const target_t *t, char *s, size_t sz);
+
+static void target_json(FILE *jf, const target_t *t)
+{
+	char port[40];
+	port_str(t, port, sizeof(port));
+	fprintf(jf, "{\"serial\":");
+	telem_json_str(jf, t->serial);
+	fprintf(jf, ",\"port\":\"%s\",\"result\":%d,", port, t->errc);
+	telem_json(jf, &t->telem);
+	fprintf(jf, "}");
+}
+
+// --telemetry: one object per device of the run
+static void telemetry_export(void)
+{
+	FILE *tf = fopen(cfg.telemetry, "w");
+	if(!tf)
+	{
+		fprintf(stderr, "error:    open file %s\n", cfg.telemetry);
+		return;
+	}
+	fprintf(tf, "{\"version\":\"%s\",\"op\":\"%s\",\"fw\":\"%s\",\"file\":", USB_FLASHER_VER, cfg.write ? "write" : "read", fw_type_str[cfg.sel]);
+	telem_json_str(tf, cfg.file_name);
+	fprintf(tf, ",\"targets\":[");
+	target_t *list = all_cnt ? all : &tgt;
+	for(uint32_t i = 0; i < (all_cnt ? all_cnt : 1); i++)
+	{
+		fprintf(tf, "%s\n", i ? "," : "");
+		target_json(tf, &list[i]);
+	}
+	fprintf(tf, "\n]}\n");
+	if(fclose(tf)) fprintf(stderr, "error:    write file %s\n", cfg.telemetry);
+}
+
+// everything a run leaves behind but the USB backend
+static void run_free(void)
 {
-	handle_close();
-	if(list) libusb_free_device_list(list, 1);
-	libusb_exit(NULL);
-	if(f) fclose(f);
-	if(content) free(content);
+	if(cfg.telemetry) telemetry_export();
+	telem_free(&tgt.telem);
+	for(uint32_t i = 0; i < all_cnt; i++)
+		telem_free(&all[i].telem);
+	handle_close(&tgt);
+	if(f && f != stdin) fclose(f);
+	if(cfg_base) free(content);
+	image_free(&image);
+	if(tgt.map) free(tgt.map);
+	cfg_base = NULL;
 	f = NULL;
-	list = NULL;
 	content = NULL;
+	tgt.map = NULL;
 }
 
-static size_t file_len(void)
+static void on_exit_cb(void)
 {
-	fseek(f, 0, SEEK_END);
-	size_t s = (size_t)ftell(f);
-	rewind(f);
-	return s;
+	run_free();
+	usb_io->exit();
+	trace_stop();
 }
 
-static struct
+static int load_content(const char *file_name, size_t *content_length)
 {
-	bool write;
-	FW_TYPE_t sel;
-	char *file_name;
-	char *dev_name;
-	char *sub_name;
-	uint32_t chunk;
-} cfg = {0};
+	int sts = image_load(&image, file_name);
+	if(sts)
+	{
+		fprintf(stderr, sts == IMAGE_ERR_OPEN ? "error:    open file %s\n" : "error:    read file %s\n", file_name);
+		return sts == IMAGE_ERR_OPEN ? ERR_FILE : ERR_FILE_READ;
+	}
+	content = image.data;
+	*content_length = image.length;
+	return 0;
+}
+
+static bool is_pipe(const char *file_name)
+{
+	struct stat st;
+	return strcmp(file_name, "-") == 0 || (stat(file_name, &st) == 0 && S_ISFIFO(st.st_mode));
+}
+
+static void journal_save(target_t *t, uint32_t acked)
+{
+	if(!t->journal.on) return;
+	FILE *jf = fopen(t->journal.path, "w");
+	if(!jf) return;
+	fprintf(jf, "%s %d\n", t->journal.key, acked);
+	fclose(jf);
+	t->journal.saved = acked;
+}
+
+// offset the previous run stopped at, 0 if it was for another image/device
+static uint32_t journal_load(target_t *t)
+{
+	FILE *jf = fopen(t->journal.path, "r");
+	if(!jf) return 0;
+	char line[sizeof(t->journal.key) + 16] = {0};
+	uint32_t acked = 0;
+	size_t n = strlen(t->journal.key);
+	if(fgets(line, sizeof(line), jf) && strncmp(line, t->journal.key, n) == 0 && line[n] == ' ') acked = (uint32_t)strtoul(&line[n + 1], NULL, 10);
+	fclose(jf);
+	return acked;
+}
+
+static void write_progress(void *arg, uint32_t pos)
+{
+	target_t *t = arg;
+	uint32_t prev = atomic_exchange(&t->pos, pos);
+	if(t->journal.on && pos - t->journal.saved >= JOURNAL_STEP) journal_save(t, pos);
+	if(job_out && pos / JOURNAL_STEP != prev / JOURNAL_STEP)
+	{
+		fprintf(job_out, "progress %d %d\n", pos, t->length);
+		fflush(job_out);
+	}
+	if(t->quiet) return;
+	if(!t->length) // streamed, size is unknown
+	{
+		if(pos / JOURNAL_STEP != prev / JOURNAL_STEP) fprintf(stderr, "\rinfo:    %d kB sent        ", pos / 1024);
+		return;
+	}
+	PERCENT_TRACKER_TRACK(t->tr, (double)pos / (double)(t->length),
+						  { fprintf(stderr, "\rinfo:    %.1f%% | pass: %lld sec | est: %lld sec        ",
+									100.0 * t->tr.progress, t->tr.time_ms_pass / 1000, t->tr.time_ms_est / 1000); });
+}
+
+// strips "--opt [val]" arguments out of argv, leaving positional ones
+static int parse_opt(char *argv[], int *argc)
+{
+	int n = 1;
+	for(int i = 1; i < *argc; i++)
+	{
+		if(strncmp(argv[i], "--", 2) != 0)
+		{
+			argv[n++] = argv[i];
+			continue;
+		}
+		if(strcmp(argv[i], "--queue") == 0 && i + 1 < *argc)
+		{
+			int v = atoi(argv[++i]);
+			if(v < 1)
+			{
+				fprintf(stderr, "Error! Queue depth can't be less than 1!\n");
+				return ERR_ARGC;
+			}
+			cfg.queue = (uint32_t)v;
+		}
+		else if(strcmp(argv[i], "--chunk-probe") == 0)
+		{
+			cfg.probe = true;
+		}
+		else if(strcmp(argv[i], "--diff") == 0)
+		{
+			cfg.diff = true;
+		}
+		else if(strcmp(argv[i], "--sparse") == 0)
+		{
+			cfg.sparse = true;
+		}
+		else if(strcmp(argv[i], "--lz") == 0)
+		{
+			cfg.lz = true;
+		}
+		else if(strcmp(argv[i], "--resume") == 0)
+		{
+			cfg.resume = true;
+		}
+		else if(strcmp(argv[i], "--adaptive") == 0)
+		{
+			cfg.adaptive = true;
+		}
+		else if(strcmp(argv[i], "--all") == 0)
+		{
+			cfg.all = true;
+		}
+		else if(strcmp(argv[i], "--force") == 0)
+		{
+			cfg.force = true;
+		}
+		else if(strcmp(argv[i], "--telemetry") == 0 && i + 1 < *argc)
+		{
+			cfg.telemetry = argv[++i];
+		}
+		else if(strcmp(argv[i], "--trace") == 0 && i + 1 < *argc)
+		{
+			cfg.trace = argv[++i];
+		}
+		else if(strcmp(argv[i], "--sim") == 0 && i + 1 < *argc)
+		{
+			cfg.sim = argv[++i];
+		}
+		else if(strcmp(argv[i], "--set") == 0 && i + 1 < *argc)
+		{
+			if(cfg.set_count == CFG_SET_MAX || !strchr(argv[i + 1], '='))
+			{
+				fprintf(stderr, "Error! --set takes up to %d key=hex values, not [%s]!\n", CFG_SET_MAX, argv[i + 1]);
+				return ERR_ARGC;
+			}
+			cfg.set[cfg.set_count++] = argv[++i];
+		}
+		else if(strcmp(argv[i], "--id") == 0 && i + 1 < *argc)
+		{
+			char *end;
+			unsigned long vid = strtoul(argv[++i], &end, 16), pid = *end == ':' ? strtoul(end + 1, &end, 16) : 0;
+			if(*end || !vid || vid > UINT16_MAX || pid > UINT16_MAX)
+			{
+				fprintf(stderr, "Error! Wrong device id [%s], VID[:PID] in hex expected!\n", argv[i]);
+				return ERR_ARGC;
+			}
+			cfg.vid = (uint16_t)vid;
+			cfg.pid = (uint16_t)pid;
+		}
+		else
+		{
+			fprintf(stderr, "Error! Unknown option [%s]!\n", argv[i]);
+			return ERR_ARGC;
+		}
+	}
+	*argc = n;
+	return 0;
+}
 
 static int parse_arg(char *argv[], int argc)
 {
+	int sts = parse_opt(argv, &argc);
+	if(sts) return sts;
+
 	if(argc != 5 && argc != 6 && argc != 7)
 	{
 		fprintf(stderr, "Error! USB FLASHER [ver. %s]: Wrong argument count!\nUsage:\n"
 						"  w/r                  - write/read operation\n"
 						"  p/b/a/c              - fw select: preboot/boot/app/config\n"
-						"  file                 - firmware binary\n"
+						"  file                 - firmware binary, \"-\" or a pipe streams it\n"
 						"  name                 - device name\n"
 						"  [optional]  sub name - remote flash device name\n"
-						"  [optional+] chunk    - chunk size\n",
-				USB_FLASHER_VER);
+						"  [optional+] chunk    - chunk size (default: device limit)\n"
+						"Options:\n"
+						"  --queue N            - DNLOAD transfers kept in flight (default %d)\n"
+						"  --chunk-probe        - time several chunk sizes and flash with the fastest\n"
+						"  --diff               - send only chunks whose CRC differs on the device\n"
+						"  --sparse             - send erased (0xFF) chunks as fill ranges\n"
+						"  --lz                 - compress packets when the device can decode them\n"
+						"  --resume             - keep <file>.resume journal, continue an interrupted write\n"
+						"  --adaptive           - tune chunk size and timeout from measured latencies\n"
+						"  --all                - write every device matching the name in parallel\n"
+						"  --id VID[:PID]       - look only at devices with this USB id (hex)\n"
+						"  --force              - write without checking the image and its product first\n"
+						"  --set key=hex        - change a config entry (empty - remove it), send changed chunks only\n"
+						"  --telemetry file     - save phase times, transfer latencies and retries as JSON at exit\n"
+						"  --trace file         - log every USB request with timestamps to a binary trace\n"
+						"  --sim spec           - talk to simulated devices instead, spec is key=value,... (see sim.h)\n"
+						"Other:\n"
+						"  lz file [chunk]      - check compressed framing of the file round trip\n"
+						"  crc [file]           - self-test CRC32, time it over the file\n"
+						"  cfg file [key[=hex]...] - list, look up or edit config entries in the file\n"
+						"  inspect [--csv] [--jobs N] path...\n"
+						"                       - parse fw/cfg images (directories are walked), print JSON/CSV\n"
+						"  trace file [bucket ms] - requests, throughput over time, gaps and retries of a --trace file\n"
+						"  daemon socket [--sim spec] [--trace file]\n"
+						"                       - serve w/r/inspect/list jobs on a Unix socket, devices stay known (see daemon.h)\n"
+						"  job socket args...   - run a job on the daemon, print its progress and result\n",
+				USB_FLASHER_VER, QUEUE_DEPTH);
 		return ERR_ARGC;
 	}
 
@@ -256,160 +624,1051 @@ static int parse_arg(char *argv[], int argc)
 		return ERR_ARGC;
 	}
 	cfg.sel = s;
+	if(cfg.all && !cfg.write)
+	{
+		fprintf(stderr, "Error! --all is supported by write only!\n");
+		return ERR_ARGC;
+	}
+
+	if(cfg.set_count && !(cfg.write && s == FW_APP + 1))
+	{
+		fprintf(stderr, "Error! --set is for config writes only!\n");
+		return ERR_ARGC;
+	}
 
 	cfg.file_name = argv[3];
+	cfg.stream = cfg.write && is_pipe(cfg.file_name);
+	if(cfg.stream && (cfg.diff || cfg.sparse || cfg.lz || cfg.resume || cfg.all || cfg.probe || cfg.set_count))
+	{
+		fprintf(stderr, "Error! --diff, --sparse, --lz, --resume, --all, --chunk-probe and --set need a file, not a pipe!\n");
+		return ERR_ARGC;
+	}
 	cfg.dev_name = argv[4];
 	cfg.sub_name = argc >= 6 ? argv[5] : NULL;
-	cfg.chunk = argc == 7 ? (uint32_t)atoi(argv[6]) : QUANT_FLASH;
-	if(cfg.chunk < 1)
+	cfg.chunk = argc == 7 ? (uint32_t)atoi(argv[6]) : 0 /* negotiated */;
+	if(argc == 7 && cfg.chunk < 1)
 	{
 		fprintf(stderr, "Error! Chunk size can't be 0!\n");
 		return ERR_ARGC;
 	}
-	if(cfg.chunk > QUANT_FLASH)
+	if(cfg.chunk > UINT16_MAX - DFU_DNLOAD_HDR)
 	{
-		fprintf(stderr, "Error! Chunk size can't be more than QUANT_FLASH!\n");
+		fprintf(stderr, "Error! Chunk size can't be more than %d!\n", UINT16_MAX - DFU_DNLOAD_HDR);
 		return ERR_ARGC;
 	}
 
 	return 0;
 }
 
-int main(int argc, char *argv[])
+// bring the device back to idle after a failed packet: GETSTATUS, then CLRSTATUS
+static int resync(target_t *t)
 {
-	int sts = parse_arg(argv, argc);
-	if(sts) return sts;
+	uint8_t fw_sts[3];
+	int sts = dfu_get_fw_sts(t->handle, fw_sts);
+	if(sts == LIBUSB_ERROR_NO_DEVICE) return sts;
+	return cfg.sub_name ? dfu_halt_specific(t->handle, cfg.sel, cfg.sub_name) : dfu_halt(t->handle);
+}
 
-	atexit(on_exit_cb);
+/**
+ * \brief Write the head of the image with growing chunk sizes and pick the
+ * fastest one. Every pass starts at offset 0 and the real write rewrites it.
+ */
+static uint32_t probe_chunk(target_t *t, const dfu_caps_t *caps)
+{
+	uint32_t max = dfu_chunk_size(caps, 0), best = max;
+	bool aligned = caps->transfer_size && caps->ep0_size;
+	double best_speed = 0;
+	dfu_src_image_t src = {.content = content, .length = t->length < PROBE_LEN ? t->length : PROBE_LEN, .fw_index = cfg.sel};
+	dfu_queue_t q = {.handle = t->handle, .depth = cfg.queue, .timeout_ms = DFU_DNLOAD_TO, .src = dfu_src_image, .src_arg = &src};
 
-	sts = libusb_init(NULL);
-	if(sts < 0) fprintf(stderr, "error:    failed to initialize libusb: %s\n", libusb_err2str(sts));
+	for(uint32_t pkt = 64;; pkt <<= 1)
+	{
+		src.chunk = q.max_len = aligned ? pkt - DFU_DNLOAD_HDR : pkt;
+		if(src.chunk > max) src.chunk = q.max_len = max;
 
-	libusb_set_option(NULL, LIBUSB_OPTION_LOG_LEVEL, 0);
+		TD_V t0, t1;
+		TD_GET(t0);
+		q.pos = 0;
+		int sts = dfu_queue_run(&q);
+		TD_GET(t1);
+		if(sts < 0)
+		{
+			fprintf(stderr, "info:    probe %5d bytes: %s\n", src.chunk, libusb_err2str(sts));
+		}
+		else
+		{
+			double speed = (double)src.length / (double)(TD_CALC_us(t1, t0)) * 1000.0;
+			fprintf(stderr, "info:    probe %5d bytes: %.2f kB/s\n", src.chunk, speed);
+			if(speed > best_speed)
+			{
+				best_speed = speed;
+				best = src.chunk;
+			}
+		}
+		if(src.chunk >= max) break;
+	}
+	return best;
+}
 
-	if(cfg.write)
+/**
+ * \brief Mark chunks whose device-side CRC matches the image as DFU_CHUNK_SKIP.
+ * The tail chunk is always sent when it is not a multiple of 4 (crc32() drops
+ * the remainder), so is every chunk if the CRC map can't be read.
+ * \return count of bytes left to send
+ */
+static uint32_t diff_map(target_t *t, uint8_t *map, uint32_t content_length, uint32_t chunk)
+{
+	uint32_t chunks = (content_length + chunk - 1) / chunk, to_send = 0;
+	uint32_t crc[DIFF_CRC_BATCH];
+	for(uint32_t i = 0; i < chunks; i += DIFF_CRC_BATCH)
 	{
-		f = fopen(cfg.file_name, "rb");
-		if(!f)
+		uint32_t n = chunks - i > DIFF_CRC_BATCH ? DIFF_CRC_BATCH : chunks - i;
+		int sts = dfu_get_crc(t->handle, cfg.sel, i * chunk, chunk, n, crc);
+		if(sts != (int)(n * 4))
 		{
-			fprintf(stderr, "error:    open file %s\n", cfg.file_name);
-			return ERR_FILE;
+			fprintf(stderr, "warn:    failed to get CRC map (%s) @%d, sending the rest\n", sts < 0 ? libusb_err2str(sts) : "short reply", i * chunk);
+			for(; i < chunks; i++)
+				map[i] = DFU_CHUNK_SEND;
+			break;
 		}
-
-		size_t content_length = file_len();
-		content = malloc(content_length);
-
-		size_t read = fread(content, 1, content_length, f);
-		if(read != content_length)
+		for(uint32_t k = 0; k < n; k++)
 		{
-			fprintf(stderr, "error:    read file (%zu %zu)\n", read, content_length);
-			return ERR_FILE_READ;
+			uint32_t off = (i + k) * chunk;
+			uint32_t len = content_length - off > chunk ? chunk : content_length - off;
+			map[i + k] = (len & 3U) == 0 && crc32(&content[off], len) == crc[k] ? DFU_CHUNK_SKIP : DFU_CHUNK_SEND;
 		}
+	}
+	for(uint32_t i = 0; i < chunks; i++)
+	{
+		if(map[i] == DFU_CHUNK_SKIP) continue;
+		to_send += content_length - i * chunk > chunk ? chunk : content_length - i * chunk;
+	}
+	return to_send;
+}
 
-		fprintf(stderr, "info:    flashing %s %s to \"%s%s%s\" (%zu bytes)...\n",
-				cfg.file_name, fw_type_str[cfg.sel], cfg.dev_name, cfg.sub_name ? ":" : "", cfg.sub_name ? cfg.sub_name : "", content_length);
+/**
+ * \brief Compare the written region with `content` by device-side CRCs of
+ * `block` sized blocks, the tail is rounded down to a multiple of 4
+ * \return 0 - same, 1 - differs at `*bad`, libusb error otherwise
+ */
+static int verify_crc(target_t *t, uint32_t block, uint32_t *bad)
+{
+	uint32_t full = t->length / block, crc[DIFF_CRC_BATCH];
+	for(uint32_t i = 0; i < full; i += DIFF_CRC_BATCH)
+	{
+		uint32_t n = full - i > DIFF_CRC_BATCH ? DIFF_CRC_BATCH : full - i;
+		int sts = dfu_get_crc(t->handle, cfg.sel, i * block, block, n, crc);
+		if(sts < 0) return sts;
+		if(sts != (int)(n * 4)) return LIBUSB_ERROR_IO;
+		for(uint32_t k = 0; k < n; k++)
+		{
+			*bad = (i + k) * block;
+			if(crc32(&content[*bad], block) != crc[k]) return 1;
+		}
+	}
+	uint32_t off = full * block, tail = (t->length - off) & ~3U;
+	if(!tail) return 0;
+	int sts = dfu_get_crc(t->handle, cfg.sel, off, tail, 1, crc);
+	if(sts < 0) return sts;
+	if(sts != 4) return LIBUSB_ERROR_IO;
+	*bad = off;
+	return crc32(&content[off], tail) != crc[0];
+}
 
-		cnt = libusb_get_device_list(NULL, &list);
-		if(cnt < 0) fprintf(stderr, "error    libusb: failed to get device list\n");
+/**
+ * \brief Mark chunks still to be sent that are all 0xFF as DFU_CHUNK_FILL,
+ * each run of them goes as one range message (counted in `ranges`)
+ * \return count of image bytes that won't go over the wire
+ */
+static uint32_t sparse_map(uint8_t *map, uint32_t content_length, uint32_t chunk, uint32_t *ranges)
+{
+	uint32_t saved = 0;
+	bool in_range = false;
+	for(uint32_t i = 0, off = 0; off < content_length; i++, off += chunk)
+	{
+		uint32_t len = content_length - off > chunk ? chunk : content_length - off;
+		bool erased = map[i] == DFU_CHUNK_SEND;
+		for(uint32_t k = 0; erased && k < len; k++)
+			erased = content[off + k] == 0xFF;
+		if(erased)
+		{
+			map[i] = DFU_CHUNK_FILL;
+			saved += len;
+			if(!in_range) (*ranges)++;
+		}
+		in_range = erased;
+	}
+	return saved;
+}
 
-		// fprintf(stderr, "info:    found %lld USB devices\n", cnt);
+/**
+ * \brief Chunk size that keeps chunks and erase pages aligned to each other:
+ * a multiple of the page, or a divisor of it (a multiple of 4) when it is larger
+ */
+static uint32_t page_chunk(uint32_t chunk, uint32_t page)
+{
+	if(!page || chunk % page == 0 || page % chunk == 0) return chunk;
+	if(chunk > page) return chunk / page * page;
+	for(uint32_t c = chunk & ~3U; c >= 4; c -= 4)
+	{
+		if(page % c == 0) return c;
+	}
+	return chunk;
+}
 
-		sts = find_usb_device(cfg.write, cfg.dev_name, cfg.sub_name, cfg.sel);
-		if(sts == 1)
+/**
+ * \brief Rewriting a chunk erases its whole page: send every skipped chunk of a
+ * page that gets written (chunks are page aligned, see page_chunk())
+ * \return count of bytes left to send
+ */
+static uint32_t page_map(uint8_t *map, uint32_t content_length, uint32_t chunk, uint32_t page)
+{
+	uint32_t chunks = (content_length + chunk - 1) / chunk, per = page > chunk ? page / chunk : 1, to_send = 0;
+	for(uint32_t i = 0; i < chunks; i += per)
+	{
+		uint32_t end = i + per < chunks ? i + per : chunks;
+		bool dirty = false;
+		for(uint32_t k = i; k < end; k++)
+			dirty |= map[k] != DFU_CHUNK_SKIP;
+		for(uint32_t k = i; dirty && k < end; k++)
 		{
-			handle_close();
-#define RETRY 7
-			for(uint32_t i = 0; i < RETRY; i++)
-			{
-				if(list) libusb_free_device_list(list, 1);
+			if(map[k] == DFU_CHUNK_SKIP) map[k] = DFU_CHUNK_SEND;
+			to_send += content_length - k * chunk > chunk ? chunk : content_length - k * chunk;
+		}
+	}
+	return to_send;
+}
 
-				cnt = libusb_get_device_list(NULL, &list);
-				if(cnt < 0) fprintf(stderr, "error    libusb: failed to get device list\n");
+// "key=hex" -> key and value, empty hex - NULL value (remove the key)
+static int cfg_edit_parse(char *set, uint8_t *value, uint16_t *len, const uint8_t **v)
+{
+	char *hex = strchr(set, '=');
+	*hex++ = '\0';
+	size_t n = strlen(hex);
+	if((n & 1U) || n / 2 > UINT16_MAX) return -1;
+	for(size_t i = 0; i < n; i += 2)
+	{
+		if(!isxdigit((unsigned char)hex[i]) || !isxdigit((unsigned char)hex[i + 1])) return -1;
+		char byte[3] = {hex[i], hex[i + 1], '\0'};
+		value[i / 2] = (uint8_t)strtoul(byte, NULL, 16);
+	}
+	*len = (uint16_t)(n / 2);
+	*v = n ? value : NULL;
+	return 0;
+}
 
-				sts = find_usb_device(cfg.write, cfg.dev_name, cfg.sub_name, cfg.sel);
-				if(sts != 0 && i == RETRY - 1)
-				{
-					fprintf(stderr, "error:    failed to reboot device \"%s%s%s\" 2nd time\n", cfg.dev_name, cfg.sub_name ? ":" : "", cfg.sub_name ? cfg.sub_name : "");
-					return ERR_REBOOT;
-				}
-				if(!sts) break;
-				delay_ms(200);
-			}
+/**
+ * \brief Apply "key=hex" edits to a config blob one by one
+ * \return 0 - `out` is the malloc'ed result
+ */
+static int cfg_edit(const uint8_t *data, size_t length, char *const set[], int count, uint8_t **out, size_t *out_len)
+{
+	uint8_t *value = malloc(UINT16_MAX); // daemon jobs edit on their own threads
+	if(!value) return ERR_FILE_READ;
+	uint8_t *cur = NULL;
+	size_t cur_len = length;
+	for(int i = 0; i < count; i++)
+	{
+		uint16_t len;
+		const uint8_t *v;
+		char *key = set[i];
+		if(cfg_edit_parse(key, value, &len, &v))
+		{
+			fprintf(stderr, "error:    wrong value of config key \"%s\", hex bytes expected\n", key);
+			free(value);
+			free(cur);
+			return ERR_ARGC;
 		}
-		else if(sts != 0)
+		cfg_index_t ix;
+		uint8_t *next = NULL;
+		int sts = cfg_index_build(&ix, cur ? cur : data, cur_len);
+		if(!sts) sts = cfg_set(&ix, key, v, len, &next, &cur_len);
+		cfg_index_free(&ix);
+		free(cur);
+		if(sts)
 		{
-			fprintf(stderr, "error:    failed to find device \"%s%s%s\"\n", cfg.dev_name, cfg.sub_name ? ":" : "", cfg.sub_name ? cfg.sub_name : "");
-			return ERR_REBOOT;
+			fprintf(stderr, "error:    can't set config key \"%s\": %s\n", key, parse_cfg_sts_str(sts));
+			free(value);
+			return ERR_CHK;
 		}
+		cur = next;
+	}
+	free(value);
+	*out = cur;
+	*out_len = cur_len;
+	return 0;
+}
 
-		int errc = 1;
+/**
+ * \brief Mark chunks equal to `base` (what the device holds) as DFU_CHUNK_SKIP
+ * \return count of image bytes to send
+ */
+static uint32_t edit_map(uint8_t *map, uint32_t content_length, uint32_t chunk, const uint8_t *base, size_t base_len)
+{
+	uint32_t to_send = 0;
+	for(uint32_t i = 0, off = 0; off < content_length; i++, off += chunk)
+	{
+		uint32_t len = content_length - off > chunk ? chunk : content_length - off;
+		bool same = off + len <= base_len && memcmp(&content[off], &base[off], len) == 0;
+		map[i] = same ? DFU_CHUNK_SKIP : DFU_CHUNK_SEND;
+		if(!same) to_send += len;
+	}
+	return to_send;
+}
 
-		for(uint32_t retry = 0; retry < RETRY_CNT; retry++)
+/**
+ * \brief Read the config region of the device, at least `need` bytes and as
+ * much as its own size word covers (up to CFG_READ_MAX)
+ * \return bytes read, <0 - libusb error; `*out` is malloc'ed
+ */
+static int read_config(target_t *t, const dfu_caps_t *caps, uint32_t need, uint8_t **out)
+{
+	dfu_upload_t up;
+	dfu_upload_init(&up, t->handle, cfg.sel, caps);
+	uint8_t *buf = NULL;
+	uint32_t len = 0, cap = 0;
+	int sts = 0;
+	while(len < need || up.stream) // a running stream is read till its end
+	{
+		if(cap - len < up.len)
 		{
-			PERCENT_TRACKER_INIT(tr);
-			for(uint32_t off = 0;; off += cfg.chunk)
+			cap = cap ? cap * 2 : up.len * 4;
+			uint8_t *p = realloc(buf, cap);
+			if(!p)
 			{
-				if(off >= content_length)
-				{
-					errc = 0;
-					break;
-				}
-				uint8_t pkt[4 + QUANT_FLASH];
-				memcpy(&pkt[0], &off, 4);
-				uint32_t size_to_write = (uint32_t)content_length - off > cfg.chunk ? cfg.chunk : (uint32_t)content_length - off;
-				memcpy(&pkt[4], &content[off], size_to_write);
+				sts = LIBUSB_ERROR_NO_MEM;
+				break;
+			}
+			buf = p;
+		}
+		for(uint32_t try = 0; try < RETRY_CNT; try++)
+		{
+			if((sts = dfu_upload_next(&up, &buf[len])) >= 0) break;
+			dfu_upload_seek(&up, len);
+		}
+		if(sts <= 0) break;
+		if(len < 4 && len + (uint32_t)sts >= 4)
+		{
+			uint32_t size;
+			memcpy(&size, buf, sizeof(size));
+			if(size <= CFG_READ_MAX - 8 && size + 8 > need) need = size + 8;
+		}
+		len += (uint32_t)sts;
+		if(len >= CFG_READ_MAX * 4) break;
+	}
+	dfu_upload_free(&up);
+	if(sts < 0)
+	{
+		free(buf);
+		return sts;
+	}
+	*out = buf;
+	return (int)len;
+}
 
-				int sts_dfu_write;
-				for(uint32_t retr_write = 0; retr_write < RETRY_CNT; retr_write++)
-				{
-					if((sts_dfu_write = dfu_write(cfg.sel, pkt, 4 + (uint16_t)size_to_write)) >= 0) break;
-				}
-				if(sts_dfu_write < 0)
-				{
-					fprintf(stderr, "error:    failed to write (%s) @%d\n", libusb_err2str(sts), off);
-					errc = ERR_WR;
-					break;
-				}
+static void print_hex(const uint8_t *p, uint32_t len)
+{
+	for(uint32_t i = 0; i < len && i < 16; i++)
+		fprintf(stderr, "%02x", p[i]);
+	if(len > 16) fprintf(stderr, "..(%d)", len);
+}
+
+/**
+ * \brief Read the device config and print by key how `content` differs from it
+ * \return 1 - the same, nothing to write, 0 - differs, `*dev` holds the device
+ * copy, <0 - device config can't be read
+ */
+static int cfg_device_diff(target_t *t, const dfu_caps_t *caps, uint8_t **dev, size_t *dev_len)
+{
+	int len = read_config(t, caps, t->length, dev);
+	if(len < 0)
+	{
+		fprintf(stderr, "warn:    %s: can't read the config (%s), writing it all\n", t->serial, libusb_err2str(len));
+		return len;
+	}
+	*dev_len = (size_t)len;
+	if((uint32_t)len >= t->length && memcmp(*dev, content, t->length) == 0)
+	{
+		fprintf(stderr, "info:    %s: config is up to date, nothing to write\n", t->serial);
+		return 1;
+	}
 
-				PERCENT_TRACKER_TRACK(tr, (double)off / (double)(content_length),
-									  { fprintf(stderr, "\rinfo:    %.1f%% | pass: %lld sec | est: %lld sec        ",
-												100.0 * tr.progress, tr.time_ms_pass / 1000, tr.time_ms_est / 1000); });
-				fflush(stdout);
+	cfg_index_t old, new;
+	int sts = cfg_index_build(&old, *dev, (size_t)len);
+	if(sts) fprintf(stderr, "info:    %s: config on the device is invalid (%s)\n", t->serial, parse_cfg_sts_str(sts));
+	if(!sts && cfg_index_build(&new, content, t->length) == 0)
+	{
+		for(uint32_t i = 0; i < new.count; i++)
+		{
+			const cfg_entry_t *e = &new.entry[i], *o = cfg_index_find(&old, e->key);
+			if(o && o->len == e->len && memcmp(&(*dev)[o->value], &content[e->value], e->len) == 0) continue;
+			fprintf(stderr, "info:    %s: cfg %c %s ", t->serial, o ? '~' : '+', e->key);
+			if(o)
+			{
+				print_hex(&(*dev)[o->value], o->len);
+				fprintf(stderr, " -> ");
 			}
-			if(errc == 0)
+			print_hex(&content[e->value], e->len);
+			fprintf(stderr, "\n");
+		}
+		for(uint32_t i = 0; i < old.count; i++)
+		{
+			if(!cfg_index_find(&new, old.entry[i].key)) fprintf(stderr, "info:    %s: cfg - %s\n", t->serial, old.entry[i].key);
+		}
+		cfg_index_free(&new);
+	}
+	cfg_index_free(&old);
+	return 0;
+}
+
+// "cfg file [key[=hex]...]": list the entries, print looked up values, or edit the file in place
+static int cfg_cmd(int argc, char *argv[])
+{
+	const char *file_name = argv[0];
+	size_t length;
+	int errc = load_content(file_name, &length);
+	if(errc) return errc;
+
+	cfg_index_t ix;
+	int sts = cfg_index_build(&ix, content, length);
+	if(sts)
+	{
+		fprintf(stderr, "error:    %s is not a config: %s\n", file_name, parse_cfg_sts_str(sts));
+		errc = ERR_CHK;
+	}
+	int sets = 0;
+	for(int i = 1; i < argc; i++) // lookups are printed in the order given, edits go after them
+	{
+		if(strchr(argv[i], '='))
+		{
+			argv[1 + sets++] = argv[i];
+			continue;
+		}
+		const cfg_entry_t *e = errc ? NULL : cfg_index_find(&ix, argv[i]);
+		if(!e)
+		{
+			if(!errc) fprintf(stderr, "error:    no config key \"%s\"\n", argv[i]);
+			errc = ERR_CHK;
+			continue;
+		}
+		printf("%s ", e->key);
+		for(uint32_t k = 0; k < e->len; k++)
+			printf("%02x", content[e->value + k]);
+		printf("\n");
+	}
+	if(!errc && argc == 1)
+	{
+		for(uint32_t i = 0; i < ix.count; i++)
+		{
+			printf("x%04x %5d %-32s ", ix.entry[i].value, ix.entry[i].len, ix.entry[i].key);
+			for(uint32_t k = 0; k < ix.entry[i].len; k++)
+				printf("%02x", content[ix.entry[i].value + k]);
+			printf("\n");
+		}
+	}
+	cfg_index_free(&ix);
+
+	uint8_t *edited = NULL;
+	size_t edited_len = 0;
+	if(!errc && sets) errc = cfg_edit(content, length, &argv[1], sets, &edited, &edited_len);
+	image_free(&image);
+	content = NULL;
+	if(edited)
+	{
+		char tmp[1040];
+		snprintf(tmp, sizeof(tmp), "%s.tmp", file_name);
+		FILE *cf = fopen(tmp, "wb");
+		bool ok = cf && fwrite(edited, 1, edited_len, cf) == edited_len;
+		if(cf && fclose(cf)) ok = false;
+		if(ok)
+		{
+#if defined(_WIN32) || defined(WIN32)
+			remove(file_name); // rename() doesn't replace there
+#endif
+			ok = rename(tmp, file_name) == 0;
+		}
+		if(!ok)
+		{
+			fprintf(stderr, "error:    write file %s\n", file_name);
+			remove(tmp);
+			errc = ERR_FILE;
+		}
+		else
+			fprintf(stderr, "info:    %s: %d key(s) set, %zu bytes\n", file_name, sets, edited_len);
+		free(edited);
+	}
+	return errc;
+}
+
+/**
+ * \brief Build the DFU_DN_LZ packet stream for `file_name` exactly as --lz
+ * sends it and unpack every frame with the reference decoder
+ */
+static int lz_check(const char *file_name, uint32_t chunk)
+{
+	size_t content_length;
+	int errc = load_content(file_name, &content_length);
+	if(errc) return errc;
+
+	dfu_src_image_t img = {.content = content, .length = (uint32_t)content_length, .chunk = chunk};
+	dfu_src_lz_t lz;
+	uint8_t *out = malloc(DFU_LZ_FRAME);
+	if(!out || dfu_src_lz_init(&lz, &img))
+	{
+		fprintf(stderr, "error:    can't frame %s by %d bytes\n", file_name, chunk);
+		free(out);
+		return ERR_ARGC;
+	}
+
+	uint32_t packets = 0, frames = 0;
+	dfu_op_t op;
+	for(uint32_t pos = 0; dfu_src_lz(&lz, pos, &op) > 0; pos = op.next, packets++)
+	{
+		if(!(op.value & DFU_DN_LZ)) continue;
+		uint16_t raw_len;
+		memcpy(&raw_len, op.data, 2);
+		frames++;
+		if(op.len > chunk || raw_len != op.next - op.off ||
+		   lz_decode(&op.data[2], op.len - 2, out, raw_len) != raw_len ||
+		   memcmp(out, &content[op.off], raw_len) != 0)
+		{
+			fprintf(stderr, "error:    frame @%d (%d -> %d bytes) doesn't decode back\n", op.off, raw_len, op.len);
+			errc = ERR_CHK;
+			break;
+		}
+	}
+	if(!errc)
+	{
+		fprintf(stderr, "info:    lz: %zu -> %d bytes, %d packets (%d compressed), %.1f%% on the wire\n",
+				content_length, lz.z_bytes, packets, frames, content_length ? 100.0 * lz.z_bytes / (double)content_length : 100.0);
+	}
+
+	dfu_src_lz_free(&lz);
+	free(out);
+	image_free(&image);
+	content = NULL;
+	return errc;
+}
+
+static int LIBUSB_CALL on_arrived(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+	(void)ctx;
+	(void)event;
+	target_t *t = user_data;
+	if(!t->port_len || same_port(t->bus, t->port, t->port_len, dev)) atomic_store(&t->arrived, true);
+	return 0;
+}
+
+/**
+ * \brief Find the device, and again once it is rebooted into the right fw.
+ * The rescan starts as soon as a device arrives on the port (hotplug) or
+ * every POLL_MS without hotplug support or for a sub device, all within
+ * REENUM_TO.
+ * `t` keeps its port once found.
+ */
+static int open_target(target_t *t)
+{
+	libusb_hotplug_callback_handle hp;
+	atomic_store(&t->arrived, false);
+	bool hotplug = usb_io->has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+				   usb_io->hotplug_register_callback(NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, 0, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+													LIBUSB_HOTPLUG_MATCH_ANY, on_arrived, t, &hp) == LIBUSB_SUCCESS;
+
+	telem_begin(&t->telem, TELEM_ENUM);
+	int sts = find_usb_device(t, cfg.write, cfg.dev_name, cfg.sub_name, cfg.sel);
+	telem_end(&t->telem, TELEM_ENUM);
+	bool rebooted = sts == 1;
+	if(rebooted) telem_begin(&t->telem, TELEM_REBOOT);
+	TD_V t0, t1;
+	TD_GET(t0);
+	while(rebooted && sts != 0)
+	{
+		TD_GET(t1);
+		int64_t left = REENUM_TO - (int64_t)(TD_CALC_ms(t1, t0));
+		if(left <= 0) break;
+		bool wait_event = hotplug && !atomic_load(&t->arrived);
+		if(wait_event)
+		{
+			int64_t wait = cfg.sub_name ? POLL_MS : 100;
+			struct timeval tv = {.tv_sec = 0, .tv_usec = 1000 * (left < wait ? left : wait)};
+			usb_io->handle_events_timeout_completed(NULL, &tv, NULL);
+			if(!cfg.sub_name) continue; // a sub reboot may leave the device on the bus: no event comes, poll as well
+		}
+		sts = find_usb_device(t, cfg.write, cfg.dev_name, cfg.sub_name, cfg.sel);
+		if(sts == 1)
+			atomic_store(&t->arrived, false); // rebooted once more, wait for it again
+		else if(sts != 0 && !wait_event)
+			delay_ms(POLL_MS); // not ready to talk yet
+	}
+	if(hotplug) usb_io->hotplug_deregister_callback(NULL, hp);
+	telem_end(&t->telem, TELEM_REBOOT);
+
+	if(sts == -4) return ERR_CHK; // image is for another product
+	if(sts != 0)
+	{
+		fprintf(stderr, rebooted ? "error:    failed to reboot device \"%s%s%s\" 2nd time\n" : "error:    failed to find device \"%s%s%s\"\n",
+				cfg.dev_name, cfg.sub_name ? ":" : "", cfg.sub_name ? cfg.sub_name : "");
+		return ERR_REBOOT;
+	}
+	return 0;
+}
+
+// every op that ended on the wire: telemetry, then the adaptive controller
+static void op_done(void *arg, const dfu_op_t *op, int sts, uint32_t latency_us)
+{
+	target_t *t = arg;
+	telem_op(&t->telem, op->pos, op->next, op->len, sts, latency_us);
+	if(t->ad) adapt_done(t->ad, op, sts, latency_us);
+}
+
+// write `content` to the opened device, check it and reboot it
+static int write_target(target_t *t)
+{
+	int sts;
+	telem_begin(&t->telem, TELEM_PREPARE);
+	dfu_caps_t caps;
+	dfu_get_caps(t->handle, cfg.sel, &caps);
+	uint32_t chunk = dfu_chunk_size(&caps, cfg.chunk);
+	if(cfg.chunk && chunk != cfg.chunk) fprintf(stderr, "warn:    chunk size limited to %d by device\n", chunk);
+	if(cfg.probe) chunk = probe_chunk(t, &caps);
+	bool diff = cfg.diff && (caps.flags & DFU_CAP_CRC_MAP);
+	if(cfg.diff && !(caps.flags & DFU_CAP_CRC_MAP)) fprintf(stderr, "warn:    device has no CRC map, writing the whole image\n");
+	if(diff && !caps.page)
+	{
+		fprintf(stderr, "warn:    device doesn't report its erase page, writing the whole image\n");
+		diff = false;
+	}
+	bool edit = cfg.sel == FW_APP + 1 && !cfg.stream && caps.page; // config chunks equal to the device's are skipped
+	if(diff || edit) chunk = page_chunk(chunk, caps.page);			// a skipped chunk must not share a page with a written one
+	fprintf(stderr, "info:    chunk %d bytes (device limit %d, ep0 %d, page %d)\n", chunk, dfu_chunk_max(&caps), caps.ep0_size, caps.page);
+
+	uint8_t *dev_cfg = NULL; // the device config, what is sent is diffed against it
+	size_t dev_cfg_len = 0;
+	bool same = false;
+	if(cfg.sel == FW_APP + 1 && !cfg.stream) same = cfg_device_diff(t, &caps, &dev_cfg, &dev_cfg_len) == 1;
+
+	if(cfg.sparse && !(caps.flags & DFU_CAP_FILL)) fprintf(stderr, "warn:    device can't fill ranges, writing erased chunks\n");
+	if(!same && (diff || (cfg.sparse && (caps.flags & DFU_CAP_FILL))) && (t->map = calloc((t->length + chunk - 1) / chunk + 1, 1)))
+	{
+		if(diff)
+		{
+			uint32_t differ = diff_map(t, t->map, t->length, chunk), to_send = page_map(t->map, t->length, chunk, caps.page);
+			fprintf(stderr, "info:    diff: %d of %d bytes differ, %d sent as whole erase pages\n", differ, t->length, to_send);
+		}
+		if(cfg.sparse && (caps.flags & DFU_CAP_FILL))
+		{
+			uint32_t ranges = 0, saved = sparse_map(t->map, t->length, chunk, &ranges);
+			fprintf(stderr, "info:    sparse: %d erased bytes saved (%d fill ranges)\n", saved, ranges);
+		}
+	}
+	// only what was read back is known to be on the device, unread it's written whole
+	if(!same && edit && dev_cfg && !t->map && (t->map = calloc((t->length + chunk - 1) / chunk + 1, 1)))
+	{
+		uint32_t changed = edit_map(t->map, t->length, chunk, dev_cfg, dev_cfg_len), to_send = page_map(t->map, t->length, chunk, caps.page);
+		fprintf(stderr, "info:    cfg: %d of %d bytes changed, %d sent as whole erase pages\n", changed, t->length, to_send);
+	}
+	free(dev_cfg);
+
+	int errc = same ? 0 : 1;
+
+	dfu_src_image_t src = {.content = content, .length = t->length, .chunk = chunk, .fw_index = cfg.sel, .map = t->map};
+	dfu_queue_t q = {
+		.handle = t->handle,
+		.depth = cfg.queue,
+		.max_len = chunk,
+		.timeout_ms = DFU_DNLOAD_TO,
+		.src = dfu_src_image,
+		.src_arg = &src,
+		.progress = write_progress,
+		.progress_arg = t,
+		.done = op_done,
+		.done_arg = t,
+	};
+	dfu_src_stream_t pipe_src = {0};
+	if(cfg.stream)
+	{
+		if(dfu_src_stream_init(&pipe_src, f, chunk, cfg.sel, cfg.queue))
+		{
+			fprintf(stderr, "error:    no memory for the stream window\n");
+			return ERR_FILE_READ;
+		}
+		q.src = dfu_src_stream;
+		q.src_arg = &pipe_src;
+	}
+	dfu_src_lz_t lz = {0};
+	if(cfg.lz && !(caps.flags & DFU_CAP_LZ)) fprintf(stderr, "warn:    device has no LZ decoder, sending raw packets\n");
+	if(cfg.lz && (caps.flags & DFU_CAP_LZ) && dfu_src_lz_init(&lz, &src) == 0)
+	{
+		q.src = dfu_src_lz;
+		q.src_arg = &lz;
+		fprintf(stderr, "info:    lz: %d of %d bytes on the wire\n", lz.z_bytes, lz.raw_bytes);
+	}
+	adapt_t ad;
+	if(cfg.adaptive)
+	{
+		// chunk size is free to change only for plain consecutive packets
+		bool free_chunk = q.src == dfu_src_image && !t->map && !cfg.chunk && !cfg.probe;
+		adapt_init(&ad, &q, free_chunk ? &src : NULL, &caps);
+		t->ad = &ad;
+	}
+
+	if(cfg.resume)
+	{
+		// every device of an --all run keeps its own journal
+		int n = cfg.all ? snprintf(t->journal.path, sizeof(t->journal.path), "%s.%s.resume", cfg.file_name, t->serial)
+						: snprintf(t->journal.path, sizeof(t->journal.path), "%s.resume", cfg.file_name);
+		if(n > 0 && (size_t)n < sizeof(t->journal.path))
+		{
+			// acked positions are chunk / frame boundaries of this very map: a new --diff map after a partial write starts over
+			uint32_t map_crc = t->map ? crc32_update(0xFFFFFFFF, t->map, (t->length + chunk - 1) / chunk) : 0;
+			snprintf(t->journal.key, sizeof(t->journal.key), "v3 %s:%s %d %d %08x %d %s %08x", t->serial, cfg.sub_name ? cfg.sub_name : "", cfg.sel,
+					 t->length, crc32_mt(content, t->length), chunk, q.src == dfu_src_lz ? "lz" : "raw", map_crc);
+			t->journal.on = true;
+			q.pos = t->journal.saved = journal_load(t);
+			if(q.pos >= t->length) q.pos = 0;
+			if(q.pos) fprintf(stderr, "info:    %s: resuming from @%d\n", t->serial, q.pos);
+		}
+	}
+
+	telem_end(&t->telem, TELEM_PREPARE);
+	telem_data(&t->telem, t->length, chunk);
+	telem_begin(&t->telem, TELEM_DATA);
+	for(uint32_t retry = 0; retry < RETRY_CNT && !same; retry++)
+	{
+		PERCENT_TRACKER_INIT(t->tr);
+		uint32_t start = q.pos;
+		if((sts = dfu_queue_run(&q)) == 0)
+		{
+			errc = 0;
+			if(!t->quiet)
 			{
 				fprintf(stderr, "\rinfo:    100.0%% | pass: %.3f sec | speed: %.2f kB/s        ",
-						(double)tr.time_ms_pass * 0.001, (double)(content_length / (double)tr.time_ms_pass));
-				break;
+						(double)t->tr.time_ms_pass * 0.001, (double)((q.pos - start) / (double)t->tr.time_ms_pass));
 			}
-			if(retry != RETRY_CNT - 1) fprintf(stderr, "error:    trying again...\n");
+			break;
+		}
+		fprintf(stderr, "%serror:    %s: failed to write (%s) @%d\n", t->quiet ? "" : "\n", t->serial, libusb_err2str(q.err), q.err_off);
+		errc = ERR_WR;
+		journal_save(t, q.pos);
+		if(sts == LIBUSB_ERROR_NO_DEVICE || sts == LIBUSB_ERROR_NO_MEM) break;
+		t->telem.resyncs++;
+		if((sts = resync(t)) < 0)
+		{
+			fprintf(stderr, "error:    %s: failed to resync: %s\n", t->serial, libusb_err2str(sts));
+			break;
+		}
+		if(retry != RETRY_CNT - 1) fprintf(stderr, "error:    %s: trying again from @%d...\n", t->serial, q.pos);
+	}
+	if(!t->quiet && !same) fprintf(stderr, "\n");
+	telem_end(&t->telem, TELEM_DATA);
+	if(cfg.adaptive) adapt_report(&ad);
+	t->ad = NULL;
+	dfu_src_lz_free(&lz);
+	dfu_src_stream_free(&pipe_src);
+	if(!errc && t->journal.on) remove(t->journal.path);
+
+	telem_begin(&t->telem, TELEM_FINISH);
+	if(!errc && !same && !cfg.stream && cfg.sel == FW_APP + 1)
+	{
+		uint8_t *back = NULL; // the config is small: read it back whole
+		int len = read_config(t, &caps, t->length, &back);
+		uint32_t bad = 0;
+		while(len >= 0 && bad < (uint32_t)len && bad < t->length && back[bad] == content[bad])
+			bad++;
+		if(len < 0) fprintf(stderr, "error:    %s: failed to read the config back (%s)\n", t->serial, libusb_err2str(len));
+		else if(bad < t->length) fprintf(stderr, "error:    %s: config on the device differs from the image @%d\n", t->serial, bad);
+		if(len < 0 || bad < t->length) errc = ERR_CHK;
+		free(back);
+	}
+	else if(!errc && !same && !cfg.stream && (caps.flags & DFU_CAP_CRC_MAP))
+	{
+		uint32_t bad = 0;
+		sts = verify_crc(t, chunk & ~3U ? chunk & ~3U : 4, &bad);
+		if(sts < 0) fprintf(stderr, "warn:    %s: failed to verify (%s)\n", t->serial, libusb_err2str(sts));
+		if(sts == 1)
+		{
+			fprintf(stderr, "error:    %s: device differs from the image @%d\n", t->serial, bad);
+			errc = ERR_CHK;
+		}
+	}
+	if(!errc && cfg.sel <= FW_APP)
+	{
+		uint8_t fw_sts[3] = {0};
+		sts = dfu_get_fw_sts(t->handle, fw_sts);
+		if(sts < 0) fprintf(stderr, "error:    failed to get fw sts: %s\n", libusb_err2str(sts));
+		if(fw_sts[0] || fw_sts[1] || fw_sts[2])
+		{
+			fprintf(stderr, "error:    failed to check HW (%d %d %d)\n", fw_sts[0], fw_sts[1], fw_sts[2]);
+			errc = ERR_CHK;
+		}
+	}
+
+	if(errc == 0)
+	{
+		sts = dfu_reboot(t->handle, cfg.sub_name != NULL);
+		if(sts < 0)
+		{
+			fprintf(stderr, "error:    failed to reboot: %s\n", libusb_err2str(sts));
+			errc = ERR_REBOOT;
+		}
+	}
+	telem_end(&t->telem, TELEM_FINISH);
+	return errc;
+}
+
+// bind a target to every device whose serial starts with the device name
+static uint32_t find_all(target_t *t, uint32_t max)
+{
+	libusb_device **list = NULL;
+	ssize_t cnt = trace_get_device_list(NULL, &list);
+	if(cnt < 0) fprintf(stderr, "error    libusb: failed to get device list\n");
+
+	uint32_t n = 0;
+	for(ssize_t i = 0; i < cnt && n < max; i++)
+	{
+		char buf[256] = {0};
+		if(!open_matching(&t[n], list[i], cfg.dev_name, buf, sizeof(buf))) continue;
+		handle_close(&t[n]);
+
+		int port_len = usb_io->get_port_numbers(list[i], t[n].port, sizeof(t[n].port));
+		if(port_len <= 0) // nothing to tell it from the others after the reboot
+		{
+			fprintf(stderr, "warn:    %s: no port path, skipped\n", buf);
+			continue;
+		}
+		strcpy(t[n].serial, buf);
+		t[n].bus = usb_io->get_bus_number(list[i]);
+		t[n].port_len = port_len;
+		n++;
+	}
+	if(list) usb_io->free_device_list(list, 1);
+	return n;
+}
+
+static void *write_thread(void *arg)
+{
+	target_t *t = arg;
+	cfg = all_job.cfg;
+	content = all_job.content;
+	cfg_base = all_job.cfg_base;
+	memcpy(image_product, all_job.image_product, sizeof(image_product));
+	TD_V t0, t1;
+	TD_GET(t0);
+	t->errc = open_target(t);
+	if(!t->errc) t->errc = write_target(t);
+	handle_close(t);
+	TD_GET(t1);
+	t->time_ms = (uint64_t)(TD_CALC_ms(t1, t0));
+	atomic_store(&t->finished, true);
+	return NULL;
+}
+
+static void port_str(const target_t *t, char *s, size_t sz)
+{
+	int n = snprintf(s, sz, "%d-", t->bus);
+	for(int i = 0; i < t->port_len && n > 0 && (size_t)n < sz; i++)
+		n += snprintf(&s[n], sz - (size_t)n, i ? ".%d" : "%d", t->port[i]);
+}
+
+/**
+ * \brief Write the image to every matching device at once, one thread per
+ * device, each bound to its port so it finds the same device after reboot
+ */
+static int write_all(void)
+{
+	static pthread_t thr[TARGETS_MAX];
+	uint32_t n = all_cnt = find_all(all, TARGETS_MAX);
+	if(!n)
+	{
+		fprintf(stderr, "error:    failed to find device \"%s\"\n", cfg.dev_name);
+		return ERR_REBOOT;
+	}
+	fprintf(stderr, "info:    flashing %d devices\n", n);
+
+	all_job.cfg = cfg;
+	all_job.content = content;
+	all_job.cfg_base = cfg_base;
+	memcpy(all_job.image_product, image_product, sizeof(image_product));
+	uint32_t started = 0;
+	for(; started < n; started++)
+	{
+		all[started].length = tgt.length;
+		all[started].quiet = true;
+		if(pthread_create(&thr[started], NULL, write_thread, &all[started]) != 0)
+		{
+			fprintf(stderr, "error:    failed to start thread for %s\n", all[started].serial);
+			break;
 		}
-		fprintf(stderr, "\n");
+	}
 
-		if(!errc && cfg.sel <= FW_APP)
+	for(uint32_t done = 0; done < started;)
+	{
+		delay_ms(VIEW_PERIOD_MS);
+		char line[TARGETS_MAX * 24] = "";
+		int len = 0;
+		done = 0;
+		for(uint32_t i = 0; i < started && len >= 0 && (size_t)len < sizeof(line); i++) // a segment per device: its percent, then its result
 		{
-			uint8_t fw_sts[3];
-			sts = dfu_get_fw_sts(fw_sts);
-			if(sts < 0) fprintf(stderr, "error:    failed to get fw sts: %s\n", libusb_err2str(sts));
-			if(fw_sts[0] || fw_sts[1] || fw_sts[2])
+			uint32_t pos = atomic_load(&all[i].pos);
+			if(atomic_load(&all[i].finished))
+			{
+				done++;
+				len += snprintf(&line[len], sizeof(line) - (size_t)len, " | %.12s %s", all[i].serial, all[i].errc ? "FAIL" : "OK");
+			}
+			else
 			{
-				fprintf(stderr, "error:    failed to check HW (%d %d %d)\n", fw_sts[0], fw_sts[1], fw_sts[2]);
-				errc = ERR_CHK;
+				len += snprintf(&line[len], sizeof(line) - (size_t)len, " | %.12s %.0f%%", all[i].serial, all[i].length ? 100.0 * (double)pos / (double)all[i].length : 0.0);
 			}
 		}
+		fprintf(stderr, "\rinfo:    %d/%d done%s    ", done, started, line);
+	}
+	fprintf(stderr, "\n");
 
-		fprintf(stderr, errc ? "error:    update failed\n" : "info:    OK, exiting...\n");
+	int errc = started == n ? 0 : ERR_WR;
+	fprintf(stderr, "info:    %-24s %-16s %10s  %s\n", "device", "port", "time, s", "result");
+	for(uint32_t i = 0; i < started; i++)
+	{
+		pthread_join(thr[i], NULL);
+		char port[40];
+		port_str(&all[i], port, sizeof(port));
+		fprintf(stderr, "info:    %-24s %-16s %10.3f  %s\n", all[i].serial, port, (double)all[i].time_ms * 0.001, all[i].errc ? "FAIL" : "OK");
+		free(all[i].map);
+		if(all[i].errc && !errc) errc = all[i].errc;
+	}
+	fprintf(stderr, errc ? "error:    update failed\n" : "info:    OK, exiting...\n");
+	return errc;
+}
+
+/**
+ * \brief Self-test the CRC32 variants, then time them over `file_name` if given
+ */
+static int crc_check(const char *file_name)
+{
+	int sts = crc32_selftest();
+	if(sts)
+	{
+		fprintf(stderr, "error:    crc32 self-test failed at %d bytes\n", sts - 1);
+		return ERR_CHK;
+	}
+	fprintf(stderr, "info:    crc32 self-test passed\n");
+	if(!file_name) return 0;
 
-		if(errc == 0)
+	size_t content_length;
+	int errc = load_content(file_name, &content_length);
+	if(errc) return errc;
+	static const struct
+	{
+		const char *name;
+		uint32_t (*fn)(uint32_t crc, const uint8_t *p, uint32_t len);
+	} variant[] = {{"slice-by-8", crc32_sb8}, {"slice-by-16", crc32_sb16}, {"clmul", crc32_clmul}, {"with tail", crc32_update}};
+	for(uint32_t i = 0; i < sizeof(variant) / sizeof(variant[0]); i++)
+	{
+		if(variant[i].fn == crc32_clmul && !crc32_clmul_supported()) continue;
+		TD_V t0, t1;
+		TD_GET(t0);
+		uint32_t crc = variant[i].fn(0xFFFFFFFF, content, (uint32_t)content_length);
+		TD_GET(t1);
+		double us = (double)(TD_CALC_us(t1, t0));
+		fprintf(stderr, "info:    %-12s %08x | %.1f MB/s\n", variant[i].name, crc, us > 0 ? (double)content_length / us : 0.0);
+	}
+	TD_V t0, t1;
+	TD_GET(t0);
+	uint32_t crc = crc32_mt(content, (uint32_t)content_length);
+	TD_GET(t1);
+	double us = (double)(TD_CALC_us(t1, t0));
+	fprintf(stderr, "info:    %-12s %08x | %.1f MB/s\n", "threads", crc, us > 0 ? (double)content_length / us : 0.0);
+	image_free(&image);
+	content = NULL;
+	return 0;
+}
+
+// "inspect [--csv|--json] [--jobs N] path..."
+static int inspect_cmd(int argc, char *argv[], FILE *out)
+{
+	int format = INSPECT_JSON, jobs = 0, n = 0;
+	for(int i = 0; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--csv") == 0) format = INSPECT_CSV;
+		else if(strcmp(argv[i], "--json") == 0) format = INSPECT_JSON;
+		else if(strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) jobs = atoi(argv[++i]);
+		else if(strncmp(argv[i], "--", 2) == 0)
 		{
-			sts = dfu_reboot(cfg.sub_name != NULL);
-			if(sts < 0)
+			fprintf(stderr, "Error! Unknown option [%s]!\n", argv[i]);
+			return ERR_ARGC;
+		}
+		else argv[n++] = argv[i];
+	}
+	if(n == 0)
+	{
+		fprintf(stderr, "Error! No files to inspect!\n");
+		return ERR_ARGC;
+	}
+	return inspect_run(argv, n, format, jobs, out) ? ERR_FILE_READ : 0;
+}
+
+// trace, then the USB backend: libusb or the simulated devices
+static int io_start(void)
+{
+	if(cfg.trace && trace_start(cfg.trace))
+	{
+		fprintf(stderr, "error:    open file %s\n", cfg.trace);
+		return ERR_FILE;
+	}
+
+	if(cfg.sim)
+	{
+		if(sim_setup(cfg.sim)) return ERR_ARGC;
+		usb_io = &usb_io_sim;
+	}
+	int sts = usb_io->init();
+	if(sts < 0) fprintf(stderr, "error:    failed to initialize %s: %s\n", usb_io->name, libusb_err2str(sts));
+	return 0;
+}
+
+// the write or read `cfg` asks for
+static int run(void)
+{
+	int sts;
+	if(cfg.write)
+	{
+		size_t content_length = 0;
+		if(cfg.stream)
+		{
+			f = strcmp(cfg.file_name, "-") == 0 ? stdin : fopen(cfg.file_name, "rb");
+			if(!f)
 			{
-				fprintf(stderr, "error:    failed to reboot: %s\n", libusb_err2str(sts));
-				errc = ERR_REBOOT;
+				fprintf(stderr, "error:    open file %s\n", cfg.file_name);
+				return ERR_FILE;
 			}
 		}
+		else if((sts = load_content(cfg.file_name, &content_length)) != 0)
+		{
+			return sts;
+		}
+		if(cfg.set_count)
+		{
+			uint8_t *edited;
+			if((sts = cfg_edit(content, content_length, cfg.set, cfg.set_count, &edited, &content_length)) != 0) return sts;
+			cfg_base = content;
+			content = edited;
+		}
+		tgt.length = (uint32_t)content_length;
+		if(cfg.stream && !cfg.force) fprintf(stderr, "warn:    streamed image can't be checked before it is sent\n");
+		if(!cfg.stream && !cfg.force && (sts = preflight_image(content, content_length)) != 0) return sts;
+
+		if(cfg.stream)
+			fprintf(stderr, "info:    flashing %s %s to \"%s%s%s\" (streamed)...\n",
+					cfg.file_name, fw_type_str[cfg.sel], cfg.dev_name, cfg.sub_name ? ":" : "", cfg.sub_name ? cfg.sub_name : "");
+		else
+			fprintf(stderr, "info:    flashing %s %s to \"%s%s%s\" (%zu bytes)...\n",
+					cfg.file_name, fw_type_str[cfg.sel], cfg.dev_name, cfg.sub_name ? ":" : "", cfg.sub_name ? cfg.sub_name : "", content_length);
 
+		if(cfg.all) return write_all();
+
+		int errc = tgt.errc = open_target(&tgt);
+		if(errc) return errc;
+		errc = tgt.errc = write_target(&tgt);
+		fprintf(stderr, errc ? "error:    update failed\n" : "info:    OK, exiting...\n");
 		return errc;
 	}
 	else // read
@@ -422,27 +1681,44 @@ int main(int argc, char *argv[])
 		}
 		fprintf(stderr, "info:    reading \"%s%s%s\" %s to %s...\n", cfg.dev_name, cfg.sub_name ? ":" : "", cfg.sub_name ? cfg.sub_name : "", fw_type_str[cfg.sel], cfg.file_name);
 
-		cnt = libusb_get_device_list(NULL, &list);
-		if(cnt < 0) fprintf(stderr, "error    libusb: failed to get device list\n");
-		sts = find_usb_device(cfg.write, cfg.dev_name, cfg.sub_name, cfg.sel);
+		telem_begin(&tgt.telem, TELEM_ENUM);
+		sts = find_usb_device(&tgt, cfg.write, cfg.dev_name, cfg.sub_name, cfg.sel);
+		telem_end(&tgt.telem, TELEM_ENUM);
 		if(sts)
 		{
 			fprintf(stderr, "error:    failed to find device \"%s\"\n", cfg.dev_name);
-			return ERR_REBOOT;
+			return tgt.errc = ERR_REBOOT;
 		};
 
 		int errc = 1;
-		uint8_t pkt[QUANT_FLASH];
-		PERCENT_TRACKER_INIT(tr);
-		for(uint32_t offset = 0, readed_length = 0;; offset += (uint32_t)sts)
+		dfu_caps_t caps;
+		dfu_upload_t up;
+		outfile_t out;
+		if(outfile_init(&out, f))
 		{
+			fprintf(stderr, "error:    no memory for output buffers\n");
+			return ERR_RD;
+		}
+		dfu_get_caps(tgt.handle, cfg.sel, &caps);
+		dfu_upload_init(&up, tgt.handle, cfg.sel, &caps);
+		if(up.stream) fprintf(stderr, "info:    streaming by %d bytes over %s\n", up.len, up.ep ? "bulk IN" : "EP0");
+		PERCENT_TRACKER_INIT(tgt.tr);
+		telem_begin(&tgt.telem, TELEM_DATA);
+		for(uint32_t offset = 0;; offset += (uint32_t)sts)
+		{
+			uint8_t *pkt = outfile_reserve(&out, up.len);
 			errc = 1;
 			for(uint32_t try = 0; try < 5; try++)
 			{
-				sts = dfu_read(cfg.sel, offset, pkt, QUANT_FLASH);
+				TD_V r0, r1;
+				TD_GET(r0);
+				sts = dfu_upload_next(&up, pkt);
+				TD_GET(r1);
+				telem_op(&tgt.telem, offset, sts > 0 ? offset + (uint32_t)sts : offset, sts > 0 ? (uint32_t)sts : 0, sts, (uint32_t)(TD_CALC_us(r1, r0)));
 				if(sts < 0)
 				{
 					fprintf(stderr, "\rerror: failed to read (%d) @%d\n", sts, offset);
+					dfu_upload_seek(&up, offset);
 				}
 				else
 				{
@@ -452,33 +1728,141 @@ int main(int argc, char *argv[])
 			}
 			if(errc) break;
 
-			readed_length += (uint32_t)sts;
-			fprintf(stderr, "\rreading... %d bytes", readed_length);
+			if(offset == 0 && cfg.sel <= FW_APP) outfile_prealloc(&out, parse_fw_size_hint(pkt, (size_t)sts));
+			outfile_commit(&out, (uint32_t)sts);
+			if(sts == 0 || (offset + (uint32_t)sts) / JOURNAL_STEP != offset / JOURNAL_STEP)
+			{
+				if(job_out)
+				{
+					fprintf(job_out, "progress %d 0\n", offset + (uint32_t)sts);
+					fflush(job_out);
+				}
+				if(!tgt.quiet) fprintf(stderr, "\rreading... %d bytes", offset + (uint32_t)sts);
+			}
 			if(sts == 0) // done
 			{
+				uint32_t readed_length = offset;
+				if(tgt.quiet) fprintf(stderr, "info:    %s: %d bytes read", tgt.serial, readed_length);
 				struct timeval t1;
 				gettimeofday(&t1, NULL);
-				tr.time_ms_pass = (uint64_t)((t1.tv_sec - tr.t0.tv_sec) * 1000 + (t1.tv_usec - tr.t0.tv_usec) / 1000);
-				tr.time_ms_est = (uint64_t)((float)tr.time_ms_pass / tr.progress);
-				fprintf(stderr, " | pass: %.3f sec | speed: %.2f kB/s\n", (double)tr.time_ms_pass * 0.001, (double)(readed_length / (double)tr.time_ms_pass));
+				tgt.tr.time_ms_pass = (uint64_t)((t1.tv_sec - tgt.tr.t0.tv_sec) * 1000 + (t1.tv_usec - tgt.tr.t0.tv_usec) / 1000);
+				tgt.tr.time_ms_est = (uint64_t)((float)tgt.tr.time_ms_pass / tgt.tr.progress);
+				fprintf(stderr, " | pass: %.3f sec | speed: %.2f kB/s\n", (double)tgt.tr.time_ms_pass * 0.001, (double)(readed_length / (double)tgt.tr.time_ms_pass));
 				if(readed_length == 0) fprintf(stderr, "FW region is invalid (size is 0)\n");
-				errc == 0;
+				if(outfile_finish(&out))
+				{
+					fprintf(stderr, "error:    failed to write to file %s\n", cfg.file_name);
+					errc = 1;
+					break;
+				}
+				fprintf(stderr, "info:    crc32 %08x\n", out.crc);
 				fclose(f);
 				f = NULL;
 				if(cfg.sel == FW_APP + 1 && readed_length) parse_file_cfg(cfg.file_name);
 				if(cfg.sel <= FW_APP && readed_length) parse_file_fw(cfg.file_name);
 				break;
 			}
-
-			size_t wr_cnt = fwrite(pkt, 1, (size_t)sts, f);
-			if(wr_cnt != (size_t)sts)
-			{
-				fprintf(stderr, "error:    failed to write to file %s\n", cfg.file_name);
-				errc = 1;
-				break;
-			}
 		}
+		telem_end(&tgt.telem, TELEM_DATA);
+		outfile_finish(&out);
+		dfu_upload_free(&up);
+		tgt.errc = errc;
 		fprintf(stderr, errc ? "Error!\n" : "info:    OK, exiting...\n");
 		return errc;
 	}
 }
+
+// one request of a daemon client, run on its connection thread
+static int daemon_job(int argc, char *argv[], FILE *out)
+{
+	int sts;
+	if(argc >= 2 && strcmp(argv[1], "inspect") == 0)
+	{
+		sts = inspect_cmd(argc - 2, &argv[2], out);
+		fprintf(out, "result %d {}\n", sts);
+		return sts;
+	}
+
+	job_out = out;
+	tgt.quiet = true;
+	if((sts = parse_arg(argv, argc)) == 0 && (cfg.all || cfg.trace || cfg.sim || strcmp(cfg.file_name, "-") == 0))
+	{
+		fprintf(stderr, "Error! --all, --trace, --sim and \"-\" are not for daemon jobs!\n");
+		sts = ERR_ARGC;
+	}
+	uint8_t bus, port[sizeof(tgt.port)];
+	int port_len;
+	if(!sts && !daemon_claim(cfg.dev_name, cfg.vid, cfg.pid, &bus, port, &port_len))
+	{
+		fprintf(stderr, "error:    failed to find device \"%s\"\n", cfg.dev_name);
+		sts = ERR_REBOOT;
+	}
+	else if(!sts)
+	{
+		tgt.bus = bus; // only this port is looked at, the device is ours till it is released
+		memcpy(tgt.port, port, sizeof(port));
+		tgt.port_len = port_len;
+		sts = run();
+		handle_close(&tgt);
+		daemon_release(bus, port, port_len);
+	}
+	tgt.errc = sts;
+	fprintf(out, "result %d ", sts);
+	target_json(out, &tgt);
+	fprintf(out, "\n");
+	fflush(out);
+	run_free();
+	return sts;
+}
+
+// "daemon socket [--sim spec] [--trace file]"
+static int daemon_cmd(int argc, char *argv[])
+{
+	const char *path = NULL;
+	for(int i = 0; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--sim") == 0 && i + 1 < argc)
+			cfg.sim = argv[++i];
+		else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			cfg.trace = argv[++i];
+		else if(strncmp(argv[i], "--", 2) != 0 && !path)
+			path = argv[i];
+		else
+		{
+			fprintf(stderr, "Error! Unknown daemon argument [%s]!\n", argv[i]);
+			return ERR_ARGC;
+		}
+	}
+	if(!path)
+	{
+		fprintf(stderr, "Error! No socket path!\n");
+		return ERR_ARGC;
+	}
+
+	atexit(on_exit_cb);
+	int sts = io_start();
+	if(sts) return sts;
+	return daemon_run(path, daemon_job) ? ERR_FILE : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc >= 3 && argc <= 4 && strcmp(argv[1], "lz") == 0) return lz_check(argv[2], argc == 4 ? (uint32_t)atoi(argv[3]) : DFU_LEGACY_CHUNK);
+	if(argc >= 2 && argc <= 3 && strcmp(argv[1], "crc") == 0) return crc_check(argc == 3 ? argv[2] : NULL);
+	if(argc >= 3 && strcmp(argv[1], "inspect") == 0) return inspect_cmd(argc - 2, &argv[2], stdout);
+	if(argc >= 3 && strcmp(argv[1], "cfg") == 0) return cfg_cmd(argc - 2, &argv[2]);
+	if(argc >= 3 && argc <= 4 && strcmp(argv[1], "trace") == 0) return trace_analyze(argv[2], argc == 4 ? (uint32_t)atoi(argv[3]) : 0) ? ERR_FILE_READ : 0;
+	if(argc >= 3 && strcmp(argv[1], "daemon") == 0) return daemon_cmd(argc - 2, &argv[2]);
+	if(argc >= 4 && strcmp(argv[1], "job") == 0)
+	{
+		int sts = daemon_client(argv[2], argc - 3, &argv[3]);
+		return sts < 0 ? ERR_FILE : sts;
+	}
+
+	int sts = parse_arg(argv, argc);
+	if(sts) return sts;
+
+	atexit(on_exit_cb);
+	if((sts = io_start()) != 0) return sts;
+	return run();
+}
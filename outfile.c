@@ -0,0 +1,116 @@
+#include "outfile.h"
+#include "crc32.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32) && !defined(WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+int outfile_init(outfile_t *o, FILE *f)
+{
+	memset(o, 0, sizeof(*o));
+	o->f = f;
+	o->buf[0] = malloc(OUTFILE_BATCH);
+	o->buf[1] = malloc(OUTFILE_BATCH);
+	o->crc = 0xFFFFFFFF;
+	if(o->buf[0] && o->buf[1]) return 0;
+	free(o->buf[0]);
+	free(o->buf[1]);
+	o->buf[0] = o->buf[1] = NULL;
+	return -1;
+}
+
+// reserve `size` bytes on disk ahead, a wrong guess costs nothing but the call
+void outfile_prealloc(outfile_t *o, uint64_t size)
+{
+#if !defined(_WIN32) && !defined(WIN32)
+	if(size > o->total && posix_fallocate(fileno(o->f), 0, (off_t)size) == 0) o->prealloc = size;
+#else
+	(void)o;
+	(void)size;
+#endif
+}
+
+// whole words go to crc32_mt(), a split word waits for the next batch
+static void hash(outfile_t *o, const uint8_t *p, uint32_t len)
+{
+	for(; o->carry_len && len; len--)
+	{
+		o->carry[o->carry_len++] = *p++;
+		if(o->carry_len == 4)
+		{
+			crc32_end(o->carry, 4, &o->crc);
+			o->carry_len = 0;
+		}
+	}
+	uint32_t words = len & ~3U;
+	o->crc = crc32_combine(o->crc, crc32_mt(p, words), words);
+	memcpy(o->carry, &p[words], len - words);
+	o->carry_len = len - words;
+}
+
+static void *write_job(void *arg)
+{
+	outfile_t *o = arg;
+	if(fwrite(o->buf[!o->cur], 1, o->job_len, o->f) != o->job_len) o->err = -1;
+	hash(o, o->buf[!o->cur], o->job_len);
+	return NULL;
+}
+
+static void join(outfile_t *o)
+{
+	if(!o->thr_on) return;
+	pthread_join(o->thr, NULL);
+	o->thr_on = false;
+}
+
+static void flush(outfile_t *o)
+{
+	join(o);
+	o->cur = !o->cur;
+	o->job_len = o->fill;
+	o->fill = 0;
+	if(pthread_create(&o->thr, NULL, write_job, o) == 0)
+		o->thr_on = true;
+	else
+		write_job(o);
+}
+
+// room for `len` (<= OUTFILE_BATCH) bytes to receive into
+uint8_t *outfile_reserve(outfile_t *o, uint32_t len)
+{
+	if(o->fill + len > OUTFILE_BATCH) flush(o);
+	return &o->buf[o->cur][o->fill];
+}
+
+void outfile_commit(outfile_t *o, uint32_t len)
+{
+	o->fill += len;
+	o->total += len;
+}
+
+/**
+ * \brief Write the rest, wait for the helper and trim the preallocation
+ * \return 0 or -1 when a write failed
+ */
+int outfile_finish(outfile_t *o)
+{
+	if(o->buf[0])
+	{
+		join(o);
+		o->cur = !o->cur;
+		o->job_len = o->fill;
+		o->fill = 0;
+		write_job(o);
+		fflush(o->f);
+#if !defined(_WIN32) && !defined(WIN32)
+		if(o->prealloc > o->total && ftruncate(fileno(o->f), (off_t)o->total) != 0) o->err = -1;
+#endif
+	}
+	free(o->buf[0]);
+	free(o->buf[1]);
+	o->buf[0] = o->buf[1] = NULL;
+	return o->err;
+}
\ No newline at end of file
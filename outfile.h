@@ -0,0 +1,39 @@
+#ifndef OUTFILE_H__
+#define OUTFILE_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define OUTFILE_BATCH 0x100000 // bytes per write, one batch is written while the next is received
+
+/**
+ * Sequential writer of a read region: data is received straight into one of
+ * two batch buffers, a full batch is written and hashed (crc32(), merged
+ * per batch) by a helper thread while the other one fills
+ */
+typedef struct
+{
+	FILE *f;
+	uint8_t *buf[2];
+	uint32_t fill; // bytes in buf[cur]
+	int cur;
+	pthread_t thr;
+	bool thr_on;
+	uint32_t job_len; // bytes of buf[!cur] the thread writes
+	int err;
+	uint64_t total;
+	uint64_t prealloc; // size reserved on disk, trimmed back on finish
+	uint32_t crc;	  // of the batches written so far
+	uint8_t carry[4]; // bytes of a word split between batches
+	uint32_t carry_len;
+} outfile_t;
+
+int outfile_init(outfile_t *o, FILE *f);
+void outfile_prealloc(outfile_t *o, uint64_t size);
+uint8_t *outfile_reserve(outfile_t *o, uint32_t len);
+void outfile_commit(outfile_t *o, uint32_t len);
+int outfile_finish(outfile_t *o);
+
+#endif // OUTFILE_H__
\ No newline at end of file
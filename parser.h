@@ -0,0 +1,55 @@
+#ifndef PARSER_H__
+#define PARSER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// one fw field ("key\0value\0") or cfg entry (binary value) found by a parser
+typedef void (*parse_field_cb_t)(void *arg, const char *key, const uint8_t *value, uint32_t len, uint32_t addr);
+
+typedef struct
+{
+	int locked;			// ::FW_HDR_LOCK_t, LOCK_NONE - valid header found
+	bool header;		// a sane header was seen, fields below are its (even if locked)
+	uint32_t offset;	// header offset
+	uint32_t fw_size;
+	uint32_t fw_crc32;	// stored
+	uint32_t crc_calc;	// calculated, 0 - not calculated
+	uint32_t fields_addr_offset;
+} parse_fw_result_t;
+
+int parse_fw(const uint8_t *content, size_t content_length, parse_fw_result_t *r, parse_field_cb_t field, void *arg);
+const char *parse_fw_lock_str(int locked);
+
+// config blob: [size:4][entries, '\0' padded to size][crc32:4], entry is [key\0][len:2][value:len]
+typedef struct
+{
+	const char *key; // points into the blob
+	uint32_t off;	 // entry (key) offset in the blob
+	uint32_t value;	 // value offset in the blob
+	uint16_t len;
+} cfg_entry_t;
+
+typedef struct
+{
+	const uint8_t *content; // indexed blob, not copied
+	uint32_t size;			// data size between the size word and the CRC
+	uint32_t end;			// end of the last entry
+	cfg_entry_t *entry;		// in blob order
+	uint32_t count;
+} cfg_index_t;
+
+int cfg_index_build(cfg_index_t *ix, const uint8_t *content, size_t content_length);
+const cfg_entry_t *cfg_index_find(const cfg_index_t *ix, const char *key);
+void cfg_index_free(cfg_index_t *ix);
+int cfg_set(const cfg_index_t *ix, const char *key, const uint8_t *value, uint16_t len, uint8_t **out, size_t *out_len);
+
+int parse_cfg(const uint8_t *content, size_t content_length, parse_field_cb_t field, void *arg);
+const char *parse_cfg_sts_str(int sts);
+
+int parse_file_fw(const char *file_name);
+int parse_file_cfg(const char *file_name);
+uint32_t parse_fw_size_hint(const uint8_t *content, size_t content_length);
+
+#endif // PARSER_H__
\ No newline at end of file
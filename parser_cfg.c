@@ -1,4 +1,6 @@
 #include "crc32.h"
+#include "image.h"
+#include "parser.h"
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -7,7 +9,6 @@
 
 #define CONFIG_MAX_KEY_SIZE 32
 #define DATA_OFFSET 4
-#define BUFFER_SIZE 32
 
 typedef struct
 {
@@ -33,27 +34,7 @@ typedef enum
 	CONFIG_STS_NO_DATA,
 } config_sts_t;
 
-typedef enum
-{
-	PROCESS_FINISH = 0,
-	PROCESS_KEY,
-	PROCESS_LENGTH,
-	PROCESS_VALUE,
-} sts_t;
-
-typedef struct
-{
-	uint8_t name_buffer[CONFIG_MAX_KEY_SIZE];
-	uint16_t name_buffer_size;
-	uint16_t length_data;
-	uint16_t length_size;
-	uint32_t offset_entry_data; // global offset from the flash start
-	sts_t sts;
-} parse_struct_t;
-
-static parse_struct_t parser;
-
-static const char *err2str(int err)
+const char *parse_cfg_sts_str(int err)
 {
 	switch(err)
 	{
@@ -73,136 +54,155 @@ static const char *err2str(int err)
 	}
 }
 
-static config_sts_t parse_data(const uint8_t *content, const uint32_t offset_data, const uint8_t *data, uint16_t length)
+static void print_entry(void *arg, const char *key, const uint8_t *value, uint32_t len, uint32_t addr)
 {
-	for(uint16_t i = 0; i < length; i++)
-	{
-		switch(parser.sts)
-		{
-		case PROCESS_FINISH:
-			if(data[i] == '\0') continue; // padding is made of '\0'
-										  // fall through
-		case PROCESS_KEY:
-			parser.sts = PROCESS_KEY;
-			parser.name_buffer[parser.name_buffer_size++] = data[i];
-			if(parser.name_buffer_size >= CONFIG_MAX_KEY_SIZE && data[i] != '\0') return CONFIG_STS_KEY_LONG; // no end zero
-			if(data[i] == '\0' && parser.name_buffer_size <= 1) return CONFIG_STS_KEY_SHORT;
-			if(data[i] == '\0') parser.sts = PROCESS_LENGTH;
-			break;
-
-		case PROCESS_LENGTH:
-			parser.length_data |= data[i] << (8 * parser.length_size);
-			if(++parser.length_size >= 2)
-			{
-				if(parser.length_data == 0) return CONFIG_STS_LENGTH_DATA_ZERO;
-				parser.sts = PROCESS_VALUE;
-				parser.offset_entry_data = offset_data + (i + 1U) /* next byte*/;
-			}
-			break;
-
-		case PROCESS_VALUE:
-			if(parser.offset_entry_data + parser.length_data == offset_data + i + 1) // entry is ready!
-			{
-				parser.sts = PROCESS_FINISH;
-				{
-					char str[2048];
-					int len = 0;
-					for(uint32_t j = 0; j < parser.length_data; j++)
-						len += snprintf(&str[len], sizeof(str) - (size_t)len, " x%02x", content[parser.offset_entry_data + j]);
-
-					fprintf(stderr, "| %3db | %-20s | %-40s|\n", parser.length_data, parser.name_buffer, str);
-				}
-				memset(&parser, 0, sizeof(parser));
-			}
-			break;
-
-		default: break;
-		}
-	}
-	return CONFIG_STS_OK;
+	(void)arg;
+	(void)addr;
+	char str[2048] = "";
+	int n = 0;
+	for(uint32_t j = 0; j < len && (size_t)n + 4 < sizeof(str); j++)
+		n += snprintf(&str[n], sizeof(str) - (size_t)n, " x%02x", value[j]);
+
+	fprintf(stderr, "| %3db | %-20s | %-40s|\n", len, key, str);
 }
 
-static int parse(uint8_t *content, size_t content_length)
+/**
+ * \brief Check the size and the CRC framing and index the entries in place
+ * \return ::config_sts_t
+ */
+int cfg_index_build(cfg_index_t *ix, const uint8_t *content, size_t content_length)
 {
-	uint8_t buffer_array[BUFFER_SIZE];
-	uint32_t crc_val;
-
+	memset(ix, 0, sizeof(*ix));
+	ix->content = content;
+	if(content_length < DATA_OFFSET + 4) return CONFIG_STS_NO_DATA;
 	uint32_t size_config;
 	memcpy((uint8_t *)&size_config, content, sizeof(size_config));
-	crc32_start((uint8_t *)&size_config, sizeof(uint32_t), &crc_val);
-
-	const uint32_t end_data = DATA_OFFSET + size_config;
 
 	if(size_config < (8) /* minimal data */ ||
-	   size_config > DATA_OFFSET + content_length + 4 ||
+	   size_config > content_length - DATA_OFFSET - 4 /* data and the CRC inside the file */ ||
 	   (size_config & 0x03U) /* not the multiple of 4 */) return CONFIG_STS_WRONG_SIZE_CONFIG;
 
-	uint32_t crc_calc = 0;
-	for(uint32_t i = 0, word; i < size_config; i += 4)
-	{
-		memcpy((uint8_t *)&word, &content[DATA_OFFSET + i], sizeof(uint32_t));
-		crc_calc = crc32_end((uint8_t *)&word, sizeof(uint32_t), &crc_val);
-	}
-
+	const uint32_t end_data = DATA_OFFSET + size_config;
 	uint32_t crc_end;
 	memcpy((uint8_t *)&crc_end, &content[end_data], sizeof(uint32_t));
-	if(crc_end != crc_calc) return CONFIG_STS_CRC_INVALID;
+	if(crc_end != crc32(content, end_data)) return CONFIG_STS_CRC_INVALID;
+	ix->size = size_config;
+	ix->end = DATA_OFFSET;
 
-	memset(&parser, 0, sizeof(parser));
-
-	uint32_t offset_read = DATA_OFFSET;
-	for(;;)
+	uint32_t cap = 0;
+	for(uint32_t pos = DATA_OFFSET; pos < end_data;)
 	{
-		uint32_t size = BUFFER_SIZE;
-		if(size > end_data - offset_read) size = end_data - offset_read;
-
-		memcpy(buffer_array, &content[offset_read], size);
-
-		config_sts_t sts = parse_data(content, offset_read, buffer_array, (uint16_t)size);
-		if(sts) return sts;
+		if(content[pos] == '\0') // padding is made of '\0'
+		{
+			pos++;
+			continue;
+		}
+		uint32_t room = end_data - pos < CONFIG_MAX_KEY_SIZE ? end_data - pos : CONFIG_MAX_KEY_SIZE;
+		uint32_t key_len = (uint32_t)strnlen((const char *)&content[pos], room);
+		if(key_len == CONFIG_MAX_KEY_SIZE) return CONFIG_STS_KEY_LONG; // no end zero
+		if(key_len == room || pos + key_len + 3 > end_data) return CONFIG_STS_PARSER_NOT_FINISHED;
 
-		offset_read += size;
+		cfg_entry_t e = {.key = (const char *)&content[pos], .off = pos, .value = pos + key_len + 3};
+		e.len = (uint16_t)(content[pos + key_len + 1] | content[pos + key_len + 2] << 8);
+		if(e.len == 0) return CONFIG_STS_LENGTH_DATA_ZERO;
+		if(e.value + e.len > end_data) return CONFIG_STS_PARSER_NOT_FINISHED;
 
-		// last
-		if(offset_read == end_data)
+		if(ix->count == cap)
 		{
-			if(parser.sts != PROCESS_FINISH) return CONFIG_STS_PARSER_NOT_FINISHED;
-			return CONFIG_STS_OK;
+			cap = cap ? cap * 2 : 16;
+			cfg_entry_t *p = realloc(ix->entry, cap * sizeof(cfg_entry_t));
+			if(!p) return CONFIG_STS_STORAGE_READ_ERROR;
+			ix->entry = p;
 		}
+		ix->entry[ix->count++] = e;
+		pos = ix->end = e.value + e.len;
 	}
+	return CONFIG_STS_OK;
 }
 
-int parse_file_cfg(const char *file_name);
-int parse_file_cfg(const char *file_name)
+const cfg_entry_t *cfg_index_find(const cfg_index_t *ix, const char *key)
+{
+	for(uint32_t i = 0; i < ix->count; i++)
+		if(strcmp(ix->entry[i].key, key) == 0) return &ix->entry[i];
+	return NULL;
+}
+
+void cfg_index_free(cfg_index_t *ix)
 {
-	FILE *f = fopen(file_name, "rb");
-	if(!f)
+	free(ix->entry);
+	ix->entry = NULL;
+	ix->count = 0;
+}
+
+/**
+ * \brief New blob with `key` set to `value` (appended when missing, removed
+ * when `value` is NULL) and the size/CRC framing recomputed. Only the entry
+ * and what follows it move; the data size is kept while it still fits, so
+ * a same-length change touches the value and the CRC only.
+ * \return ::config_sts_t, `out` is malloc'ed on success
+ */
+int cfg_set(const cfg_index_t *ix, const char *key, const uint8_t *value, uint16_t len, uint8_t **out, size_t *out_len)
+{
+	size_t key_len = strlen(key);
+	if(key_len == 0) return CONFIG_STS_KEY_SHORT;
+	if(key_len >= CONFIG_MAX_KEY_SIZE) return CONFIG_STS_KEY_LONG;
+	if(value && len == 0) return CONFIG_STS_LENGTH_DATA_ZERO;
+
+	const cfg_entry_t *e = cfg_index_find(ix, key);
+	if(!e && !value) return CONFIG_STS_NO_DATA;
+	uint32_t from = e ? e->off : ix->end, to = e ? e->value + e->len : ix->end; // replaced range
+	uint32_t n = value ? (uint32_t)key_len + 3 + len : 0;
+
+	uint32_t end = ix->end - (to - from) + n; // end of the last entry
+	uint32_t size = end - DATA_OFFSET <= ix->size ? ix->size : (end - DATA_OFFSET + 3) & ~3U;
+
+	uint8_t *b = calloc(DATA_OFFSET + size + 4, 1);
+	if(!b) return CONFIG_STS_STORAGE_WRITE_ERROR;
+	memcpy(b, &size, sizeof(size));
+	memcpy(&b[DATA_OFFSET], &ix->content[DATA_OFFSET], from - DATA_OFFSET);
+	if(value)
 	{
-		fprintf(stderr, "CFG: error:\topen file %s\n", file_name);
-		return 1;
+		memcpy(&b[from], key, key_len + 1);
+		b[from + key_len + 1] = (uint8_t)len;
+		b[from + key_len + 2] = (uint8_t)(len >> 8);
+		memcpy(&b[from + key_len + 3], value, len);
 	}
+	memcpy(&b[from + n], &ix->content[to], ix->end - to);
+	uint32_t crc = crc32(b, DATA_OFFSET + size);
+	memcpy(&b[DATA_OFFSET + size], &crc, sizeof(crc));
+	*out = b;
+	*out_len = DATA_OFFSET + size + 4;
+	return CONFIG_STS_OK;
+}
 
-	fseek(f, 0, SEEK_END);
-	size_t file_size = (size_t)ftell(f);
-	rewind(f);
-	uint8_t *file_data = malloc(file_size);
+int parse_cfg(const uint8_t *content, size_t content_length, parse_field_cb_t field, void *arg)
+{
+	cfg_index_t ix;
+	int sts = cfg_index_build(&ix, content, content_length);
+	for(uint32_t i = 0; sts == 0 && field && i < ix.count; i++)
+		field(arg, ix.entry[i].key, &content[ix.entry[i].value], ix.entry[i].len, ix.entry[i].value);
+	cfg_index_free(&ix);
+	return sts;
+}
 
-	size_t read = fread(file_data, 1, file_size, f);
-	if(read != file_size)
+int parse_file_cfg(const char *file_name)
+{
+	image_t img;
+	int ld = image_load(&img, file_name);
+	if(ld)
 	{
-		fprintf(stderr, "CFG: error:\tread file (%zu %zu)\n", read, file_size);
-		if(f) fclose(f);
-		if(file_data) free(file_data);
-		return 2;
+		fprintf(stderr, ld == IMAGE_ERR_OPEN ? "CFG: error:\topen file %s\n" : "CFG: error:\tread file %s\n", file_name);
+		return ld;
 	}
+	uint8_t *file_data = img.data;
+	size_t file_size = img.length;
 
 	fprintf(stderr, "\n===== CFG Parser =====\n");
 	fprintf(stderr, "-------------------------------------------------------------------------\n");
-	int sts = parse(file_data, file_size);
+	int sts = parse_cfg(file_data, file_size, print_entry, NULL);
 	fprintf(stderr, "-------------------------------------------------------------------------\n");
-	if(sts) fprintf(stderr, "Error: %s\n", err2str(sts));
+	if(sts) fprintf(stderr, "Error: %s\n", parse_cfg_sts_str(sts));
 
-	if(f) fclose(f);
-	if(file_data) free(file_data);
+	image_free(&img);
 	return 0;
 }
\ No newline at end of file
@@ -1,10 +1,15 @@
 #include "crc32.h"
+#include "image.h"
+#include "parser.h"
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define FW_SIZE_HINT_MAX 0x4000000
+#define FW_HDR_WINDOW 0x800 // header is looked for at 4-aligned offsets below it
+
 typedef enum
 {
 	LOCK_NONE = 0,
@@ -41,7 +46,7 @@ typedef struct
 	uint32_t ver_patch;					// parsed patch version
 } fw_info_t;
 
-static const char *err2str(int err)
+const char *parse_fw_lock_str(int err)
 {
 	switch(err)
 	{
@@ -58,24 +63,69 @@ static const char *err2str(int err)
 	}
 }
 
-static int parse(fw_info_t *fw, fw_header_v1_t *hdr, uint8_t *content, size_t content_length, uint32_t header_offset)
+/** \brief Header fields that need no CRC: image inside the file, fields region inside the image */
+static bool hdr_sane(const fw_header_v1_t *hdr, uint32_t header_offset, size_t limit)
+{
+	uint32_t hdr_end = header_offset + (uint32_t)sizeof(fw_header_v1_t);
+	return hdr->fw_size > hdr_end && hdr->fw_size <= limit &&
+		   hdr->fields_addr_offset >= hdr_end && hdr->fields_addr_offset < hdr->fw_size;
+}
+
+/**
+ * \brief Header candidates share one image: prefix CRCs of the search window
+ * are hashed once, the image end once per distinct fw_size
+ */
+typedef struct
+{
+	const uint8_t *content;
+	size_t length;
+	uint32_t prefix[FW_HDR_WINDOW / 4 + 5]; // crc32() of the first 4*i bytes
+	uint32_t end;							// image length `end_crc` is cached for, 0 - none
+	uint32_t end_crc;
+} fw_locator_t;
+
+static void locator_init(fw_locator_t *l, const uint8_t *content, size_t content_length)
+{
+	l->content = content;
+	l->length = content_length;
+	l->end = 0;
+	uint32_t crc = crc32(content, 0);
+	l->prefix[0] = crc;
+	for(uint32_t i = 1; i < sizeof(l->prefix) / sizeof(l->prefix[0]) && i * 4 <= content_length; i++)
+	{
+		crc = crc32_update(crc, &content[(i - 1) * 4], 4);
+		l->prefix[i] = crc;
+	}
+}
+
+static int parse(fw_locator_t *l, fw_info_t *fw, fw_header_v1_t *hdr, uint32_t header_offset, uint32_t *crc_calc)
 {
 	fw->locked = LOCK_NONE; // init
-	memcpy(hdr, &content[header_offset], sizeof(fw_header_v1_t));
+	memcpy(hdr, &l->content[header_offset], sizeof(fw_header_v1_t));
 
 	fw->size = hdr->fw_size;
-	if(fw->size > content_length) fw->locked = LOCK_BY_ADDR; // check flash range
+	if(fw->size > l->length) fw->locked = LOCK_BY_ADDR; // check flash range
 	if(hdr->fw_size <= (header_offset + sizeof(fw_header_v1_t))) fw->locked = LOCK_BY_SIZE_SMALL;
+	if(!fw->locked && !hdr_sane(hdr, header_offset, l->length)) fw->locked = LOCK_BY_ADDR;
 	if(fw->locked) return fw->locked;
 
-	uint32_t crc_val;
-	crc32_start(content, header_offset, &crc_val);
-	if(crc32_end(&content[header_offset + sizeof(fw_header_v1_t)], hdr->fw_size - (header_offset + (uint32_t)sizeof(fw_header_v1_t)), &crc_val) != hdr->fw_crc32) fw->locked = LOCK_BY_CRC;
+	// crc32() of [0, header) ++ [header end, fw_size): the rest is the image prefix minus the window prefix
+	uint32_t hdr_end = header_offset + (uint32_t)sizeof(fw_header_v1_t);
+	uint32_t rest = (hdr->fw_size - hdr_end) & ~3U;
+	if(l->end != hdr_end + rest)
+	{
+		l->end = hdr_end + rest;
+		l->end_crc = crc32_mt(l->content, l->end);
+	}
+	uint32_t rest_crc = l->end_crc ^ crc32_combine(l->prefix[hdr_end / 4], 0, rest);
+	uint32_t crc_val = crc32_combine(l->prefix[header_offset / 4], rest_crc, rest);
+	*crc_calc = crc_val;
+	if(crc_val != hdr->fw_crc32) fw->locked = LOCK_BY_CRC;
 	if(fw->locked) return fw->locked;
 	return 0;
 }
 
-static void print_fields(uint8_t *content, uint32_t addr_fields_start, uint32_t region_size)
+static void walk_fields(const uint8_t *content, uint32_t addr_fields_start, uint32_t region_size, parse_field_cb_t field, void *arg)
 {
 	unsigned int null_term_count = 0, element_count = 0 /* field keys or values */;
 	bool null_captured = true; /* assuming that -1 element is '\0' */
@@ -96,7 +146,11 @@ static void print_fields(uint8_t *content, uint32_t addr_fields_start, uint32_t
 				null_captured = false;
 				if((element_count & 1U) == 0) // check only keys, not values
 				{
-					fprintf(stderr, "| %-24s | %-24s|\n", &content[addr_fields_start + i], &content[addr_fields_start + i + strlen(&content[addr_fields_start + i]) + 1]);
+					const char *key = (const char *)&content[addr_fields_start + i];
+					uint32_t key_len = (uint32_t)strnlen(key, region_size - i);
+					uint32_t val = i + key_len + 1, val_len = 0;
+					if(val < region_size) val_len = (uint32_t)strnlen((const char *)&content[addr_fields_start + val], region_size - val);
+					if(key_len < region_size - i) field(arg, key, val < region_size ? &content[addr_fields_start + val] : (const uint8_t *)"", val_len, addr_fields_start + val);
 				}
 			}
 		}
@@ -104,54 +158,92 @@ static void print_fields(uint8_t *content, uint32_t addr_fields_start, uint32_t
 	}
 }
 
-int parse_file_fw(const char *file_name);
-int parse_file_fw(const char *file_name)
+static void print_field(void *arg, const char *key, const uint8_t *value, uint32_t len, uint32_t addr)
 {
-	FILE *f = fopen(file_name, "rb");
-	if(!f)
-	{
-		fprintf(stderr, "FW: error:\topen file %s\n", file_name);
-		return 1;
-	}
-
-	fseek(f, 0, SEEK_END);
-	size_t file_size = (size_t)ftell(f);
-	rewind(f);
-	uint8_t *file_data = malloc(file_size);
+	(void)arg;
+	(void)addr;
+	fprintf(stderr, "| %-24s | %-24.*s|\n", key, (int)len, (const char *)value);
+}
 
-	size_t read = fread(file_data, 1, file_size, f);
-	if(read != file_size)
+/**
+ * \brief Guess the image size from its head before the rest is read: fw_size
+ * of the first offset holding a sane looking header (the CRC can't be checked
+ * yet, so it is only a hint)
+ * \return 0 - nothing found
+ */
+uint32_t parse_fw_size_hint(const uint8_t *content, size_t content_length)
+{
+	for(uint32_t offset = 4; offset < FW_HDR_WINDOW && offset + sizeof(fw_header_v1_t) <= content_length; offset += 4)
 	{
-		fprintf(stderr, "FW: error:\tread file (%zu %zu)\n", read, file_size);
-		if(f) fclose(f);
-		if(file_data) free(file_data);
-		return 2;
+		fw_header_v1_t hdr;
+		memcpy(&hdr, &content[offset], sizeof(hdr));
+		if(hdr_sane(&hdr, offset, FW_SIZE_HINT_MAX) && (hdr.fw_size & 3U) == 0) return hdr.fw_size;
 	}
+	return 0;
+}
 
-	fprintf(stderr, "\n===== FW Parser =====\n");
+/**
+ * \brief Locate the header, check the CRC and walk the fields of a valid one
+ * \return 0 - valid header, ::FW_HDR_LOCK_t of the best candidate otherwise
+ */
+int parse_fw(const uint8_t *content, size_t content_length, parse_fw_result_t *r, parse_field_cb_t field, void *arg)
+{
+	memset(r, 0, sizeof(*r));
+	r->locked = LOCK_BY_ADDR;
+	fw_locator_t *loc = malloc(sizeof(fw_locator_t));
+	if(!loc) return r->locked;
+	locator_init(loc, content, content_length);
 
 	fw_info_t fw;
 	fw_header_v1_t hdr;
-	int sts = 1;
-	uint32_t offset = 4;
-	for(; offset < 0x800 || offset < file_size; offset++)
+	for(uint32_t offset = 4; offset < FW_HDR_WINDOW && offset + sizeof(fw_header_v1_t) <= content_length; offset += 4)
+	{
+		uint32_t crc_calc = 0;
+		int sts = parse(loc, &fw, &hdr, offset, &crc_calc);
+		if(sts == LOCK_BY_ADDR || sts == LOCK_BY_SIZE_SMALL) continue;
+
+		// a header with a bad CRC is reported unless a valid one follows
+		if(sts == 0 || !r->header)
+		{
+			r->locked = sts;
+			r->header = true;
+			r->offset = offset;
+			r->fw_size = hdr.fw_size;
+			r->fw_crc32 = hdr.fw_crc32;
+			r->crc_calc = crc_calc;
+			r->fields_addr_offset = hdr.fields_addr_offset;
+		}
+		if(sts == 0) break;
+	}
+	free(loc);
+	if(r->locked == 0 && field) walk_fields(content, r->fields_addr_offset, (uint32_t)content_length - r->fields_addr_offset, field, arg);
+	return r->locked;
+}
+
+int parse_file_fw(const char *file_name)
+{
+	image_t img;
+	int ld = image_load(&img, file_name);
+	if(ld)
 	{
-		sts = parse(&fw, &hdr, file_data, file_size, offset);
-		if(sts == LOCK_BY_ADDR ||
-		   sts == LOCK_BY_CRC ||
-		   sts == LOCK_BY_SIZE_SMALL) continue;
-		if(sts) fprintf(stderr, "Error: %s\n", err2str(sts));
-		fprintf(stderr, "@offset x%x\n", offset);
-		break;
+		fprintf(stderr, ld == IMAGE_ERR_OPEN ? "FW: error:\topen file %s\n" : "FW: error:\tread file %s\n", file_name);
+		return ld;
 	}
+
+	fprintf(stderr, "\n===== FW Parser =====\n");
+
+	parse_fw_result_t r;
+	int sts = parse_fw(img.data, img.length, &r, NULL, NULL);
 	if(sts == 0)
 	{
+		fprintf(stderr, "@offset x%x\n", r.offset);
 		fprintf(stderr, "------------------------------------------------------\n");
-		print_fields(file_data, hdr.fields_addr_offset, file_size < hdr.fields_addr_offset ? 0 : (uint32_t)file_size - hdr.fields_addr_offset);
+		walk_fields(img.data, r.fields_addr_offset, (uint32_t)img.length - r.fields_addr_offset, print_field, NULL);
 		fprintf(stderr, "------------------------------------------------------\n");
 	}
+	else if(r.header)
+		fprintf(stderr, "Error: %s\n@offset x%x\n", parse_fw_lock_str(sts), r.offset);
 
-	if(f) fclose(f);
-	if(file_data) free(file_data);
+	image_free(&img);
 	return 0;
 }
\ No newline at end of file
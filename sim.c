@@ -0,0 +1,1075 @@
+#include "sim.h"
+#include "crc32.h"
+#include "dfu.h"
+#include "image.h"
+#include "lz.h"
+#include "parser.h"
+#include "timedate.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIM_REGIONS (FW_APP + 2) // preboot, boot, app, cfg
+#define SIM_VID 0x0483
+#define SIM_PID 0xDF11
+#define SIM_BULK_EP 0x81
+#define SIM_EVENTS_MAX_WAIT_NS (10 * NSEC_PER_MSEC) // handle_events() sleeps at most this long at once
+#define SIM_HOTPLUG_MAX 16							// registered callbacks
+
+enum
+{
+	STR_MANUFACTURER = 1,
+	STR_PRODUCT,
+	STR_SERIAL,
+};
+
+typedef struct
+{
+	uint8_t *data;	 // flash contents, NULL - erased, nothing written yet
+	uint8_t *erased; // per page, erased since the last reboot
+	uint32_t used;	 // end of the written part, reads stop there
+	bool dirty;		 // written since the last reboot, checked by DFU_GETSTATUS
+} sim_region_t;
+
+typedef struct
+{
+	char name[SIM_NAME_LEN]; // "" - the device itself
+	uint8_t mode;			 // FW_BOOT / FW_APP
+	sim_region_t region[SIM_REGIONS];
+	uint64_t back_ns; // sub: rebooting till then, the device itself stays on the bus
+} sim_unit_t;
+
+// libusb keeps these opaque, so the simulator has its own
+struct libusb_device
+{
+	uint32_t index;
+	uint8_t address;
+	uint32_t generation; // bumped on every reboot, older handles get LIBUSB_ERROR_NO_DEVICE
+	uint64_t back_ns;	 // gone till then
+	bool left;			 // hotplug: DEVICE_LEFT to report
+	bool away;			 // hotplug: DEVICE_ARRIVED to report at back_ns
+	uint64_t busy_ns;	 // requests are served one by one, the last one ends then
+	char serial[SIM_NAME_LEN + 8];
+	sim_unit_t unit[1 + SIM_SUBS_MAX];
+	uint32_t sel; // unit the requests go to, chosen by CLRSTATUS
+	bool written; // DNLOAD since the last reboot
+	bool fail_done;
+
+	uint32_t req_off; // last UPLOAD / GETCRC request
+	uint32_t req_len;
+	uint32_t req_count;
+	uint32_t req_idx;
+	bool stream;
+
+	uint8_t dfu_desc[9];
+	struct libusb_endpoint_descriptor ep;
+	struct libusb_interface_descriptor itf;
+	struct libusb_interface itfs;
+	struct libusb_config_descriptor conf;
+};
+
+struct libusb_device_handle
+{
+	libusb_device *dev;
+	uint32_t generation;
+};
+
+typedef struct sim_xfer
+{
+	struct libusb_transfer *xfer;
+	uint64_t due_ns;
+	int sts;
+	bool cancelled;
+	struct sim_xfer *next;
+} sim_xfer_t;
+
+static struct
+{
+	char name[SIM_NAME_LEN];
+	char product[SIM_NAME_LEN];
+	uint32_t count;
+	char subs[SIM_SUBS_MAX][SIM_NAME_LEN];
+	uint32_t sub_count;
+	uint8_t mode;
+	uint32_t flash;
+	uint32_t xfer;
+	uint32_t ep0;
+	uint32_t caps;
+	uint32_t legacy;
+	uint32_t bulk;
+	uint32_t latency_us;
+	uint32_t bw_kbs;
+	uint32_t page;
+	uint32_t page_us;
+	uint32_t erase_us;
+	uint32_t reboot_ms;
+	double loss; // %
+	uint32_t loss_ms;
+	uint32_t fail_at;
+	uint32_t seed;
+	uint32_t check;
+	uint32_t hotplug;
+	char *load[SIM_REGIONS];
+	char *save;
+} sc = {
+	.name = "sim",
+	.product = "sim",
+	.count = 1,
+	.mode = FW_APP,
+	.flash = 0x100000,
+	.xfer = 4096,
+	.ep0 = 64,
+	.caps = DFU_CAP_CRC_MAP | DFU_CAP_FILL | DFU_CAP_LZ | DFU_CAP_UP_STREAM,
+	.latency_us = 125,
+	.bw_kbs = 1000,
+	.page = 2048,
+	.reboot_ms = 50,
+	.loss_ms = 20,
+	.fail_at = UINT32_MAX,
+	.seed = 1,
+	.check = 1,
+};
+
+static char *spec_copy; // the strings of `sc` point here
+static struct libusb_device dev[SIM_DEVICES_MAX];
+static sim_xfer_t *pending;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t ev_lock = PTHREAD_MUTEX_INITIALIZER; // one thread runs the callbacks and reads `completed`, as in libusb; taken before `lock`
+static uint64_t rnd;
+static uint8_t lz_raw[DFU_LZ_FRAME];
+static sim_region_t *save_region; // written last
+static struct
+{
+	libusb_hotplug_callback_fn fn;
+	void *arg;
+	int events;
+} hp[SIM_HOTPLUG_MAX]; // fn NULL - free
+
+static uint64_t now_ns(void)
+{
+	TD_V now;
+	TD_GET(now);
+	return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	uint64_t now = now_ns();
+	if(ns <= now) return;
+#if defined(_WIN32) || defined(WIN32)
+	delay_ms((uint32_t)((ns - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC));
+#else
+	usleep2((uint32_t)((ns - now + NSEC_PER_USEC - 1) / NSEC_PER_USEC));
+#endif
+}
+
+static bool lost(void)
+{
+	if(sc.loss <= 0) return false;
+	rnd ^= rnd << 13; // xorshift64
+	rnd ^= rnd >> 7;
+	rnd ^= rnd << 17;
+	return (double)(rnd % 1000000) < sc.loss * 10000.0;
+}
+
+// latency plus the bytes on the bus
+static uint64_t wire_us(uint32_t bytes)
+{
+	return sc.latency_us + (sc.bw_kbs ? (uint64_t)bytes * USEC_PER_SEC / ((uint64_t)sc.bw_kbs * 1024) : 0);
+}
+
+static sim_region_t *region_get(sim_unit_t *u, uint32_t idx)
+{
+	sim_region_t *r = &u->region[idx];
+	if(r->data) return r;
+	r->data = malloc(sc.flash);
+	r->erased = calloc(sc.flash / sc.page + 1, 1);
+	if(!r->data || !r->erased)
+	{
+		free(r->data);
+		free(r->erased);
+		r->data = r->erased = NULL;
+		return NULL;
+	}
+	memset(r->data, 0xFF, sc.flash);
+	return r;
+}
+
+// DNLOAD [off:4][data], DFU_DN_FILL [off:4][len:4] or DFU_DN_LZ [off:4][raw_len:2][lz]
+static int dn_load(libusb_device *d, uint16_t value, const uint8_t *data, uint16_t length, uint64_t *cost_us)
+{
+	sim_unit_t *u = &d->unit[d->sel];
+	uint32_t idx = value & 0xFFU, kind = value & 0xFF00U, off;
+	if(length < DFU_DNLOAD_HDR || length > sc.xfer || idx >= SIM_REGIONS || idx == FW_PREBOOT) return LIBUSB_ERROR_PIPE;
+	if(idx == u->mode) return LIBUSB_ERROR_PIPE; // the running fw can't be replaced
+	memcpy(&off, data, 4);
+	if(off == sc.fail_at && !d->fail_done)
+	{
+		d->fail_done = true;
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	const uint8_t *src = &data[DFU_DNLOAD_HDR];
+	uint32_t len = length - DFU_DNLOAD_HDR;
+	bool fill = false;
+	if(kind == DFU_DN_FILL)
+	{
+		if(!(sc.caps & DFU_CAP_FILL) || len != 4) return LIBUSB_ERROR_PIPE;
+		memcpy(&len, src, 4);
+		fill = true;
+	}
+	else if(kind == DFU_DN_LZ)
+	{
+		uint16_t raw_len;
+		if(!(sc.caps & DFU_CAP_LZ) || len < 2) return LIBUSB_ERROR_PIPE;
+		memcpy(&raw_len, src, 2);
+		if(raw_len > DFU_LZ_FRAME || lz_decode(&src[2], len - 2, lz_raw, raw_len) != raw_len) return LIBUSB_ERROR_PIPE;
+		src = lz_raw;
+		len = raw_len;
+	}
+	else if(kind)
+		return LIBUSB_ERROR_PIPE;
+	if(off > sc.flash || len > sc.flash - off) return LIBUSB_ERROR_PIPE;
+
+	sim_region_t *r = region_get(u, idx);
+	if(!r) return LIBUSB_ERROR_NO_MEM;
+	for(uint32_t p = off / sc.page; len && p <= (off + len - 1) / sc.page; p++) // first write of a page erases it
+	{
+		if(r->erased[p]) continue;
+		r->erased[p] = 1;
+		memset(&r->data[p * sc.page], 0xFF, sc.flash - p * sc.page > sc.page ? sc.page : sc.flash - p * sc.page);
+		*cost_us += sc.erase_us;
+	}
+	if(fill)
+	{
+		memset(&r->data[off], 0xFF, len);
+	}
+	else
+	{
+		memcpy(&r->data[off], src, len);
+		*cost_us += (uint64_t)len * sc.page_us / sc.page;
+	}
+	if(off + len > r->used) r->used = off + len;
+	r->dirty = true;
+	d->written = true;
+	save_region = r;
+	return length;
+}
+
+// IN data of the running UPLOAD request
+static int up_load(libusb_device *d, uint32_t idx, uint8_t *data, uint32_t length)
+{
+	const sim_region_t *r = &d->unit[d->sel].region[idx];
+	uint32_t avail = r->data && r->used > d->req_off ? r->used - d->req_off : 0, n = length;
+	if(n > d->req_len) n = d->req_len;
+	if(n > avail) n = avail;
+	if(n) memcpy(data, &r->data[d->req_off], n);
+	d->req_off += n;
+	d->req_len -= n;
+	return (int)n;
+}
+
+static int get_crc(libusb_device *d, uint32_t idx, uint8_t *data, uint16_t length)
+{
+	if(length < d->req_count * 4 || (uint64_t)d->req_off + (uint64_t)d->req_len * d->req_count > sc.flash) return LIBUSB_ERROR_PIPE;
+	sim_region_t *r = region_get(&d->unit[d->sel], idx);
+	if(!r) return LIBUSB_ERROR_NO_MEM;
+	for(uint32_t i = 0; i < d->req_count; i++)
+	{
+		uint32_t crc = crc32(&r->data[d->req_off + i * d->req_len], d->req_len);
+		memcpy(&data[i * 4], &crc, 4);
+	}
+	return (int)(d->req_count * 4);
+}
+
+// DFU_GETSTATUS: per fw region (preboot, boot, app) the header check of what was written since the reboot, 0 - OK
+static int get_status(libusb_device *d, uint8_t *data, uint16_t length)
+{
+	uint8_t sts[FW_APP + 1] = {0};
+	for(uint32_t i = 0; sc.check && i <= FW_APP; i++)
+	{
+		const sim_region_t *r = &d->unit[d->sel].region[i];
+		parse_fw_result_t res;
+		if(r->dirty) sts[i] = (uint8_t)parse_fw(r->data, r->used, &res, NULL, NULL);
+	}
+	memset(data, 0, length);
+	memcpy(data, sts, length < sizeof(sts) ? length : sizeof(sts));
+	return length < sizeof(sts) ? length : (int)sizeof(sts);
+}
+
+// `sub` - only the selected remote unit reboots, no re-enumeration
+static void reboot(libusb_device *d, bool sub)
+{
+	for(uint32_t u = sub ? d->sel : 0; u <= (sub ? d->sel : sc.sub_count); u++) // a new session: the pages are erased again on the first write
+	{
+		for(uint32_t i = 0; i < SIM_REGIONS; i++)
+		{
+			sim_region_t *r = &d->unit[u].region[i];
+			r->dirty = false;
+			if(r->erased) memset(r->erased, 0, sc.flash / sc.page + 1);
+		}
+	}
+	sim_unit_t *u = &d->unit[d->sel];
+	u->mode = d->written || u->mode == FW_BOOT ? FW_APP : FW_BOOT; // a new fw starts as app
+	d->written = false;
+	d->sel = 0;
+	d->stream = false;
+	uint64_t now = now_ns();
+	if(sub)
+	{
+		u->back_ns = (d->busy_ns > now ? d->busy_ns : now) + (uint64_t)sc.reboot_ms * NSEC_PER_MSEC;
+		return;
+	}
+	d->generation++;
+	d->address = (uint8_t)(d->address % 126 + 1);
+	d->left = d->away = sc.hotplug != 0;
+	d->back_ns = (d->busy_ns > now ? d->busy_ns : now) + (uint64_t)sc.reboot_ms * NSEC_PER_MSEC;
+}
+
+/**
+ * \brief One DFU class request with this project's semantics
+ * \return bytes of the data stage or libusb error, `*cost_us` - time it takes
+ */
+static int request(libusb_device *d, uint8_t request_type, uint8_t req, uint16_t value, uint8_t *data, uint16_t length, uint64_t *cost_us)
+{
+	bool in = (request_type & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN;
+	uint32_t idx = value & 0xFFU;
+	int sts = LIBUSB_ERROR_PIPE;
+	*cost_us = 0;
+	if(lost())
+	{
+		*cost_us = (uint64_t)sc.loss_ms * 1000;
+		return LIBUSB_ERROR_TIMEOUT;
+	}
+	if((request_type & 0x60) != LIBUSB_REQUEST_TYPE_CLASS) return LIBUSB_ERROR_PIPE;
+
+	switch(req)
+	{
+	case DFU_DETACH:
+		if(in) break;
+		reboot(d, value && d->sel);
+		sts = 0;
+		break;
+
+	case DFU_DNLOAD:
+		if(!in) sts = dn_load(d, value, data, length, cost_us);
+		break;
+
+	case DFU_UPLOAD:
+		if(idx >= SIM_REGIONS) break;
+		if(in)
+		{
+			if(d->stream && !(value & DFU_UP_STREAM)) break;
+			sts = up_load(d, idx, data, length);
+		}
+		else if(length == 8 && (!(value & DFU_UP_STREAM) || (sc.caps & DFU_CAP_UP_STREAM)))
+		{
+			memcpy(&d->req_off, &data[0], 4);
+			memcpy(&d->req_len, &data[4], 4);
+			d->req_idx = idx;
+			d->stream = (value & DFU_UP_STREAM) != 0;
+			sts = 8;
+		}
+		break;
+
+	case DFU_GETSTATUS:
+		if(in) sts = get_status(d, data, length);
+		break;
+
+	case DFU_CLRSTATUS:
+		if(in) break;
+		if(length == 0)
+		{
+			d->sel = 0;
+			sts = 0;
+		}
+		for(uint32_t i = 0; length && i < sc.sub_count; i++)
+		{
+			if(strlen(sc.subs[i]) != length || memcmp(sc.subs[i], data, length) != 0 || now_ns() < d->unit[i + 1].back_ns) continue;
+			d->sel = i + 1;
+			sts = length;
+		}
+		break;
+
+	case DFU_GETSTATE:
+		if(!in || length < 1) break;
+		data[0] = d->unit[d->sel].mode;
+		sts = 1;
+		break;
+
+	case DFU_GETCAPS:
+		if(!in || sc.legacy) break;
+		{
+			uint8_t caps[12] = {0};
+			uint16_t ts = (uint16_t)sc.xfer;
+			memcpy(&caps[0], &ts, 2);
+			memcpy(&caps[4], &sc.caps, 4);
+			memcpy(&caps[8], &sc.page, 4);
+			sts = length < sizeof(caps) ? length : (int)sizeof(caps);
+			memcpy(data, caps, (size_t)sts);
+		}
+		break;
+
+	case DFU_GETCRC:
+		if(!(sc.caps & DFU_CAP_CRC_MAP) || idx >= SIM_REGIONS) break;
+		if(in)
+		{
+			sts = get_crc(d, idx, data, length);
+		}
+		else if(length == 12)
+		{
+			memcpy(&d->req_off, &data[0], 4);
+			memcpy(&d->req_len, &data[4], 4);
+			memcpy(&d->req_count, &data[8], 4);
+			sts = 12;
+		}
+		break;
+
+	default: break;
+	}
+	*cost_us += wire_us(LIBUSB_CONTROL_SETUP_SIZE + (sts > 0 ? (uint32_t)sts : 0));
+	return sts;
+}
+
+// device of a handle that is still valid, call locked
+static libusb_device *live(libusb_device_handle *h)
+{
+	if(!h || h->generation != h->dev->generation || now_ns() < h->dev->back_ns) return NULL;
+	return h->dev;
+}
+
+// queue `cost_us` of work on the device, a request over `timeout` fails with it; returns when it ends
+static uint64_t busy(libusb_device *d, uint64_t cost_us, unsigned int timeout, int *sts)
+{
+	uint64_t now = now_ns(), start = d->busy_ns > now ? d->busy_ns : now;
+	if(timeout && cost_us > (uint64_t)timeout * 1000)
+	{
+		cost_us = (uint64_t)timeout * 1000;
+		*sts = LIBUSB_ERROR_TIMEOUT;
+	}
+	d->busy_ns = start + cost_us * NSEC_PER_USEC;
+	return d->busy_ns;
+}
+
+static int sim_init(void) { return 0; }
+
+static void sim_exit(void)
+{
+	if(sc.save && save_region)
+	{
+		FILE *sf = fopen(sc.save, "wb");
+		if(!sf || fwrite(save_region->data, 1, save_region->used, sf) != save_region->used) fprintf(stderr, "error:    sim: write file %s\n", sc.save);
+		if(sf) fclose(sf);
+	}
+	for(uint32_t i = 0; i < sc.count; i++)
+	{
+		for(uint32_t u = 0; u <= sc.sub_count; u++)
+		{
+			for(uint32_t r = 0; r < SIM_REGIONS; r++)
+			{
+				free(dev[i].unit[u].region[r].data);
+				free(dev[i].unit[u].region[r].erased);
+				dev[i].unit[u].region[r].data = dev[i].unit[u].region[r].erased = NULL;
+			}
+		}
+	}
+	save_region = NULL;
+	free(spec_copy);
+	spec_copy = NULL;
+}
+
+static int sim_has_capability(uint32_t capability) { return capability == LIBUSB_CAP_HAS_HOTPLUG && sc.hotplug; }
+
+static ssize_t sim_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+	(void)ctx;
+	*list = calloc(sc.count + 1, sizeof(libusb_device *));
+	if(!*list) return LIBUSB_ERROR_NO_MEM;
+	ssize_t n = 0;
+	pthread_mutex_lock(&lock);
+	uint64_t now = now_ns();
+	for(uint32_t i = 0; i < sc.count; i++)
+	{
+		if(now >= dev[i].back_ns) (*list)[n++] = &dev[i];
+	}
+	pthread_mutex_unlock(&lock);
+	return n;
+}
+
+static void sim_free_device_list(libusb_device **list, int unref_devices)
+{
+	(void)unref_devices;
+	free(list);
+}
+
+static int sim_get_device_descriptor(libusb_device *d, struct libusb_device_descriptor *desc)
+{
+	memset(desc, 0, sizeof(*desc));
+	desc->bLength = 18;
+	desc->bDescriptorType = LIBUSB_DT_DEVICE;
+	desc->bcdUSB = 0x0200;
+	desc->bMaxPacketSize0 = (uint8_t)sc.ep0;
+	desc->idVendor = SIM_VID;
+	desc->idProduct = SIM_PID;
+	pthread_mutex_lock(&lock);
+	desc->bcdDevice = (uint16_t)(0x0100 + d->unit[0].mode);
+	pthread_mutex_unlock(&lock);
+	desc->iManufacturer = STR_MANUFACTURER;
+	desc->iProduct = STR_PRODUCT;
+	desc->iSerialNumber = STR_SERIAL;
+	desc->bNumConfigurations = 1;
+	return 0;
+}
+
+static int sim_get_active_config_descriptor(libusb_device *d, struct libusb_config_descriptor **config)
+{
+	*config = &d->conf;
+	return 0;
+}
+
+static void sim_free_config_descriptor(struct libusb_config_descriptor *config) { (void)config; } // owned by the device
+static uint8_t sim_get_bus_number(libusb_device *d) { return d ? 1 : 0; }
+static uint8_t sim_get_device_address(libusb_device *d)
+{
+	if(!d) return 0;
+	pthread_mutex_lock(&lock);
+	uint8_t address = d->address;
+	pthread_mutex_unlock(&lock);
+	return address;
+}
+
+static int sim_get_port_numbers(libusb_device *d, uint8_t *port_numbers, int port_numbers_len)
+{
+	if(port_numbers_len < 1) return LIBUSB_ERROR_OVERFLOW;
+	port_numbers[0] = (uint8_t)(d->index + 1);
+	return 1;
+}
+
+static int sim_open(libusb_device *d, libusb_device_handle **handle)
+{
+	libusb_device_handle *h = malloc(sizeof(*h));
+	if(!h) return LIBUSB_ERROR_NO_MEM;
+	pthread_mutex_lock(&lock);
+	h->dev = d;
+	h->generation = d->generation;
+	bool gone = now_ns() < d->back_ns;
+	pthread_mutex_unlock(&lock);
+	if(gone)
+	{
+		free(h);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	*handle = h;
+	return 0;
+}
+
+static void sim_close(libusb_device_handle *handle) { free(handle); }
+static libusb_device *sim_get_device(libusb_device_handle *handle) { return handle->dev; }
+
+static int sim_claim_interface(libusb_device_handle *handle, int interface_number)
+{
+	(void)handle;
+	return interface_number == 0 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int sim_release_interface(libusb_device_handle *handle, int interface_number) { return sim_claim_interface(handle, interface_number); }
+
+static int sim_get_string_descriptor_ascii(libusb_device_handle *handle, uint8_t desc_index, unsigned char *data, int length)
+{
+	pthread_mutex_lock(&lock);
+	libusb_device *d = live(handle);
+	if(!d)
+	{
+		pthread_mutex_unlock(&lock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	const char *s = desc_index == STR_SERIAL ? d->serial : (desc_index == STR_PRODUCT ? sc.product : (desc_index == STR_MANUFACTURER ? "usb_dfu_flasher sim" : NULL));
+	int sts = s ? snprintf((char *)data, (size_t)length, "%s", s) : LIBUSB_ERROR_PIPE;
+	if(sts >= length) sts = length - 1;
+	uint64_t due = busy(d, 2 * wire_us(LIBUSB_CONTROL_SETUP_SIZE + 4) + wire_us(LIBUSB_CONTROL_SETUP_SIZE + 2 + 2 * (sts > 0 ? (uint32_t)sts : 0)), 0, &sts);
+	pthread_mutex_unlock(&lock);
+	sleep_until(due);
+	return sts;
+}
+
+static int sim_control_transfer(libusb_device_handle *handle, uint8_t request_type, uint8_t req, uint16_t value, uint16_t index,
+								unsigned char *data, uint16_t length, unsigned int timeout)
+{
+	(void)index;
+	pthread_mutex_lock(&lock);
+	libusb_device *d = live(handle);
+	if(!d)
+	{
+		pthread_mutex_unlock(&lock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	uint64_t cost;
+	int sts = request(d, request_type, req, value, data, length, &cost);
+	uint64_t due = busy(d, cost, timeout, &sts);
+	pthread_mutex_unlock(&lock);
+	sleep_until(due);
+	return sts;
+}
+
+// IN packets of a DFU_UP_STREAM request
+static int sim_bulk_transfer(libusb_device_handle *handle, unsigned char endpoint, unsigned char *data, int length, int *actual, unsigned int timeout)
+{
+	*actual = 0;
+	pthread_mutex_lock(&lock);
+	libusb_device *d = live(handle);
+	if(!d)
+	{
+		pthread_mutex_unlock(&lock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	int sts = LIBUSB_ERROR_PIPE;
+	uint64_t cost = sc.latency_us;
+	if(lost())
+	{
+		cost = (uint64_t)sc.loss_ms * 1000;
+		sts = LIBUSB_ERROR_TIMEOUT;
+	}
+	else if(endpoint == SIM_BULK_EP && sc.bulk && d->stream && length > 0)
+	{
+		sts = up_load(d, d->req_idx, data, (uint32_t)length);
+		cost = wire_us((uint32_t)sts);
+	}
+	uint64_t due = busy(d, cost, timeout, &sts);
+	pthread_mutex_unlock(&lock);
+	sleep_until(due);
+	if(sts < 0) return sts;
+	*actual = sts;
+	return 0;
+}
+
+static struct libusb_transfer *sim_alloc_transfer(int iso_packets)
+{
+	return calloc(1, sizeof(struct libusb_transfer) + (size_t)iso_packets * sizeof(struct libusb_iso_packet_descriptor));
+}
+
+static void sim_free_transfer(struct libusb_transfer *transfer) { free(transfer); }
+
+// the request is served at once, its completion is reported when the time it takes has passed
+static int sim_submit_transfer(struct libusb_transfer *transfer)
+{
+	sim_xfer_t *x = calloc(1, sizeof(*x));
+	if(!x) return LIBUSB_ERROR_NO_MEM;
+	const uint8_t *setup = transfer->buffer;
+	uint16_t value = (uint16_t)(setup[2] | setup[3] << 8), length = (uint16_t)(setup[6] | setup[7] << 8);
+
+	pthread_mutex_lock(&lock);
+	libusb_device *d = live(transfer->dev_handle);
+	if(!d)
+	{
+		pthread_mutex_unlock(&lock);
+		free(x);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	uint64_t cost;
+	x->xfer = transfer;
+	x->sts = request(d, setup[0], setup[1], value, &transfer->buffer[LIBUSB_CONTROL_SETUP_SIZE], length, &cost);
+	x->due_ns = busy(d, cost, transfer->timeout, &x->sts);
+	x->next = pending;
+	pending = x;
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+static int sim_cancel_transfer(struct libusb_transfer *transfer)
+{
+	int sts = LIBUSB_ERROR_NOT_FOUND;
+	pthread_mutex_lock(&lock);
+	for(sim_xfer_t *x = pending; x; x = x->next)
+	{
+		if(x->xfer != transfer || x->cancelled) continue;
+		x->cancelled = true;
+		x->due_ns = now_ns();
+		sts = 0;
+	}
+	pthread_mutex_unlock(&lock);
+	return sts;
+}
+
+static enum libusb_transfer_status err2xfer_sts(int err)
+{
+	switch(err)
+	{
+	case LIBUSB_ERROR_TIMEOUT: return LIBUSB_TRANSFER_TIMED_OUT;
+	case LIBUSB_ERROR_PIPE: return LIBUSB_TRANSFER_STALL;
+	case LIBUSB_ERROR_NO_DEVICE: return LIBUSB_TRANSFER_NO_DEVICE;
+	default: return LIBUSB_TRANSFER_ERROR;
+	}
+}
+
+// hotplug events that are due (call locked), `next_ns` is lowered to the next one ahead
+static uint32_t hotplug_due(uint64_t now, uint64_t *next_ns, libusb_device **ev_dev, libusb_hotplug_event *ev)
+{
+	uint32_t n = 0;
+	for(uint32_t i = 0; sc.hotplug && i < sc.count; i++)
+	{
+		libusb_device *d = &dev[i];
+		if(d->left)
+		{
+			d->left = false;
+			ev_dev[n] = d;
+			ev[n++] = LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT;
+		}
+		if(d->away && d->back_ns <= now)
+		{
+			d->away = false;
+			ev_dev[n] = d;
+			ev[n++] = LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
+		}
+		else if(d->away && d->back_ns < *next_ns)
+			*next_ns = d->back_ns;
+	}
+	return n;
+}
+
+// complete transfers and report hotplug events that are due, waiting for the first one till `deadline_ns`
+static int events(uint64_t deadline_ns, int *completed)
+{
+	for(;;)
+	{
+		pthread_mutex_lock(&ev_lock);
+		pthread_mutex_lock(&lock);
+		uint64_t next = UINT64_MAX, now = now_ns();
+		for(sim_xfer_t *x = pending; x; x = x->next)
+		{
+			if(x->due_ns < next) next = x->due_ns;
+		}
+		libusb_device *ev_dev[2 * SIM_DEVICES_MAX];
+		libusb_hotplug_event ev[2 * SIM_DEVICES_MAX];
+		uint32_t ev_cnt = hotplug_due(now, &next, ev_dev, ev);
+		if(ev_cnt) next = now;
+		if((completed && *completed && !ev_cnt) || (next > now && now >= deadline_ns) || (next == UINT64_MAX && deadline_ns == UINT64_MAX))
+		{
+			pthread_mutex_unlock(&lock);
+			pthread_mutex_unlock(&ev_lock);
+			return 0;
+		}
+		if(next > now)
+		{
+			pthread_mutex_unlock(&lock);
+			pthread_mutex_unlock(&ev_lock);
+			if(next > deadline_ns) next = deadline_ns;
+			sleep_until(next - now > SIM_EVENTS_MAX_WAIT_NS ? now + SIM_EVENTS_MAX_WAIT_NS : next);
+			continue;
+		}
+
+		sim_xfer_t *due = NULL;
+		for(sim_xfer_t **p = &pending; *p;)
+		{
+			sim_xfer_t *x = *p;
+			if(x->due_ns > now)
+			{
+				p = &x->next;
+				continue;
+			}
+			*p = x->next;
+			x->next = due;
+			due = x;
+		}
+		pthread_mutex_unlock(&lock);
+
+		while(due) // callbacks run unlocked, they may submit again
+		{
+			sim_xfer_t *x = due;
+			due = x->next;
+			struct libusb_transfer *t = x->xfer;
+			t->status = x->cancelled ? LIBUSB_TRANSFER_CANCELLED : (x->sts < 0 ? err2xfer_sts(x->sts) : LIBUSB_TRANSFER_COMPLETED);
+			t->actual_length = x->sts > 0 && !x->cancelled ? x->sts : 0;
+			free(x);
+			t->callback(t);
+		}
+		for(uint32_t e = 0; e < ev_cnt; e++)
+		{
+			for(int h = 0; h < SIM_HOTPLUG_MAX; h++)
+			{
+				pthread_mutex_lock(&lock);
+				libusb_hotplug_callback_fn fn = hp[h].events & (int)ev[e] ? hp[h].fn : NULL;
+				void *arg = hp[h].arg;
+				pthread_mutex_unlock(&lock);
+				if(fn && fn(NULL, ev_dev[e], ev[e], arg)) // nonzero - done with it, as in libusb
+				{
+					pthread_mutex_lock(&lock);
+					if(hp[h].fn == fn && hp[h].arg == arg) hp[h].fn = NULL;
+					pthread_mutex_unlock(&lock);
+				}
+			}
+		}
+		pthread_mutex_unlock(&ev_lock);
+		return 0;
+	}
+}
+
+static int sim_handle_events_completed(libusb_context *ctx, int *completed)
+{
+	(void)ctx;
+	return events(UINT64_MAX, completed);
+}
+
+static int sim_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed)
+{
+	(void)ctx;
+	return events(now_ns() + (uint64_t)tv->tv_sec * NSEC_PER_SEC + (uint64_t)tv->tv_usec * NSEC_PER_USEC, completed);
+}
+
+// events of the sim devices only, no LIBUSB_HOTPLUG_ENUMERATE
+static int sim_hotplug_register_callback(libusb_context *ctx, int events_mask, int flags, int vendor_id, int product_id, int dev_class,
+										 libusb_hotplug_callback_fn cb_fn, void *user_data, libusb_hotplug_callback_handle *handle)
+{
+	(void)ctx;
+	(void)flags;
+	(void)dev_class;
+	if(!sc.hotplug) return LIBUSB_ERROR_NOT_SUPPORTED;
+	bool match = (vendor_id == LIBUSB_HOTPLUG_MATCH_ANY || vendor_id == SIM_VID) && (product_id == LIBUSB_HOTPLUG_MATCH_ANY || product_id == SIM_PID);
+	int sts = LIBUSB_ERROR_NO_MEM;
+	pthread_mutex_lock(&lock);
+	for(int h = 0; h < SIM_HOTPLUG_MAX; h++)
+	{
+		if(hp[h].fn) continue;
+		hp[h].fn = cb_fn;
+		hp[h].arg = user_data;
+		hp[h].events = match ? events_mask : 0;
+		if(handle) *handle = h;
+		sts = LIBUSB_SUCCESS;
+		break;
+	}
+	pthread_mutex_unlock(&lock);
+	return sts;
+}
+
+static void sim_hotplug_deregister_callback(libusb_context *ctx, libusb_hotplug_callback_handle handle)
+{
+	(void)ctx;
+	if(handle < 0 || handle >= SIM_HOTPLUG_MAX) return;
+	pthread_mutex_lock(&lock);
+	hp[handle].fn = NULL;
+	pthread_mutex_unlock(&lock);
+}
+
+const usb_io_t usb_io_sim = {
+	.name = "sim",
+	.init = sim_init,
+	.exit = sim_exit,
+	.has_capability = sim_has_capability,
+	.get_device_list = sim_get_device_list,
+	.free_device_list = sim_free_device_list,
+	.get_device_descriptor = sim_get_device_descriptor,
+	.get_active_config_descriptor = sim_get_active_config_descriptor,
+	.free_config_descriptor = sim_free_config_descriptor,
+	.get_bus_number = sim_get_bus_number,
+	.get_device_address = sim_get_device_address,
+	.get_port_numbers = sim_get_port_numbers,
+	.open = sim_open,
+	.close = sim_close,
+	.get_device = sim_get_device,
+	.claim_interface = sim_claim_interface,
+	.release_interface = sim_release_interface,
+	.get_string_descriptor_ascii = sim_get_string_descriptor_ascii,
+	.control_transfer = sim_control_transfer,
+	.bulk_transfer = sim_bulk_transfer,
+	.alloc_transfer = sim_alloc_transfer,
+	.free_transfer = sim_free_transfer,
+	.submit_transfer = sim_submit_transfer,
+	.cancel_transfer = sim_cancel_transfer,
+	.handle_events_completed = sim_handle_events_completed,
+	.handle_events_timeout_completed = sim_handle_events_timeout_completed,
+	.hotplug_register_callback = sim_hotplug_register_callback,
+	.hotplug_deregister_callback = sim_hotplug_deregister_callback,
+};
+
+// number with an optional k/M suffix
+static bool parse_num(const char *v, uint32_t *out)
+{
+	char *end;
+	unsigned long long n = strtoull(v, &end, 0);
+	if(end == v) return false;
+	if(*end == 'k' || *end == 'K')
+	{
+		n *= 1024;
+		end++;
+	}
+	else if(*end == 'M')
+	{
+		n *= 1024 * 1024;
+		end++;
+	}
+	if(*end || n > UINT32_MAX) return false;
+	*out = (uint32_t)n;
+	return true;
+}
+
+static bool parse_caps(char *v, uint32_t *caps)
+{
+	*caps = 0;
+	if(strcmp(v, "none") == 0) return true;
+	for(char *c = v; c && *c;)
+	{
+		char *next = strchr(c, '+');
+		if(next) *next++ = '\0';
+		if(strcmp(c, "crc") == 0) *caps |= DFU_CAP_CRC_MAP;
+		else if(strcmp(c, "fill") == 0) *caps |= DFU_CAP_FILL;
+		else if(strcmp(c, "lz") == 0) *caps |= DFU_CAP_LZ;
+		else if(strcmp(c, "stream") == 0) *caps |= DFU_CAP_UP_STREAM;
+		else return false;
+		c = next;
+	}
+	return true;
+}
+
+static bool parse_subs(char *v)
+{
+	sc.sub_count = 0;
+	for(char *s = v; s && *s;)
+	{
+		char *next = strchr(s, ':');
+		if(next) *next++ = '\0';
+		if(sc.sub_count == SIM_SUBS_MAX || strlen(s) >= SIM_NAME_LEN) return false;
+		strcpy(sc.subs[sc.sub_count++], s);
+		s = next;
+	}
+	return true;
+}
+
+static bool parse_kv(char *key, char *v)
+{
+	static const struct
+	{
+		const char *key;
+		uint32_t *value;
+	} num[] = {
+		{"count", &sc.count},
+		{"flash", &sc.flash},
+		{"xfer", &sc.xfer},
+		{"ep0", &sc.ep0},
+		{"legacy", &sc.legacy},
+		{"bulk", &sc.bulk},
+		{"latency", &sc.latency_us},
+		{"bw", &sc.bw_kbs},
+		{"page", &sc.page},
+		{"page_us", &sc.page_us},
+		{"erase_us", &sc.erase_us},
+		{"reboot", &sc.reboot_ms},
+		{"loss_ms", &sc.loss_ms},
+		{"fail_at", &sc.fail_at},
+		{"seed", &sc.seed},
+		{"check", &sc.check},
+		{"hotplug", &sc.hotplug},
+	};
+	for(uint32_t i = 0; i < sizeof(num) / sizeof(num[0]); i++)
+	{
+		if(strcmp(key, num[i].key) == 0) return parse_num(v, num[i].value);
+	}
+	if(strcmp(key, "name") == 0 || strcmp(key, "product") == 0)
+	{
+		if(strlen(v) >= SIM_NAME_LEN) return false;
+		strcpy(strcmp(key, "name") == 0 ? sc.name : sc.product, v);
+		return true;
+	}
+	if(strcmp(key, "subs") == 0) return parse_subs(v);
+	if(strcmp(key, "caps") == 0) return parse_caps(v, &sc.caps);
+	if(strcmp(key, "mode") == 0 && (strcmp(v, "app") == 0 || strcmp(v, "boot") == 0))
+	{
+		sc.mode = strcmp(v, "app") == 0 ? FW_APP : FW_BOOT;
+		return true;
+	}
+	if(strcmp(key, "loss") == 0)
+	{
+		char *end;
+		sc.loss = strtod(v, &end);
+		return *end == '\0' && sc.loss >= 0 && sc.loss <= 100;
+	}
+	char **file = strcmp(key, "boot") == 0 ? &sc.load[FW_BOOT] : strcmp(key, "app") == 0 ? &sc.load[FW_APP] : strcmp(key, "cfg") == 0 ? &sc.load[FW_APP + 1] : strcmp(key, "save") == 0 ? &sc.save : NULL;
+	if(file) *file = v;
+	return file != NULL;
+}
+
+static void build_device(libusb_device *d, uint32_t index)
+{
+	memset(d, 0, sizeof(*d));
+	d->index = index;
+	d->address = (uint8_t)(index + 2);
+	snprintf(d->serial, sizeof(d->serial), "%s%u", sc.name, index);
+	for(uint32_t u = 0; u <= sc.sub_count; u++)
+	{
+		strcpy(d->unit[u].name, u ? sc.subs[u - 1] : "");
+		d->unit[u].mode = sc.mode;
+	}
+
+	// DFU functional descriptor: bmAttributes, wDetachTimeOut, wTransferSize, bcdDFUVersion
+	uint8_t desc[9] = {9, DFU_FUNC_DESC_TYPE, 0x0B, 0xFF, 0x00, (uint8_t)sc.xfer, (uint8_t)(sc.xfer >> 8), 0x1A, 0x01};
+	memcpy(d->dfu_desc, desc, sizeof(desc));
+	d->ep.bLength = 7;
+	d->ep.bDescriptorType = LIBUSB_DT_ENDPOINT;
+	d->ep.bEndpointAddress = SIM_BULK_EP;
+	d->ep.bmAttributes = LIBUSB_TRANSFER_TYPE_BULK;
+	d->ep.wMaxPacketSize = 512;
+	d->itf.bLength = 9;
+	d->itf.bDescriptorType = LIBUSB_DT_INTERFACE;
+	d->itf.bNumEndpoints = sc.bulk ? 1 : 0;
+	d->itf.bInterfaceClass = 0xFE; // application specific: DFU
+	d->itf.bInterfaceSubClass = 0x01;
+	d->itf.bInterfaceProtocol = 0x02;
+	d->itf.endpoint = sc.bulk ? &d->ep : NULL;
+	d->itf.extra = d->dfu_desc;
+	d->itf.extra_length = sizeof(d->dfu_desc);
+	d->itfs.altsetting = &d->itf;
+	d->itfs.num_altsetting = 1;
+	d->conf.bLength = 9;
+	d->conf.bDescriptorType = LIBUSB_DT_CONFIG;
+	d->conf.bNumInterfaces = 1;
+	d->conf.bConfigurationValue = 1;
+	d->conf.interface = &d->itfs;
+}
+
+/** \brief Parse the spec and power the devices up, see sim.h */
+int sim_setup(const char *spec)
+{
+	free(spec_copy);
+	spec_copy = strdup(spec);
+	if(!spec_copy) return -1;
+	for(char *kv = strtok(spec_copy, ","); kv; kv = strtok(NULL, ","))
+	{
+		char *v = strchr(kv, '=');
+		if(v) *v++ = '\0';
+		if(!v || !parse_kv(kv, v))
+		{
+			fprintf(stderr, "error:    sim: wrong \"%s%s%s\"\n", kv, v ? "=" : "", v ? v : "");
+			return -1;
+		}
+	}
+	if(!sc.count || sc.count > SIM_DEVICES_MAX || !sc.page || sc.xfer <= DFU_DNLOAD_HDR || sc.xfer > UINT16_MAX || !sc.ep0 || sc.ep0 > 255)
+	{
+		fprintf(stderr, "error:    sim: count 1..%d, page > 0, xfer %d..%d and ep0 1..255 expected\n", SIM_DEVICES_MAX, DFU_DNLOAD_HDR + 1, UINT16_MAX);
+		return -1;
+	}
+	rnd = sc.seed ? sc.seed : 1;
+
+	for(uint32_t i = 0; i < sc.count; i++)
+	{
+		build_device(&dev[i], i);
+		for(uint32_t r = 0; r < SIM_REGIONS; r++)
+		{
+			if(!sc.load[r]) continue;
+			image_t img;
+			if(image_load(&img, sc.load[r]))
+			{
+				fprintf(stderr, "error:    sim: can't read %s\n", sc.load[r]);
+				return -1;
+			}
+			sim_region_t *reg = region_get(&dev[i].unit[0], r);
+			uint32_t len = img.length > sc.flash ? sc.flash : (uint32_t)img.length;
+			if(reg)
+			{
+				memcpy(reg->data, img.data, len);
+				reg->used = len;
+			}
+			image_free(&img);
+			if(!reg) return -1;
+		}
+	}
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,45 @@
+#ifndef SIM_H__
+#define SIM_H__
+
+#include "usb_io.h"
+
+#define SIM_DEVICES_MAX 16
+#define SIM_SUBS_MAX 4
+#define SIM_NAME_LEN 32
+
+/**
+ * Simulated DFU device(s) behind the usb_io transport, in process and in
+ * real time. Set up by a "key=value,..." spec, numbers take k/M suffixes:
+ *   name=sim          serial prefix, devices are <name>0, <name>1...
+ *   product=sim       iProduct string (the image "product" field)
+ *   count=1           devices, one per port of bus 1
+ *   subs=a:b          remote flash devices reached by name, a sub reboot doesn't
+ *                     re-enumerate the device
+ *   mode=app          fw running at start: app / boot
+ *   flash=1M          bytes per fw region (boot, app, cfg)
+ *   xfer=4096         wTransferSize, DNLOAD packet limit with the offset
+ *   ep0=64            bMaxPacketSize0
+ *   caps=crc+fill+lz+stream  DFU_GETCAPS flags, none - no extensions
+ *   legacy=0          1 - DFU_GETCAPS stalls (old firmware)
+ *   bulk=0            1 - bulk IN endpoint for stream reads
+ *   latency=125       us per transfer
+ *   bw=1000           kB/s on the bus
+ *   page=2048         erase page, reported by DFU_GETCAPS
+ *   page_us=0         program time per page, charged per byte written
+ *   erase_us=0        erase time per page, charged when a page is first written
+ *   reboot=50         ms the device is gone after DFU_DETACH
+ *   loss=0            % of transfers that time out after loss_ms
+ *   loss_ms=20
+ *   fail_at=-1        offset whose first DNLOAD stalls
+ *   check=1           DFU_GETSTATUS checks the fw header of the regions written
+ *                     since the reboot, 0 - always OK
+ *   hotplug=0         1 - report DEVICE_LEFT / DEVICE_ARRIVED around reboots
+ *   seed=1
+ *   boot=FILE, app=FILE, cfg=FILE  region contents at start
+ *   save=FILE         region written last, saved at exit
+ */
+int sim_setup(const char *spec);
+
+extern const usb_io_t usb_io_sim;
+
+#endif // SIM_H__
\ No newline at end of file
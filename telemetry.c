@@ -0,0 +1,157 @@
+#include "telemetry.h"
+#include <libusb-1.0/libusb.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *phase_str[TELEM_PHASES] = {"enumeration", "reboot", "prepare", "transfer", "finish"};
+
+static uint32_t bucket_of(uint32_t us)
+{
+	if(us < TELEM_SUB) return us;
+	uint32_t e = 31U - (uint32_t)__builtin_clz(us); // >= 3
+	uint32_t b = (e - 2) * TELEM_SUB + ((us >> (e - 3)) & (TELEM_SUB - 1));
+	return b < TELEM_BUCKETS ? b : TELEM_BUCKETS - 1;
+}
+
+// smallest value of bucket `b`
+static uint64_t bucket_lo(uint32_t b)
+{
+	if(b < TELEM_SUB) return b;
+	uint32_t e = b / TELEM_SUB + 2;
+	return (uint64_t)(TELEM_SUB + b % TELEM_SUB) << (e - 3);
+}
+
+void telem_hist_add(telem_hist_t *h, uint32_t us)
+{
+	if(!h->count || us < h->min) h->min = us;
+	if(us > h->max) h->max = us;
+	h->count++;
+	h->sum += us;
+	h->bucket[bucket_of(us)]++;
+}
+
+/** \brief Upper bound of the bucket holding the `pct` percentile, clamped to what was seen */
+uint32_t telem_percentile(const telem_hist_t *h, uint32_t pct)
+{
+	if(!h->count) return 0;
+	uint64_t rank = (h->count * pct + 99) / 100, acc = 0;
+	if(rank == 0) rank = 1;
+	for(uint32_t b = 0; b < TELEM_BUCKETS; b++)
+	{
+		acc += h->bucket[b];
+		if(acc < rank) continue;
+		uint64_t hi = b + 1 < TELEM_BUCKETS ? bucket_lo(b + 1) - 1 : UINT32_MAX;
+		if(hi > h->max) hi = h->max;
+		if(hi < h->min) hi = h->min;
+		return (uint32_t)hi;
+	}
+	return h->max;
+}
+
+void telem_begin(telem_t *m, int phase)
+{
+	TD_V now;
+	TD_GET(now);
+	if(!m->started)
+	{
+		m->t0 = now;
+		m->started = true;
+	}
+	m->phase_t0[phase] = now;
+	m->phase_on[phase] = true;
+}
+
+void telem_end(telem_t *m, int phase)
+{
+	if(!m->phase_on[phase]) return;
+	TD_V now;
+	TD_GET(now);
+	m->phase_us[phase] += (uint64_t)(TD_CALC_us(now, m->phase_t0[phase]));
+	m->phase_on[phase] = false;
+}
+
+/** \brief Track which `chunk` sized pieces of a `length` image get sent, 0 - unknown length (stream) */
+void telem_data(telem_t *m, uint32_t length, uint32_t chunk)
+{
+	free(m->sent);
+	m->sent = NULL;
+	m->chunk = chunk;
+	m->chunks = chunk ? (length + chunk - 1) / chunk : 0;
+	if(m->chunks) m->sent = calloc(m->chunks, 1);
+}
+
+/**
+ * \brief Account an op that covered [pos, next) of the source with `len`
+ * bytes on the wire. A failed op is sent again from its `pos`, so retries are
+ * counted per offset and hold whatever the packet size is (--adaptive, --lz)
+ */
+void telem_op(telem_t *m, uint32_t pos, uint32_t next, uint32_t len, int sts, uint32_t latency_us)
+{
+	m->ops++;
+	bool again = m->fail_cnt && pos == m->fail_pos;
+	if(sts < 0)
+	{
+		m->errors++;
+		if(sts == LIBUSB_ERROR_TIMEOUT) m->timeouts++;
+		m->fail_cnt = again ? m->fail_cnt + 1 : 1;
+		m->fail_pos = pos;
+		return;
+	}
+	m->retries[again ? (m->fail_cnt > TELEM_RETRY_MAX ? TELEM_RETRY_MAX : m->fail_cnt) : 0]++;
+	m->fail_cnt = 0;
+	for(uint32_t i = m->chunk ? pos / m->chunk : 0; m->sent && i < m->chunks && i * m->chunk < next; i++)
+		m->sent[i] = 1;
+	m->bytes += len;
+	telem_hist_add(&m->lat, latency_us);
+}
+
+void telem_json_str(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for(; *str; str++)
+	{
+		if(*str == '"' || *str == '\\') fputc('\\', f);
+		if((unsigned char)*str < 0x20) fprintf(f, "\\u%04x", *str);
+		else fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+/** \brief Members of a JSON object, the caller adds the braces and its own members */
+void telem_json(FILE *f, const telem_t *m)
+{
+	TD_V now;
+	TD_GET(now);
+	fprintf(f, "\"elapsed_us\":%lld,\"phases_us\":{", m->started ? (long long)(TD_CALC_us(now, m->t0)) : 0LL);
+	for(int i = 0; i < TELEM_PHASES; i++)
+		fprintf(f, "%s\"%s\":%llu", i ? "," : "", phase_str[i], (unsigned long long)m->phase_us[i]);
+
+	const telem_hist_t *h = &m->lat;
+	fprintf(f, "},\"transfers\":{\"ops\":%llu,\"bytes\":%llu,\"errors\":%u,\"timeouts\":%u,\"resyncs\":%u,",
+			(unsigned long long)m->ops, (unsigned long long)m->bytes, m->errors, m->timeouts, m->resyncs);
+	fprintf(f, "\"latency_us\":{\"count\":%llu,\"min\":%u,\"mean\":%llu,\"p50\":%u,\"p95\":%u,\"p99\":%u,\"max\":%u,\"buckets\":[",
+			(unsigned long long)h->count, h->min, h->count ? (unsigned long long)(h->sum / h->count) : 0ULL,
+			telem_percentile(h, 50), telem_percentile(h, 95), telem_percentile(h, 99), h->max);
+	bool first = true;
+	for(uint32_t b = 0; b < TELEM_BUCKETS; b++) // [lower bound, count] of non-empty buckets
+	{
+		if(!h->bucket[b]) continue;
+		fprintf(f, "%s[%llu,%u]", first ? "" : ",", (unsigned long long)bucket_lo(b), h->bucket[b]);
+		first = false;
+	}
+
+	// packets retried 0, 1, ... TELEM_RETRY_MAX+ times, skipped chunks aside
+	uint32_t unsent = 0;
+	for(uint32_t i = 0; m->sent && i < m->chunks; i++)
+		unsent += !m->sent[i];
+	fprintf(f, "]}},\"chunks\":{\"size\":%u,\"count\":%u,\"unsent\":%u,\"retries\":[", m->chunk, m->chunks, unsent);
+	for(uint32_t r = 0; r <= TELEM_RETRY_MAX; r++)
+		fprintf(f, "%s%u", r ? "," : "", m->retries[r]);
+	fprintf(f, "]}");
+}
+
+void telem_free(telem_t *m)
+{
+	free(m->sent);
+	m->sent = NULL;
+}
\ No newline at end of file
@@ -0,0 +1,68 @@
+#ifndef TELEMETRY_H__
+#define TELEMETRY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "timedate.h" // needs stdint.h
+
+#define TELEM_SUB 8						 // buckets per power of two, ~12% wide
+#define TELEM_BUCKETS (30 * TELEM_SUB) // latencies up to 2^32 us
+#define TELEM_RETRY_MAX 3				 // packets retried this many times or more share a counter
+
+enum
+{
+	TELEM_ENUM = 0, // looking the device up
+	TELEM_REBOOT,	// waiting for it to come back after a reboot
+	TELEM_PREPARE,	// caps, probing, diff maps
+	TELEM_DATA,		// transfers
+	TELEM_FINISH,	// status check and the final reboot request
+	TELEM_PHASES,
+};
+
+// log-linear histogram of microseconds
+typedef struct
+{
+	uint64_t count;
+	uint64_t sum;
+	uint32_t min;
+	uint32_t max;
+	uint32_t bucket[TELEM_BUCKETS];
+} telem_hist_t;
+
+// transfer telemetry of one device, all times are CLOCK_MONOTONIC; zeroed is ready to use
+typedef struct
+{
+	TD_V t0; // first phase start
+	bool started;
+	uint64_t phase_us[TELEM_PHASES];
+	TD_V phase_t0[TELEM_PHASES];
+	bool phase_on[TELEM_PHASES];
+
+	telem_hist_t lat; // acknowledged transfers
+	uint64_t ops;
+	uint64_t bytes;
+	uint32_t errors;
+	uint32_t timeouts;
+	uint32_t resyncs;
+
+	uint32_t chunk;
+	uint32_t chunks;
+	uint8_t *sent;							// per chunk, acked bytes in it
+	uint32_t retries[TELEM_RETRY_MAX + 1]; // acked packets by the failed sends of their offset before
+	uint32_t fail_pos;
+	uint32_t fail_cnt;
+} telem_t;
+
+void telem_begin(telem_t *m, int phase);
+void telem_end(telem_t *m, int phase);
+void telem_data(telem_t *m, uint32_t length, uint32_t chunk);
+void telem_op(telem_t *m, uint32_t pos, uint32_t next, uint32_t len, int sts, uint32_t latency_us);
+void telem_hist_add(telem_hist_t *h, uint32_t us);
+uint32_t telem_percentile(const telem_hist_t *h, uint32_t pct);
+void telem_json(FILE *f, const telem_t *m);
+void telem_json_str(FILE *f, const char *str); // quoted and escaped
+void telem_free(telem_t *m);
+
+#endif // TELEMETRY_H__
\ No newline at end of file
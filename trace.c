@@ -0,0 +1,400 @@
+#include "trace.h"
+#include "dfu.h"
+#include "image.h"
+#include "libusb_helper.h"
+#include "telemetry.h"
+#include "usb_io.h"
+#include "timedate.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_TOP 10 // gaps / hotspots listed by the analyzer
+
+static FILE *trace_f = NULL;
+static TD_V trace_t0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int trace_start(const char *file_name)
+{
+	trace_f = fopen(file_name, "wb");
+	if(!trace_f) return -1;
+	trace_header_t h = {.entry_size = sizeof(trace_entry_t)};
+	memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+	TD_GET(trace_t0);
+	if(fwrite(&h, sizeof(h), 1, trace_f) != 1)
+	{
+		fclose(trace_f);
+		trace_f = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void trace_stop(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	if(trace_f) fclose(trace_f);
+	trace_f = NULL;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+bool trace_enabled(void) { return trace_f != NULL; }
+
+uint64_t trace_now(void)
+{
+	TD_V now;
+	TD_GET(now);
+	return (uint64_t)(TD_CALC_ns(now, trace_t0));
+}
+
+static uint16_t dev_id(libusb_device *dev)
+{
+	return dev ? (uint16_t)(usb_io->get_bus_number(dev) << 8 | usb_io->get_device_address(dev)) : 0;
+}
+
+// `e->dev` is taken from `handle` when there is one
+void trace_record(trace_entry_t *e, libusb_device_handle *handle)
+{
+	if(handle) e->dev = dev_id(usb_io->get_device(handle));
+	pthread_mutex_lock(&trace_lock);
+	if(trace_f) fwrite(e, sizeof(*e), 1, trace_f);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+// OUT requests of the DFU extensions start with the offset they refer to
+static uint32_t request_offset(uint8_t request_type, uint8_t request, const uint8_t *data, uint16_t length)
+{
+	uint32_t off = UINT32_MAX;
+	if((request_type & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT && (request_type & 0x60) == LIBUSB_REQUEST_TYPE_CLASS && data && length >= 4 &&
+	   (request == DFU_DNLOAD || request == DFU_UPLOAD || request == DFU_GETCRC))
+		memcpy(&off, data, 4);
+	return off;
+}
+
+int trace_control_transfer(libusb_device_handle *handle, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+						   unsigned char *data, uint16_t length, unsigned int timeout)
+{
+	if(!trace_f) return usb_io->control_transfer(handle, request_type, request, value, index, data, length, timeout);
+	trace_entry_t e = {.kind = TRACE_CTRL, .request_type = request_type, .request = request, .value = value, .index = index, .length = length};
+	e.offset = request_offset(request_type, request, data, length);
+	e.t0_ns = trace_now();
+	int sts = usb_io->control_transfer(handle, request_type, request, value, index, data, length, timeout);
+	e.t1_ns = trace_now();
+	e.status = sts;
+	trace_record(&e, handle);
+	return sts;
+}
+
+int trace_bulk_transfer(libusb_device_handle *handle, unsigned char ep, unsigned char *data, int length, int *actual, unsigned int timeout)
+{
+	if(!trace_f) return usb_io->bulk_transfer(handle, ep, data, length, actual, timeout);
+	trace_entry_t e = {.kind = TRACE_BULK, .request_type = ep, .length = (uint32_t)length, .offset = UINT32_MAX};
+	e.t0_ns = trace_now();
+	int sts = usb_io->bulk_transfer(handle, ep, data, length, actual, timeout);
+	e.t1_ns = trace_now();
+	e.status = sts < 0 ? sts : *actual;
+	trace_record(&e, handle);
+	return sts;
+}
+
+ssize_t trace_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+	if(!trace_f) return usb_io->get_device_list(ctx, list);
+	trace_entry_t e = {.kind = TRACE_ENUM, .request = TRACE_ENUM_LIST, .offset = UINT32_MAX};
+	e.t0_ns = trace_now();
+	ssize_t cnt = usb_io->get_device_list(ctx, list);
+	e.t1_ns = trace_now();
+	e.status = (int32_t)cnt;
+	trace_record(&e, NULL);
+	return cnt;
+}
+
+int trace_open(libusb_device *dev, libusb_device_handle **handle)
+{
+	if(!trace_f) return usb_io->open(dev, handle);
+	trace_entry_t e = {.kind = TRACE_ENUM, .request = TRACE_ENUM_OPEN, .offset = UINT32_MAX, .dev = dev_id(dev)};
+	e.t0_ns = trace_now();
+	int sts = usb_io->open(dev, handle);
+	e.t1_ns = trace_now();
+	e.status = sts;
+	trace_record(&e, NULL);
+	return sts;
+}
+
+// recorded as the GET_DESCRIPTOR request it ends with (libusb reads the language list first)
+int trace_get_string_descriptor_ascii(libusb_device_handle *handle, uint8_t desc_index, unsigned char *data, int length)
+{
+	if(!trace_f) return usb_io->get_string_descriptor_ascii(handle, desc_index, data, length);
+	trace_entry_t e = {.kind = TRACE_CTRL, .request_type = LIBUSB_ENDPOINT_IN, .request = LIBUSB_REQUEST_GET_DESCRIPTOR,
+					   .value = (uint16_t)(LIBUSB_DT_STRING << 8 | desc_index), .length = (uint32_t)length, .offset = UINT32_MAX};
+	e.t0_ns = trace_now();
+	int sts = usb_io->get_string_descriptor_ascii(handle, desc_index, data, length);
+	e.t1_ns = trace_now();
+	e.status = sts;
+	trace_record(&e, handle);
+	return sts;
+}
+
+// analyzer groups: DFU class requests by direction, then the rest
+enum
+{
+	GRP_STD_DESC = 2 * (DFU_GETCRC + 1),
+	GRP_BULK,
+	GRP_LIST,
+	GRP_OPEN,
+	GRP_OTHER,
+	GRP_COUNT,
+};
+
+static const char *dfu_req_str[] = {"DETACH", "DNLOAD", "UPLOAD", "GETSTATUS", "CLRSTATUS", "GETSTATE", "ABORT", "GETCAPS", "GETCRC"};
+
+static int group_of(const trace_entry_t *e)
+{
+	if(e->kind == TRACE_ENUM) return e->request == TRACE_ENUM_LIST ? GRP_LIST : GRP_OPEN;
+	if(e->kind == TRACE_BULK) return GRP_BULK;
+	if((e->request_type & 0x60) == LIBUSB_REQUEST_TYPE_CLASS && e->request <= DFU_GETCRC)
+		return e->request * 2 + ((e->request_type & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN);
+	if(e->request == LIBUSB_REQUEST_GET_DESCRIPTOR) return GRP_STD_DESC;
+	return GRP_OTHER;
+}
+
+static void group_str(int g, char *s, size_t size)
+{
+	if(g < GRP_STD_DESC) snprintf(s, size, "%s %s", dfu_req_str[g / 2], g & 1 ? "IN" : "OUT");
+	else if(g == GRP_STD_DESC) snprintf(s, size, "GET_DESCRIPTOR");
+	else if(g == GRP_BULK) snprintf(s, size, "BULK IN");
+	else if(g == GRP_LIST) snprintf(s, size, "device list");
+	else if(g == GRP_OPEN) snprintf(s, size, "open");
+	else snprintf(s, size, "other");
+}
+
+// payload bytes the transfer moved: DNLOAD data past the offset, UPLOAD/bulk IN data
+static uint64_t payload_of(const trace_entry_t *e)
+{
+	if(e->status <= 0 || e->kind == TRACE_ENUM) return 0;
+	if(e->kind == TRACE_BULK) return (uint32_t)e->status;
+	if((e->request_type & 0x60) != LIBUSB_REQUEST_TYPE_CLASS) return 0;
+	bool in = (e->request_type & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN;
+	if(!in && e->request == DFU_DNLOAD) return (uint32_t)e->status > DFU_DNLOAD_HDR ? (uint32_t)e->status - DFU_DNLOAD_HDR : 0;
+	if(in && e->request == DFU_UPLOAD) return (uint32_t)e->status;
+	return 0;
+}
+
+static uint32_t ns2us(uint64_t ns) { return ns / 1000 > UINT32_MAX ? UINT32_MAX : (uint32_t)(ns / 1000); }
+
+static int cmp_t0(const void *a, const void *b)
+{
+	const trace_entry_t *x = a, *y = b;
+	if(x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+	if(x->t0_ns != y->t0_ns) return x->t0_ns < y->t0_ns ? -1 : 1;
+	return x->t1_ns < y->t1_ns ? -1 : (x->t1_ns > y->t1_ns);
+}
+
+typedef struct
+{
+	uint16_t dev;
+	uint8_t request;
+	uint32_t offset;
+	uint32_t attempts;
+	uint32_t errors;
+	int last_err;
+} hotspot_t;
+
+static int cmp_offset(const void *a, const void *b)
+{
+	const trace_entry_t *x = a, *y = b;
+	if(x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+	if(x->request != y->request) return x->request < y->request ? -1 : 1;
+	if(x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+	return x->t0_ns < y->t0_ns ? -1 : (x->t0_ns > y->t0_ns);
+}
+
+static int cmp_hotspot(const void *a, const void *b)
+{
+	const hotspot_t *x = a, *y = b;
+	if(x->attempts != y->attempts) return x->attempts > y->attempts ? -1 : 1;
+	if(x->errors != y->errors) return x->errors > y->errors ? -1 : 1;
+	return x->offset < y->offset ? -1 : (x->offset > y->offset);
+}
+
+typedef struct
+{
+	uint64_t ns;
+	uint64_t at;
+	const trace_entry_t *next; // transfer that ended the gap
+} gap_t;
+
+static void print_throughput(const trace_entry_t *e, uint32_t n, uint64_t span_ns, uint32_t bucket_ms)
+{
+	if(!bucket_ms)
+	{
+		bucket_ms = (uint32_t)(span_ns / NSEC_PER_MSEC / 40); // ~40 lines
+		if(bucket_ms == 0) bucket_ms = 1;
+	}
+	uint64_t bucket_ns = (uint64_t)bucket_ms * NSEC_PER_MSEC;
+	uint32_t count = (uint32_t)(span_ns / bucket_ns + 1);
+	uint64_t *bytes = calloc(count, sizeof(uint64_t));
+	if(!bytes) return;
+	uint64_t max = 0, total = 0;
+	for(uint32_t i = 0; i < n; i++)
+	{
+		uint64_t b = payload_of(&e[i]);
+		uint32_t k = (uint32_t)(e[i].t1_ns / bucket_ns);
+		if(k >= count) k = count - 1;
+		bytes[k] += b;
+		total += b;
+		if(bytes[k] > max) max = bytes[k];
+	}
+	printf("\nThroughput, %u ms buckets (%.1f kB payload, %.1f kB/s overall):\n", bucket_ms, total / 1024.0,
+		   span_ns ? total / 1024.0 / ((double)span_ns / NSEC_PER_SEC) : 0.0);
+	for(uint32_t k = 0; k < count; k++)
+	{
+		printf("  %9.3f s %10.1f kB/s |", (double)k * bucket_ms / MSEC_PER_SEC, bytes[k] / 1024.0 / ((double)bucket_ms / MSEC_PER_SEC));
+		for(uint64_t c = max ? bytes[k] * 50 / max : 0; c; c--)
+			putchar('#');
+		putchar('\n');
+	}
+	free(bytes);
+}
+
+static void print_gaps(const trace_entry_t *e, uint32_t n)
+{
+	telem_hist_t h = {0};
+	gap_t top[TRACE_TOP] = {0};
+	uint64_t idle = 0, end = 0;
+	for(uint32_t i = 0; i < n; i++)
+	{
+		if(i == 0 || e[i].dev != e[i - 1].dev) end = e[i].t0_ns; // sorted by device, then start
+		uint64_t gap = e[i].t0_ns > end ? e[i].t0_ns - end : 0;
+		if(e[i].t1_ns > end) end = e[i].t1_ns;
+		telem_hist_add(&h, ns2us(gap));
+		idle += gap;
+		if(gap <= top[TRACE_TOP - 1].ns) continue;
+		int k = TRACE_TOP - 1;
+		for(; k > 0 && top[k - 1].ns < gap; k--)
+			top[k] = top[k - 1];
+		top[k] = (gap_t){.ns = gap, .at = e[i].t0_ns - gap, .next = &e[i]};
+	}
+	printf("\nGaps between transfers (idle bus per device, us): p50 %u, p95 %u, p99 %u, max %u, idle %.3f s total\n",
+		   telem_percentile(&h, 50), telem_percentile(&h, 95), telem_percentile(&h, 99), h.max, (double)idle / NSEC_PER_SEC);
+	for(int k = 0; k < TRACE_TOP && top[k].next; k++)
+	{
+		char name[32];
+		group_str(group_of(top[k].next), name, sizeof(name));
+		printf("  %9.3f s %10u us  dev %u:%u  before %s", (double)top[k].at / NSEC_PER_SEC, ns2us(top[k].ns), top[k].next->dev >> 8,
+			   top[k].next->dev & 0xFF, name);
+		if(top[k].next->offset != UINT32_MAX) printf(" @0x%08x", top[k].next->offset);
+		putchar('\n');
+	}
+}
+
+// offsets requested more than once, in the order of the sent transfers
+static void print_hotspots(trace_entry_t *e, uint32_t n)
+{
+	qsort(e, n, sizeof(trace_entry_t), cmp_offset);
+	hotspot_t *hs = malloc((n ? n : 1) * sizeof(hotspot_t));
+	if(!hs) return;
+	uint32_t count = 0, extra = 0;
+	for(uint32_t i = 0; i < n;)
+	{
+		if(e[i].offset == UINT32_MAX)
+		{
+			i++;
+			continue;
+		}
+		hotspot_t s = {.dev = e[i].dev, .request = e[i].request, .offset = e[i].offset};
+		for(; i < n && e[i].dev == s.dev && e[i].request == s.request && e[i].offset == s.offset; i++)
+		{
+			s.attempts++;
+			if(e[i].status < 0)
+			{
+				s.errors++;
+				s.last_err = e[i].status;
+			}
+		}
+		if(s.attempts > 1 || s.errors)
+		{
+			hs[count++] = s;
+			extra += s.attempts - 1;
+		}
+	}
+	qsort(hs, count, sizeof(hotspot_t), cmp_hotspot);
+	printf("\nRetry hotspots: %u offsets sent more than once or failed, %u extra transfers\n", count, extra);
+	for(uint32_t k = 0; k < count && k < TRACE_TOP; k++)
+	{
+		printf("  dev %u:%u  %-6s @0x%08x  %u attempts, %u errors", hs[k].dev >> 8, hs[k].dev & 0xFF,
+			   hs[k].request <= DFU_GETCRC ? dfu_req_str[hs[k].request] : "?", hs[k].offset, hs[k].attempts, hs[k].errors);
+		if(hs[k].errors) printf(" (last: %s)", libusb_err2str(hs[k].last_err));
+		putchar('\n');
+	}
+	free(hs);
+}
+
+/** \brief Print a summary of a trace: requests, throughput over time, gaps and retries */
+int trace_analyze(const char *file_name, uint32_t bucket_ms)
+{
+	image_t img;
+	if(image_load(&img, file_name))
+	{
+		fprintf(stderr, "error:    can't read trace %s\n", file_name);
+		return -1;
+	}
+	trace_header_t h;
+	if(img.length < sizeof(h) || (memcpy(&h, img.data, sizeof(h)), memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0) ||
+	   h.entry_size != sizeof(trace_entry_t))
+	{
+		fprintf(stderr, "error:    %s is not a trace of this version\n", file_name);
+		image_free(&img);
+		return -1;
+	}
+	uint32_t n = (uint32_t)((img.length - sizeof(h)) / sizeof(trace_entry_t));
+	if((img.length - sizeof(h)) % sizeof(trace_entry_t)) fprintf(stderr, "warn:    trace is truncated, the last entry is dropped\n");
+	trace_entry_t *e = malloc((n ? n : 1) * sizeof(trace_entry_t));
+	if(!e)
+	{
+		fprintf(stderr, "error:    no memory for %u entries\n", n);
+		image_free(&img);
+		return -1;
+	}
+	memcpy(e, &img.data[sizeof(h)], (size_t)n * sizeof(trace_entry_t));
+	image_free(&img);
+	qsort(e, n, sizeof(trace_entry_t), cmp_t0);
+
+	uint64_t span = 0;
+	uint32_t devs = 0;
+	telem_hist_t lat[GRP_COUNT] = {0};
+	uint64_t cnt[GRP_COUNT] = {0}, bytes[GRP_COUNT] = {0};
+	uint32_t errs[GRP_COUNT] = {0};
+	for(uint32_t i = 0; i < n; i++)
+	{
+		if(e[i].t1_ns > span) span = e[i].t1_ns;
+		if(i == 0 || e[i].dev != e[i - 1].dev) devs++;
+		int g = group_of(&e[i]);
+		cnt[g]++;
+		if(e[i].status < 0) errs[g]++;
+		else bytes[g] += e[i].kind == TRACE_ENUM ? 0 : (uint32_t)e[i].status;
+		telem_hist_add(&lat[g], ns2us(e[i].t1_ns - e[i].t0_ns));
+	}
+
+	printf("%u transfers, %.3f s, %u devices (enumeration counts as device 0:0)\n", n, (double)span / NSEC_PER_SEC, devs);
+	printf("\n%-16s %8s %8s %12s %10s %10s %10s\n", "request", "count", "errors", "bytes", "p50 us", "p99 us", "max us");
+	for(int g = 0; g < GRP_COUNT; g++)
+	{
+		if(!cnt[g]) continue;
+		char name[32];
+		group_str(g, name, sizeof(name));
+		printf("%-16s %8llu %8u %12llu %10u %10u %10u\n", name, (unsigned long long)cnt[g], errs[g], (unsigned long long)bytes[g],
+			   telem_percentile(&lat[g], 50), telem_percentile(&lat[g], 99), lat[g].max);
+	}
+
+	if(n)
+	{
+		print_throughput(e, n, span, bucket_ms);
+		print_gaps(e, n);
+		print_hotspots(e, n);
+	}
+	free(e);
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,68 @@
+#ifndef TRACE_H__
+#define TRACE_H__
+
+#include <libusb-1.0/libusb.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Binary trace of every USB request the tool makes: a trace_header_t and
+ * fixed size trace_entry_t records in host byte order, appended as the
+ * requests end (completion order, not submission order)
+ */
+#define TRACE_MAGIC "DFUTRC01"
+
+enum
+{
+	TRACE_CTRL = 0,	  // synchronous control transfer
+	TRACE_CTRL_ASYNC, // queued DNLOAD, t0 is the submission
+	TRACE_BULK,		  // bulk transfer, request_type is the endpoint
+	TRACE_ENUM,		  // enumeration call, request is TRACE_ENUM_*
+};
+
+enum
+{
+	TRACE_ENUM_LIST = 0, // libusb_get_device_list(), status is the device count
+	TRACE_ENUM_OPEN,	 // libusb_open()
+};
+
+typedef struct
+{
+	char magic[8];
+	uint32_t entry_size;
+	uint32_t reserved;
+} trace_header_t;
+
+typedef struct
+{
+	uint64_t t0_ns;	 // since the trace start, CLOCK_MONOTONIC
+	uint64_t t1_ns;	 // end
+	uint32_t length; // wLength / bulk buffer size
+	int32_t status;	 // bytes moved or libusb error
+	uint32_t offset; // DFU offset carried by a DNLOAD/UPLOAD/GETCRC OUT payload, UINT32_MAX - none
+	uint16_t value;
+	uint16_t index;
+	uint16_t dev; // bus << 8 | address
+	uint8_t kind; // TRACE_*
+	uint8_t request_type;
+	uint8_t request;
+	uint8_t reserved[3];
+} trace_entry_t;
+
+int trace_start(const char *file_name);
+void trace_stop(void);
+bool trace_enabled(void);
+uint64_t trace_now(void);
+void trace_record(trace_entry_t *e, libusb_device_handle *handle);
+
+// usb_io calls that are recorded while the trace is on
+int trace_control_transfer(libusb_device_handle *handle, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+						   unsigned char *data, uint16_t length, unsigned int timeout);
+int trace_bulk_transfer(libusb_device_handle *handle, unsigned char ep, unsigned char *data, int length, int *actual, unsigned int timeout);
+ssize_t trace_get_device_list(libusb_context *ctx, libusb_device ***list);
+int trace_open(libusb_device *dev, libusb_device_handle **handle);
+int trace_get_string_descriptor_ascii(libusb_device_handle *handle, uint8_t desc_index, unsigned char *data, int length);
+
+int trace_analyze(const char *file_name, uint32_t bucket_ms);
+
+#endif // TRACE_H__
\ No newline at end of file
@@ -0,0 +1,88 @@
+#include "usb_io.h"
+
+// thin wrappers: libusb declares its API with LIBUSB_CALL and the signatures vary a bit between versions
+
+static int lu_init(void)
+{
+	int sts = libusb_init(NULL);
+	if(sts == 0) libusb_set_option(NULL, LIBUSB_OPTION_LOG_LEVEL, 0);
+	return sts;
+}
+
+static void lu_exit(void) { libusb_exit(NULL); }
+static int lu_has_capability(uint32_t capability) { return libusb_has_capability(capability); }
+
+static ssize_t lu_get_device_list(libusb_context *ctx, libusb_device ***list) { return libusb_get_device_list(ctx, list); }
+static void lu_free_device_list(libusb_device **list, int unref_devices) { libusb_free_device_list(list, unref_devices); }
+static int lu_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc) { return libusb_get_device_descriptor(dev, desc); }
+static int lu_get_active_config_descriptor(libusb_device *dev, struct libusb_config_descriptor **config) { return libusb_get_active_config_descriptor(dev, config); }
+static void lu_free_config_descriptor(struct libusb_config_descriptor *config) { libusb_free_config_descriptor(config); }
+static uint8_t lu_get_bus_number(libusb_device *dev) { return libusb_get_bus_number(dev); }
+static uint8_t lu_get_device_address(libusb_device *dev) { return libusb_get_device_address(dev); }
+static int lu_get_port_numbers(libusb_device *dev, uint8_t *port_numbers, int port_numbers_len) { return libusb_get_port_numbers(dev, port_numbers, port_numbers_len); }
+
+static int lu_open(libusb_device *dev, libusb_device_handle **handle) { return libusb_open(dev, handle); }
+static void lu_close(libusb_device_handle *handle) { libusb_close(handle); }
+static libusb_device *lu_get_device(libusb_device_handle *handle) { return libusb_get_device(handle); }
+static int lu_claim_interface(libusb_device_handle *handle, int interface_number) { return libusb_claim_interface(handle, interface_number); }
+static int lu_release_interface(libusb_device_handle *handle, int interface_number) { return libusb_release_interface(handle, interface_number); }
+static int lu_get_string_descriptor_ascii(libusb_device_handle *handle, uint8_t desc_index, unsigned char *data, int length) { return libusb_get_string_descriptor_ascii(handle, desc_index, data, length); }
+
+static int lu_control_transfer(libusb_device_handle *handle, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+							   unsigned char *data, uint16_t length, unsigned int timeout)
+{
+	return libusb_control_transfer(handle, request_type, request, value, index, data, length, timeout);
+}
+
+static int lu_bulk_transfer(libusb_device_handle *handle, unsigned char endpoint, unsigned char *data, int length, int *actual, unsigned int timeout)
+{
+	return libusb_bulk_transfer(handle, endpoint, data, length, actual, timeout);
+}
+
+static struct libusb_transfer *lu_alloc_transfer(int iso_packets) { return libusb_alloc_transfer(iso_packets); }
+static void lu_free_transfer(struct libusb_transfer *transfer) { libusb_free_transfer(transfer); }
+static int lu_submit_transfer(struct libusb_transfer *transfer) { return libusb_submit_transfer(transfer); }
+static int lu_cancel_transfer(struct libusb_transfer *transfer) { return libusb_cancel_transfer(transfer); }
+static int lu_handle_events_completed(libusb_context *ctx, int *completed) { return libusb_handle_events_completed(ctx, completed); }
+static int lu_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed) { return libusb_handle_events_timeout_completed(ctx, tv, completed); }
+
+static int lu_hotplug_register_callback(libusb_context *ctx, int events, int flags, int vendor_id, int product_id, int dev_class,
+										libusb_hotplug_callback_fn cb_fn, void *user_data, libusb_hotplug_callback_handle *handle)
+{
+	return libusb_hotplug_register_callback(ctx, events, flags, vendor_id, product_id, dev_class, cb_fn, user_data, handle);
+}
+
+static void lu_hotplug_deregister_callback(libusb_context *ctx, libusb_hotplug_callback_handle handle) { libusb_hotplug_deregister_callback(ctx, handle); }
+
+const usb_io_t usb_io_libusb = {
+	.name = "libusb",
+	.init = lu_init,
+	.exit = lu_exit,
+	.has_capability = lu_has_capability,
+	.get_device_list = lu_get_device_list,
+	.free_device_list = lu_free_device_list,
+	.get_device_descriptor = lu_get_device_descriptor,
+	.get_active_config_descriptor = lu_get_active_config_descriptor,
+	.free_config_descriptor = lu_free_config_descriptor,
+	.get_bus_number = lu_get_bus_number,
+	.get_device_address = lu_get_device_address,
+	.get_port_numbers = lu_get_port_numbers,
+	.open = lu_open,
+	.close = lu_close,
+	.get_device = lu_get_device,
+	.claim_interface = lu_claim_interface,
+	.release_interface = lu_release_interface,
+	.get_string_descriptor_ascii = lu_get_string_descriptor_ascii,
+	.control_transfer = lu_control_transfer,
+	.bulk_transfer = lu_bulk_transfer,
+	.alloc_transfer = lu_alloc_transfer,
+	.free_transfer = lu_free_transfer,
+	.submit_transfer = lu_submit_transfer,
+	.cancel_transfer = lu_cancel_transfer,
+	.handle_events_completed = lu_handle_events_completed,
+	.handle_events_timeout_completed = lu_handle_events_timeout_completed,
+	.hotplug_register_callback = lu_hotplug_register_callback,
+	.hotplug_deregister_callback = lu_hotplug_deregister_callback,
+};
+
+const usb_io_t *usb_io = &usb_io_libusb;
\ No newline at end of file
@@ -0,0 +1,55 @@
+#ifndef USB_IO_H__
+#define USB_IO_H__
+
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+
+/**
+ * Transport under the dfu_* helpers: every libusb call the tool makes goes
+ * through `usb_io`, which is libusb itself unless another backend (the
+ * simulated device, see sim.h) is selected before usb_io->init()
+ */
+typedef struct
+{
+	const char *name;
+	int (*init)(void);
+	void (*exit)(void);
+	int (*has_capability)(uint32_t capability);
+
+	ssize_t (*get_device_list)(libusb_context *ctx, libusb_device ***list);
+	void (*free_device_list)(libusb_device **list, int unref_devices);
+	int (*get_device_descriptor)(libusb_device *dev, struct libusb_device_descriptor *desc);
+	int (*get_active_config_descriptor)(libusb_device *dev, struct libusb_config_descriptor **config);
+	void (*free_config_descriptor)(struct libusb_config_descriptor *config);
+	uint8_t (*get_bus_number)(libusb_device *dev);
+	uint8_t (*get_device_address)(libusb_device *dev);
+	int (*get_port_numbers)(libusb_device *dev, uint8_t *port_numbers, int port_numbers_len);
+
+	int (*open)(libusb_device *dev, libusb_device_handle **handle);
+	void (*close)(libusb_device_handle *handle);
+	libusb_device *(*get_device)(libusb_device_handle *handle);
+	int (*claim_interface)(libusb_device_handle *handle, int interface_number);
+	int (*release_interface)(libusb_device_handle *handle, int interface_number);
+	int (*get_string_descriptor_ascii)(libusb_device_handle *handle, uint8_t desc_index, unsigned char *data, int length);
+
+	int (*control_transfer)(libusb_device_handle *handle, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+							unsigned char *data, uint16_t length, unsigned int timeout);
+	int (*bulk_transfer)(libusb_device_handle *handle, unsigned char endpoint, unsigned char *data, int length, int *actual, unsigned int timeout);
+
+	// asynchronous control transfers, filled with libusb_fill_control_*()
+	struct libusb_transfer *(*alloc_transfer)(int iso_packets);
+	void (*free_transfer)(struct libusb_transfer *transfer);
+	int (*submit_transfer)(struct libusb_transfer *transfer);
+	int (*cancel_transfer)(struct libusb_transfer *transfer);
+	int (*handle_events_completed)(libusb_context *ctx, int *completed);
+	int (*handle_events_timeout_completed)(libusb_context *ctx, struct timeval *tv, int *completed);
+
+	int (*hotplug_register_callback)(libusb_context *ctx, int events, int flags, int vendor_id, int product_id, int dev_class,
+									 libusb_hotplug_callback_fn cb_fn, void *user_data, libusb_hotplug_callback_handle *handle);
+	void (*hotplug_deregister_callback)(libusb_context *ctx, libusb_hotplug_callback_handle handle);
+} usb_io_t;
+
+extern const usb_io_t usb_io_libusb;
+extern const usb_io_t *usb_io;
+
+#endif // USB_IO_H__
\ No newline at end of file